@@ -0,0 +1,174 @@
+/*
+ * accounting.c
+ *
+ *
+ * What a session costs us, in CPU time and in I/O calls, the reads, writes
+ * and sendfiles it makes on the connection. Other system calls, signals,
+ * timers and the like, are not counted. Each session adds itself to shared
+ * histograms when it exits, split by phase and by client fingerprint, and
+ * whoever reports reads the percentiles back out of them.
+ * This is the number that tells us how many sessions a machine can take.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+
+#include "accounting.h"
+
+/*
+ * Log-linear buckets: exact below 8, then four per power of two, so that
+ * any percentile we report is within 25% of the truth.
+ */
+#define BUCKETS		160
+
+struct histogram {
+	unsigned long long count;
+	unsigned long long bucket[BUCKETS];
+};
+
+struct account {
+	struct histogram cpu_us[PHASE_COUNT];
+	struct histogram io_calls[PHASE_COUNT];
+	unsigned long long reads, writes, flushes;
+};
+
+static struct account *accounts = 0;
+
+static const char *phase_names[PHASE_COUNT] = { "negotiate", "login", "total" };
+static const char *fingerprint_names[FINGERPRINT_COUNT] = { "raw", "ansi", "xterm", "vt", "linux", "other" };
+
+/*
+ * Maps the histograms before forking, like the stats shards. Sessions
+ * write to them from behind seccomp, so it has to be plain memory.
+ */
+int accounting_init(void)
+{
+	void *map;
+
+	map = mmap(NULL, FINGERPRINT_COUNT * sizeof(struct account), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	accounts = map;
+	return 0;
+}
+
+int accounting_enabled(void)
+{
+	return accounts != 0;
+}
+
+enum fingerprint accounting_fingerprint(int is_telnet_client, const char *term)
+{
+	if (!is_telnet_client)
+		return FINGERPRINT_RAW;
+	if (!strncasecmp(term, "ansi", 4))
+		return FINGERPRINT_ANSI;
+	if (!strncasecmp(term, "xterm", 5))
+		return FINGERPRINT_XTERM;
+	if (!strncasecmp(term, "vt", 2))
+		return FINGERPRINT_VT;
+	if (!strncasecmp(term, "linux", 5))
+		return FINGERPRINT_LINUX;
+	return FINGERPRINT_OTHER;
+}
+
+const char *accounting_fingerprint_name(enum fingerprint fingerprint)
+{
+	return fingerprint_names[fingerprint];
+}
+
+static int bucket_of(unsigned long long value)
+{
+	int msb, bucket;
+
+	if (value < 8)
+		return value;
+	msb = 63 - __builtin_clzll(value);
+	bucket = (msb - 1) * 4 + ((value >> (msb - 2)) & 3);
+	return bucket < BUCKETS ? bucket : BUCKETS - 1;
+}
+
+/*
+ * The smallest value that falls into the bucket.
+ */
+static unsigned long long bucket_floor(int bucket)
+{
+	if (bucket < 8)
+		return bucket;
+	return (4ULL + bucket % 4) << (bucket / 4 - 1);
+}
+
+static void histogram_add(struct histogram *histogram, unsigned long long value)
+{
+	__atomic_fetch_add(&histogram->bucket[bucket_of(value)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+}
+
+static unsigned long long histogram_percentile(const struct histogram *histogram, unsigned long long count, int percent)
+{
+	unsigned long long seen = 0, rank = (count * percent + 99) / 100;
+	int i;
+
+	for (i = 0; i < BUCKETS; ++i) {
+		seen += __atomic_load_n(&histogram->bucket[i], __ATOMIC_RELAXED);
+		if (seen >= rank)
+			return bucket_floor(i);
+	}
+	return bucket_floor(BUCKETS - 1);
+}
+
+/*
+ * Called by the session on its way out, possibly from a signal handler.
+ */
+void accounting_record(enum fingerprint fingerprint, enum account_phase phase, unsigned long long cpu_us, unsigned long long io_calls)
+{
+	histogram_add(&accounts[fingerprint].cpu_us[phase], cpu_us);
+	histogram_add(&accounts[fingerprint].io_calls[phase], io_calls);
+}
+
+void accounting_count_io(enum fingerprint fingerprint, unsigned long long reads, unsigned long long writes, unsigned long long flushes)
+{
+	__atomic_fetch_add(&accounts[fingerprint].reads, reads, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&accounts[fingerprint].writes, writes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&accounts[fingerprint].flushes, flushes, __ATOMIC_RELAXED);
+}
+
+/*
+ * Prints the p50 and p99 of every phase of every fingerprint we have seen.
+ */
+void accounting_report(void)
+{
+	const struct account *account;
+	unsigned long long count, sessions;
+	int fingerprint, phase;
+
+	if (!accounts)
+		return;
+	for (fingerprint = 0; fingerprint < FINGERPRINT_COUNT; ++fingerprint) {
+		account = &accounts[fingerprint];
+		sessions = __atomic_load_n(&account->cpu_us[PHASE_TOTAL].count, __ATOMIC_RELAXED);
+		if (!sessions)
+			continue;
+		printf("Accounting: %s: %llu sessions, %.1f reads, %.1f writes and %.1f flushes per session.\n",
+			fingerprint_names[fingerprint], sessions,
+			(double)__atomic_load_n(&account->reads, __ATOMIC_RELAXED) / sessions,
+			(double)__atomic_load_n(&account->writes, __ATOMIC_RELAXED) / sessions,
+			(double)__atomic_load_n(&account->flushes, __ATOMIC_RELAXED) / sessions);
+		for (phase = 0; phase < PHASE_COUNT; ++phase) {
+			count = __atomic_load_n(&account->cpu_us[phase].count, __ATOMIC_RELAXED);
+			if (!count)
+				continue;
+			printf("Accounting: %s %s: %llu sessions, CPU p50 %llu us, p99 %llu us, I/O calls p50 %llu, p99 %llu.\n",
+				fingerprint_names[fingerprint], phase_names[phase], count,
+				histogram_percentile(&account->cpu_us[phase], count, 50),
+				histogram_percentile(&account->cpu_us[phase], count, 99),
+				histogram_percentile(&account->io_calls[phase], count, 50),
+				histogram_percentile(&account->io_calls[phase], count, 99));
+		}
+	}
+}
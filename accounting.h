@@ -0,0 +1,33 @@
+#ifndef ACCOUNTING_H
+#define ACCOUNTING_H
+
+enum account_phase {
+	PHASE_NEGOTIATE,	/* from the fork until the telnet options are settled */
+	PHASE_LOGIN,		/* everything after that */
+	PHASE_TOTAL,
+	PHASE_COUNT
+};
+
+/*
+ * A rough fingerprint of the client, from what it told us during
+ * negotiation. Most bots are one of a handful of terminal types.
+ */
+enum fingerprint {
+	FINGERPRINT_RAW,	/* never negotiated, not a telnet client */
+	FINGERPRINT_ANSI,
+	FINGERPRINT_XTERM,
+	FINGERPRINT_VT,
+	FINGERPRINT_LINUX,
+	FINGERPRINT_OTHER,
+	FINGERPRINT_COUNT
+};
+
+int accounting_init(void);
+int accounting_enabled(void);
+enum fingerprint accounting_fingerprint(int is_telnet_client, const char *term);
+const char *accounting_fingerprint_name(enum fingerprint fingerprint);
+void accounting_record(enum fingerprint fingerprint, enum account_phase phase, unsigned long long cpu_us, unsigned long long io_calls);
+void accounting_count_io(enum fingerprint fingerprint, unsigned long long reads, unsigned long long writes, unsigned long long flushes);
+void accounting_report(void);
+
+#endif
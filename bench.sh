@@ -0,0 +1,23 @@
+#!/bin/sh
+#
+# Runs the bot session benchmark against a honeypot binary on loopback, and
+# prints the session rate along with the CPU time spent per session.
+#
+# Usage: ./bench.sh ./honeypot [HONEYBENCH OPTION]...
+#
+
+set -e
+
+binary="$1"
+shift
+port="${PORT:-2323}"
+log="$(mktemp)"
+
+"$binary" --port="$port" --stats-interval=0 --debug-log="$log" &
+pid=$!
+sleep 1
+./honeybench --port="$port" --sessions "$@" | grep -E "^(completed|sessions/s):"
+kill -TERM $pid
+wait $pid || true
+grep "^Served" "$log" || true
+rm -f "$log"
@@ -0,0 +1,352 @@
+/*
+ * config.c
+ *
+ *
+ * Reads the config file, and reads it again on SIGHUP, so that timeouts,
+ * limits and the like can change without a restart that would cut off
+ * every session. The file is made of lines like these, where # starts a
+ * comment and timeouts take the value for when we are idle first and
+ * the one for when we are about to hit a limit second:
+ *
+ *     negotiate-timeout 15 3	# seconds to come up with a terminal type
+ *     session-timeout 120 20	# seconds for the whole login
+ *     negotiate-idle 10 2	# seconds without input while negotiating
+ *     login-idle 60 10		# and while logging in
+ *     reply-delay 2000 0	# ms before we reject a password
+ *     retry-delay 3000 0	# ms before we ask again
+ *     persona zx2c4.com	# the name the console goes by, one word
+ *     heavy-threshold 16	# connections in ten minutes that make a source heavy
+ *     heavy-penalty 50		# percent of load added to heavy sources' sessions
+ *     park-seconds 30		# how long parked connections are held
+ *     sample 16		# log 1 in 16 repeats, overriding --sample
+ *     ignore 192.0.2.0/24	# hang up on these, as often as needed
+ *
+ * We are chrooted and running as nobody by the time a reload comes, so
+ * the directory of the file is opened beforehand and the file is opened
+ * relative to it; it has to be readable by nobody. Editors that replace
+ * the file are fine, since we go by name within the directory.
+ *
+ * A reload builds a whole new config and publishes it with one atomic
+ * pointer store. Nothing is ever changed in place: sessions copy what they
+ * need when they are forked, and whatever still holds the old config in
+ * the listener has until the next reload before it is freed.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "config.h"
+
+/* What we use without a config file, or for what it leaves out. */
+static const struct config defaults = {
+	.relaxed = {
+		.negotiate = { .idle = 10, .keepalive_idle = 3, .keepalive_interval = 2, .keepalive_count = 2, .user_timeout = 5000 },
+		.login = { .idle = 60, .keepalive_idle = 10, .keepalive_interval = 5, .keepalive_count = 3, .user_timeout = 10000 },
+		.negotiate_timeout = 15,
+		.session_timeout = 120,
+		.reply_delay = 2000,
+		.retry_delay = 3000
+	},
+	.tight = {
+		.negotiate = { .idle = 2, .keepalive_idle = 1, .keepalive_interval = 1, .keepalive_count = 2, .user_timeout = 1000 },
+		.login = { .idle = 10, .keepalive_idle = 2, .keepalive_interval = 1, .keepalive_count = 2, .user_timeout = 2000 },
+		.negotiate_timeout = 3,
+		.session_timeout = 20,
+		.reply_delay = 0,
+		.retry_delay = 0
+	},
+	.persona = "zx2c4.com",
+	.heavy_threshold = 16,
+	.heavy_penalty = 50,
+	.park_seconds = 30,
+	.sample = 0,
+	.ignore_count = 0
+};
+
+/* Keys that take a value for the relaxed and one for the tight policy. */
+static const struct {
+	const char *name;
+	size_t relaxed, tight;
+	int min;
+} policy_keys[] = {
+	{ "negotiate-timeout", offsetof(struct config, relaxed.negotiate_timeout), offsetof(struct config, tight.negotiate_timeout), 1 },
+	{ "session-timeout", offsetof(struct config, relaxed.session_timeout), offsetof(struct config, tight.session_timeout), 1 },
+	{ "negotiate-idle", offsetof(struct config, relaxed.negotiate.idle), offsetof(struct config, tight.negotiate.idle), 1 },
+	{ "login-idle", offsetof(struct config, relaxed.login.idle), offsetof(struct config, tight.login.idle), 1 },
+	{ "reply-delay", offsetof(struct config, relaxed.reply_delay), offsetof(struct config, tight.reply_delay), 0 },
+	{ "retry-delay", offsetof(struct config, relaxed.retry_delay), offsetof(struct config, tight.retry_delay), 0 }
+};
+
+static const struct {
+	const char *name;
+	size_t offset;
+	int min, max;
+} number_keys[] = {
+	{ "heavy-threshold", offsetof(struct config, heavy_threshold), 1, 1000000 },
+	{ "heavy-penalty", offsetof(struct config, heavy_penalty), 0, 100 },
+	{ "park-seconds", offsetof(struct config, park_seconds), 1, 3600 },
+	{ "sample", offsetof(struct config, sample), 1, 1000000 }
+};
+
+static const struct config *current = &defaults;
+static struct config *retired = 0;
+static int directory_fd = -1;
+static char *file_name = 0, *file_path = 0;
+
+static int parse_number(const char *arg, int min, int max, int *value)
+{
+	char *end;
+	long parsed;
+
+	if (!arg)
+		return -1;
+	parsed = strtol(arg, &end, 10);
+	if (*end || end == arg || parsed < min || parsed > max)
+		return -1;
+	*value = parsed;
+	return 0;
+}
+
+static int parse_cidr(const char *arg, struct cidr *cidr)
+{
+	char address[INET6_ADDRSTRLEN];
+	const char *slash;
+	size_t len;
+
+	if (!arg)
+		return -1;
+	slash = strchr(arg, '/');
+	len = slash ? (size_t)(slash - arg) : strlen(arg);
+	if (len >= sizeof(address))
+		return -1;
+	memcpy(address, arg, len);
+	address[len] = 0;
+	if (inet_pton(AF_INET, address, cidr->address) == 1)
+		cidr->family = AF_INET;
+	else if (inet_pton(AF_INET6, address, cidr->address) == 1)
+		cidr->family = AF_INET6;
+	else
+		return -1;
+	if (!slash) {
+		cidr->bits = cidr->family == AF_INET ? 32 : 128;
+		return 0;
+	}
+	return parse_number(slash + 1, 0, cidr->family == AF_INET ? 32 : 128, &cidr->bits);
+}
+
+/*
+ * Applies one line to the config. Returns what is wrong with it, if
+ * anything.
+ */
+static const char *parse_line(struct config *config, char *line)
+{
+	char *key, *first, *second, *saveptr;
+	size_t i;
+
+	key = strtok_r(line, " \t\r\n", &saveptr);
+	if (!key)
+		return 0;
+	first = strtok_r(NULL, " \t\r\n", &saveptr);
+	second = strtok_r(NULL, " \t\r\n", &saveptr);
+	for (i = 0; i < sizeof(policy_keys) / sizeof(policy_keys[0]); ++i) {
+		if (strcmp(key, policy_keys[i].name))
+			continue;
+		if (parse_number(first, policy_keys[i].min, 86400000, (int *)((char *)config + policy_keys[i].relaxed)) < 0
+				|| parse_number(second, policy_keys[i].min, 86400000, (int *)((char *)config + policy_keys[i].tight)) < 0)
+			return "expected the relaxed and the tight value";
+		return strtok_r(NULL, " \t\r\n", &saveptr) ? "too many values" : 0;
+	}
+	if (second)
+		return "too many values";
+	for (i = 0; i < sizeof(number_keys) / sizeof(number_keys[0]); ++i) {
+		if (strcmp(key, number_keys[i].name))
+			continue;
+		if (parse_number(first, number_keys[i].min, number_keys[i].max, (int *)((char *)config + number_keys[i].offset)) < 0)
+			return "invalid number";
+		return 0;
+	}
+	if (!strcmp(key, "persona")) {
+		if (!first || strlen(first) >= sizeof(config->persona))
+			return "expected a name of up to 63 characters";
+		/* It ends up on the screens, so no escape sequences. */
+		for (i = 0; first[i]; ++i) {
+			if (!isgraph((unsigned char)first[i]))
+				return "the name may only have printable characters";
+		}
+		strcpy(config->persona, first);
+		return 0;
+	}
+	if (!strcmp(key, "ignore")) {
+		if (config->ignore_count == CONFIG_IGNORE_MAX)
+			return "too many prefixes to ignore";
+		if (parse_cidr(first, &config->ignore[config->ignore_count]) < 0)
+			return "expected an address or a prefix";
+		++config->ignore_count;
+		return 0;
+	}
+	return "unknown setting";
+}
+
+/*
+ * Reads the whole file into a new config, starting from the defaults.
+ */
+static struct config *parse_file(void)
+{
+	struct config *config;
+	char line[512], *comment;
+	const char *error;
+	FILE *file;
+	int fd, line_number = 0;
+
+	fd = openat(directory_fd, file_name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror("openat");
+		return 0;
+	}
+	file = fdopen(fd, "r");
+	if (!file) {
+		perror("fdopen");
+		close(fd);
+		return 0;
+	}
+	config = malloc(sizeof(*config));
+	if (!config) {
+		perror("malloc");
+		fclose(file);
+		return 0;
+	}
+	*config = defaults;
+	while (fgets(line, sizeof(line), file)) {
+		++line_number;
+		comment = strchr(line, '#');
+		if (comment)
+			*comment = 0;
+		error = parse_line(config, line);
+		if (error) {
+			fprintf(stderr, "%s:%d: %s.\n", file_path, line_number, error);
+			free(config);
+			fclose(file);
+			return 0;
+		}
+	}
+	fclose(file);
+	return config;
+}
+
+/*
+ * Opens the directory of the config file while we can still see it, and
+ * loads the config for the first time.
+ */
+int config_open(const char *path)
+{
+	char *directory_copy, *name_copy;
+
+	directory_copy = strdup(path);
+	name_copy = strdup(path);
+	if (!directory_copy || !name_copy) {
+		perror("strdup");
+		return -1;
+	}
+	directory_fd = open(dirname(directory_copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (directory_fd < 0) {
+		perror("open");
+		return -1;
+	}
+	file_name = strdup(basename(name_copy));
+	file_path = strdup(path);
+	free(directory_copy);
+	free(name_copy);
+	if (!file_name || !file_path) {
+		perror("strdup");
+		return -1;
+	}
+	return config_reload();
+}
+
+/*
+ * Loads the config file again and publishes it. If the file does not
+ * parse, we say why and keep going with what we had.
+ */
+int config_reload(void)
+{
+	struct config *config;
+
+	if (directory_fd < 0)
+		return -1;
+	config = parse_file();
+	if (!config) {
+		fprintf(stderr, "Keeping the current config.\n");
+		return -1;
+	}
+	/* It has been out of use since the last reload. */
+	free(retired);
+	retired = current == &defaults ? 0 : (struct config *)current;
+	__atomic_store_n(&current, config, __ATOMIC_RELEASE);
+	printf("Loaded config from %s: persona %s, %d prefixes ignored.\n", file_path, config->persona, config->ignore_count);
+	return 0;
+}
+
+/*
+ * Lets go of the directory, which is outside the chroot. Sessions call
+ * this right after the fork, as they never reload, and must not be able
+ * to reach anything through it.
+ */
+void config_close(void)
+{
+	if (directory_fd >= 0)
+		close(directory_fd);
+	directory_fd = -1;
+}
+
+const struct config *config_get(void)
+{
+	return __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Whether the connection comes from a prefix we were told to ignore. The
+ * list is meant for a handful of our own scanners and monitors, so it is
+ * just walked.
+ */
+int config_ignored(const struct sockaddr_storage *addr)
+{
+	const struct config *config = config_get();
+	const unsigned char *address;
+	const struct cidr *cidr;
+	int family, i, bytes, bits;
+
+	if (!config->ignore_count)
+		return 0;
+	if (addr->ss_family == AF_INET) {
+		family = AF_INET;
+		address = (const unsigned char *)&((const struct sockaddr_in *)addr)->sin_addr;
+	} else if (IN6_IS_ADDR_V4MAPPED(&((const struct sockaddr_in6 *)addr)->sin6_addr)) {
+		family = AF_INET;
+		address = ((const struct sockaddr_in6 *)addr)->sin6_addr.s6_addr + 12;
+	} else {
+		family = AF_INET6;
+		address = ((const struct sockaddr_in6 *)addr)->sin6_addr.s6_addr;
+	}
+	for (i = 0; i < config->ignore_count; ++i) {
+		cidr = &config->ignore[i];
+		if (cidr->family != family)
+			continue;
+		bytes = cidr->bits / 8;
+		bits = cidr->bits % 8;
+		if (memcmp(address, cidr->address, bytes))
+			continue;
+		if (!bits || !((address[bytes] ^ cidr->address[bytes]) & (0xff << (8 - bits))))
+			return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <sys/socket.h>
+
+#include "telnet_srv.h"
+
+#define CONFIG_IGNORE_MAX	256
+
+struct cidr {
+	int family;
+	unsigned char address[16];
+	int bits;
+};
+
+/*
+ * Everything that --config can change without a restart. A loaded config
+ * is never changed; a reload publishes a new one in its place.
+ */
+struct config {
+	struct session_policy relaxed;	/* what sessions get when we are idle */
+	struct session_policy tight;	/* and when we are about to hit a limit */
+	char persona[64];		/* the name the console goes by */
+	int heavy_threshold;		/* connections in a generation that make a source heavy */
+	int heavy_penalty;		/* load added to the sessions of heavy sources */
+	int park_seconds;		/* how long parked connections are held */
+	int sample;			/* 1 in N repeats logged, 0 to leave it to --sample */
+	int ignore_count;
+	struct cidr ignore[CONFIG_IGNORE_MAX];	/* hung up on, without a session or a record */
+};
+
+int config_open(const char *path);
+int config_reload(void);
+void config_close(void);
+const struct config *config_get(void);
+int config_ignored(const struct sockaddr_storage *addr);
+
+#endif
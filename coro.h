@@ -0,0 +1,59 @@
+#ifndef CORO_H
+#define CORO_H
+
+/*
+ * Stackless coroutines, so that session logic can read top to bottom
+ * (say the banner, await a line, await a delay, say no, start over) and
+ * still run as a few hundred bytes of state in an event loop instead of
+ * as a process. A coroutine is a function of its state, which holds a
+ * struct coro, and every call picks up where the last one left off:
+ *
+ *     static int script(struct script *s)
+ *     {
+ *         CORO_BEGIN(&s->coro);
+ *         say(s, "login: ");
+ *         CORO_AWAIT(&s->coro, next_line(s), CORO_WANT_READ);
+ *         ...
+ *         CORO_END(&s->coro);
+ *     }
+ *
+ * Locals do not survive a yield; whatever has to goes in the state. The
+ * place to resume is kept as the distance between two label addresses, a
+ * GCC extension, so unlike with Duff's device the body may use switch
+ * statements of its own. There
+ * is no stack to suspend on, so every yield has to be in the coroutine
+ * itself, not in something it calls.
+ */
+struct coro {
+	int resume;		/* where to pick up, as an offset from the top */
+};
+
+/* What a coroutine returns: done, or what it waits on before it can go on. */
+enum coro_status {
+	CORO_DONE,
+	CORO_WANT_READ,		/* input on its descriptor */
+	CORO_WANT_TIMER		/* a deadline it keeps in its state */
+};
+
+#define CORO_CONCAT_(a, b)	a##b
+#define CORO_CONCAT(a, b)	CORO_CONCAT_(a, b)
+#define CORO_LABEL		CORO_CONCAT(coro_resume_, __LINE__)
+
+/* Offsets rather than label addresses, which would outlive the call they were taken in. */
+#define CORO_HERE		((char *)&&CORO_LABEL - (char *)&&coro_top)
+
+#define CORO_INIT(c)		((c)->resume = 0)
+
+#define CORO_BEGIN(c)		do { if ((c)->resume) goto *(&&coro_top + (c)->resume); coro_top:; } while (0)
+
+/* Returns status, and goes on from here next time. */
+#define CORO_YIELD(c, status)	do { (c)->resume = CORO_HERE; return (status); CORO_LABEL:; } while (0)
+
+/* Returns status for as long as condition does not hold, checking it again every time. */
+#define CORO_AWAIT(c, condition, status)	\
+	do { (c)->resume = CORO_HERE; CORO_LABEL: if (!(condition)) return (status); } while (0)
+
+/* Done, now and on every call after. */
+#define CORO_END(c)		do { (c)->resume = CORO_HERE; CORO_LABEL: return CORO_DONE; } while (0)
+
+#endif
@@ -0,0 +1,183 @@
+/*
+ * credindex.c
+ *
+ *
+ * Keeps an index of every password we have collected: when we first and
+ * last saw it, how often, and a few of the sources that tried it, so that
+ * "have we seen this password, and from where" is a lookup and not a scan
+ * of the log. The index is a shared file mapping updated by the sessions
+ * themselves, with atomics and no system calls.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "credindex.h"
+
+static struct credindex_header *index_header = 0;
+
+/*
+ * Gives up on claims left behind by sessions that died halfway through
+ * one, and counts the entries that are in use again, since those
+ * sessions may or may not have counted theirs.
+ */
+static void credindex_recover(void)
+{
+	struct credindex_entry *entry;
+	uint64_t i, used = 0, dead = 0;
+
+	for (i = 0; i < index_header->entry_count; ++i) {
+		entry = &credindex_entries(index_header)[i];
+		if (entry->hash & CREDINDEX_BUSY && entry->hash != CREDINDEX_DEAD) {
+			entry->hash = CREDINDEX_DEAD;
+			++dead;
+		}
+		if (entry->hash && entry->hash != CREDINDEX_DEAD)
+			++used;
+	}
+	index_header->used = used;
+	if (dead)
+		printf("Credential index: %llu entries were left half written, skipping them.\n", (unsigned long long)dead);
+}
+
+/*
+ * Maps the index file before the chroot, creating it or starting it over
+ * if it does not have the layout we want.
+ */
+int credindex_open(const char *path, uint64_t entries)
+{
+	size_t size = sizeof(struct credindex_header) + entries * CREDINDEX_ENTRY_SIZE;
+	struct stat sbuf;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+	if (fstat(fd, &sbuf) < 0) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+	if ((size_t)sbuf.st_size != size && ftruncate(fd, size) < 0) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	index_header = map;
+	if ((size_t)sbuf.st_size == size && index_header->magic == CREDINDEX_MAGIC && index_header->version == CREDINDEX_VERSION &&
+	    index_header->entry_size == CREDINDEX_ENTRY_SIZE && index_header->entry_count == entries) {
+		credindex_recover();
+		printf("Credential index has %llu passwords.\n", (unsigned long long)index_header->used);
+		return 0;
+	}
+	if (sbuf.st_size)
+		fprintf(stderr, "Warning: %s is not an index of %llu entries, starting it over.\n", path, (unsigned long long)entries);
+	memset(map, 0, size);
+	index_header->version = CREDINDEX_VERSION;
+	index_header->entry_size = CREDINDEX_ENTRY_SIZE;
+	index_header->entry_count = entries;
+	__atomic_store_n(&index_header->magic, CREDINDEX_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Finds the entry for a password, claiming a free one if it is new. The
+ * session timeout and shutdown end a session from a signal handler, so
+ * they are held off while a claim is open, or it would stay open for good.
+ */
+static struct credindex_entry *find_or_claim(const char *password, size_t len, uint64_t now)
+{
+	uint64_t hash = credindex_hash(password, len), seen, probe;
+	struct credindex_entry *entry;
+	sigset_t block, saved;
+	int spins;
+
+	sigemptyset(&block);
+	sigaddset(&block, SIGALRM);
+	sigaddset(&block, SIGINT);
+	for (probe = 0; probe < CREDINDEX_MAX_PROBES; ++probe) {
+		entry = &credindex_entries(index_header)[(hash + probe) % index_header->entry_count];
+		seen = __atomic_load_n(&entry->hash, __ATOMIC_ACQUIRE);
+		if (!seen) {
+			sigprocmask(SIG_BLOCK, &block, &saved);
+			if (__atomic_compare_exchange_n(&entry->hash, &seen, hash | CREDINDEX_BUSY, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+				entry->password_len = len < sizeof(entry->password) ? len : sizeof(entry->password);
+				memcpy(entry->password, password, entry->password_len);
+				entry->first_seen = now;
+				__atomic_fetch_add(&index_header->used, 1, __ATOMIC_RELAXED);
+				__atomic_store_n(&entry->hash, hash, __ATOMIC_RELEASE);
+				sigprocmask(SIG_SETMASK, &saved, NULL);
+				return entry;
+			}
+			sigprocmask(SIG_SETMASK, &saved, NULL);
+		}
+		/* Taken, maybe just now, in which case seen is what they put there.
+		 * If another session is still writing this key, it takes nanoseconds;
+		 * if it is taking much longer than that, that session is gone, and
+		 * the entry is as good as taken by another key. */
+		for (spins = 0; seen == (hash | CREDINDEX_BUSY) && spins < CREDINDEX_SPIN_MAX; ++spins)
+			seen = __atomic_load_n(&entry->hash, __ATOMIC_ACQUIRE);
+		if (seen == hash && credindex_matches(entry, password, len))
+			return entry;
+	}
+	__atomic_fetch_add(&index_header->full, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/*
+ * Adds the source to the sample, unless it is already in there.
+ */
+static void add_source(struct credindex_entry *entry, const char *ipaddr)
+{
+	unsigned char address[16] = { [10] = 0xff, [11] = 0xff };
+	uint32_t i, count;
+
+	if (inet_pton(AF_INET6, ipaddr, address) != 1 && inet_pton(AF_INET, ipaddr, address + 12) != 1)
+		return;
+	count = __atomic_load_n(&entry->source_count, __ATOMIC_RELAXED);
+	for (i = 0; i < count && i < CREDINDEX_SOURCES; ++i) {
+		if (!memcmp(entry->sources[i], address, sizeof(address)))
+			return;
+	}
+	i = __atomic_fetch_add(&entry->source_count, 1, __ATOMIC_RELAXED);
+	if (i < CREDINDEX_SOURCES)
+		memcpy(entry->sources[i], address, sizeof(address));
+}
+
+/*
+ * Called by the sessions as they log a password.
+ */
+void credindex_update(const char *password, const char *ipaddr)
+{
+	struct credindex_entry *entry;
+	uint64_t now, last;
+
+	if (!index_header)
+		return;
+	now = time(NULL);
+	entry = find_or_claim(password, strlen(password), now);
+	if (!entry)
+		return;
+	__atomic_fetch_add(&entry->count, 1, __ATOMIC_RELAXED);
+	last = __atomic_load_n(&entry->last_seen, __ATOMIC_RELAXED);
+	while (last < now && !__atomic_compare_exchange_n(&entry->last_seen, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	add_source(entry, ipaddr);
+}
@@ -0,0 +1,94 @@
+#ifndef CREDINDEX_H
+#define CREDINDEX_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "hash.h"
+
+/*
+ * The on-disk layout of the credential index, shared by the honeypot,
+ * which keeps it up to date, and honeyquery, which reads it. The file is
+ * a header followed by an open addressing hash table of entries keyed on
+ * the password, all CREDINDEX_ENTRY_SIZE bytes. Entries are never removed;
+ * once the table is full, passwords we have not seen yet are not indexed.
+ *
+ * An entry is claimed by swapping its hash in with CREDINDEX_BUSY set,
+ * and published by clearing that bit once the key is written. A claim
+ * that was never published, by a session that died in between, is
+ * turned into CREDINDEX_DEAD when the index is next opened: taken, but
+ * never matching, so that probing goes on past it as before.
+ */
+#define CREDINDEX_MAGIC		0x58444e4944455243ULL	/* "CREDINDX" */
+#define CREDINDEX_VERSION	1
+#define CREDINDEX_ENTRY_SIZE	256
+#define CREDINDEX_DEFAULT_ENTRIES	65536
+#define CREDINDEX_MAX_PROBES	64
+#define CREDINDEX_SOURCES	8
+#define CREDINDEX_BUSY		(1ULL << 63)
+#define CREDINDEX_DEAD		CREDINDEX_BUSY	/* no hash, which is never 0 */
+#define CREDINDEX_SPIN_MAX	100000	/* loads before a claim counts as abandoned */
+
+struct credindex_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t entry_size;
+	uint64_t entry_count;
+	uint64_t used;
+	uint64_t full;		/* passwords that found no free entry */
+	char padding[CREDINDEX_ENTRY_SIZE - 40];
+};
+
+struct credindex_entry {
+	uint64_t hash;		/* 0 while free */
+	uint64_t first_seen;	/* seconds since the epoch */
+	uint64_t last_seen;
+	uint64_t count;
+	uint32_t source_count;	/* distinct sources offered to the sample, which keeps the first few */
+	uint16_t password_len;
+	char password[90];	/* cut short if it is longer */
+	unsigned char sources[CREDINDEX_SOURCES][16];	/* IPv4 as v4-mapped IPv6 */
+};
+
+static inline uint64_t credindex_hash(const char *password, size_t len)
+{
+	uint64_t hash = hash_bytes(password, len) & ~CREDINDEX_BUSY;
+
+	return hash ? hash : 1;
+}
+
+static inline struct credindex_entry *credindex_entries(struct credindex_header *header)
+{
+	return (struct credindex_entry *)(header + 1);
+}
+
+static inline int credindex_matches(const struct credindex_entry *entry, const char *password, size_t len)
+{
+	size_t stored = len < sizeof(entry->password) ? len : sizeof(entry->password);
+
+	return entry->password_len == stored && !memcmp(entry->password, password, stored);
+}
+
+/*
+ * Finds the entry for a password, or returns NULL if it was never seen.
+ */
+static inline struct credindex_entry *credindex_find(struct credindex_header *header, const char *password, size_t len)
+{
+	uint64_t hash = credindex_hash(password, len), seen, probe;
+	struct credindex_entry *entry;
+
+	for (probe = 0; probe < CREDINDEX_MAX_PROBES; ++probe) {
+		entry = &credindex_entries(header)[(hash + probe) % header->entry_count];
+		seen = __atomic_load_n(&entry->hash, __ATOMIC_ACQUIRE);
+		if (!seen)
+			return NULL;
+		if (seen == hash && credindex_matches(entry, password, len))
+			return entry;
+	}
+	return NULL;
+}
+
+int credindex_open(const char *path, uint64_t entries);
+void credindex_update(const char *password, const char *ipaddr);
+
+#endif
@@ -0,0 +1,191 @@
+/*
+ * fairness.c
+ *
+ *
+ * Decides who gets a session when we are short on them. New sources are
+ * what we are here for, so they are always let in; sources that keep
+ * coming back get less and less of our time as the load goes up, and
+ * eventually end up parked: the listener just holds their connection open
+ * for a while, which costs a descriptor instead of a process.
+ *
+ * Since each source is steered to the same worker, all of this is local
+ * to the worker and needs no locking. That goes for IPv6 too, where the
+ * steering and the counts here both take a source by its /64.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#include "fairness.h"
+#include "config.h"
+#include "hash.h"
+
+/* How long the recently-seen filter remembers a source, at least. */
+#define GENERATION_SECONDS	600
+#define PARK_SLOTS		256
+
+#define BLOOM_BITS		65536
+#define COUNTER_SLOTS		4096
+
+/*
+ * A source counts as seen if it is in either generation of the bloom
+ * filter, so it is remembered for between one and two generations.
+ */
+static uint64_t bloom[2][BLOOM_BITS / 64];
+static int current = 0;
+static time_t generation_start = 0;
+
+/*
+ * Connection counts of the sources, by hash. Collisions evict the
+ * previous source once its count has worn down, so that sources that
+ * keep connecting win the slot.
+ */
+static struct {
+	uint32_t tag;
+	uint32_t count;
+} counters[COUNTER_SLOTS];
+
+static struct {
+	int fd;
+	time_t deadline;
+} parked[PARK_SLOTS];
+static int park_head = 0, park_count = 0;
+
+/*
+ * Hashes a source address. IPv6 sources are taken by their /64, since
+ * that is usually what a single host can pick addresses from.
+ */
+static uint64_t source_hash(const struct sockaddr_storage *addr)
+{
+	const struct in6_addr *v6;
+
+	if (addr->ss_family == AF_INET)
+		return hash_bytes(&((const struct sockaddr_in *)addr)->sin_addr, 4);
+	v6 = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+	if (IN6_IS_ADDR_V4MAPPED(v6))
+		return hash_bytes(&v6->s6_addr[12], 4);
+	return hash_bytes(v6->s6_addr, 8);
+}
+
+static void rotate(time_t now)
+{
+	int i;
+
+	if (now - generation_start < GENERATION_SECONDS)
+		return;
+	generation_start = now;
+	current = !current;
+	memset(bloom[current], 0, sizeof(bloom[current]));
+	for (i = 0; i < COUNTER_SLOTS; ++i)
+		counters[i].count /= 2;
+}
+
+static int bloom_test_and_set(uint64_t hash)
+{
+	unsigned int bits[3] = { hash & 0xffff, (hash >> 16) & 0xffff, (hash >> 32) & 0xffff };
+	int i, seen_current = 1, seen_previous = 1;
+
+	for (i = 0; i < 3; ++i) {
+		if (!(bloom[current][bits[i] / 64] & (1ULL << (bits[i] % 64))))
+			seen_current = 0;
+		if (!(bloom[!current][bits[i] / 64] & (1ULL << (bits[i] % 64))))
+			seen_previous = 0;
+		bloom[current][bits[i] / 64] |= 1ULL << (bits[i] % 64);
+	}
+	return seen_current || seen_previous;
+}
+
+static uint32_t count_source(uint64_t hash)
+{
+	unsigned int slot = (hash >> 48) % COUNTER_SLOTS;
+	uint32_t tag = (uint32_t)hash;
+
+	if (counters[slot].tag != tag) {
+		if (counters[slot].count > 1) {
+			--counters[slot].count;
+			return 1;
+		}
+		counters[slot].tag = tag;
+		counters[slot].count = 0;
+	}
+	return ++counters[slot].count;
+}
+
+enum source_class fairness_classify(const struct sockaddr_storage *addr)
+{
+	uint64_t hash = source_hash(addr);
+	uint32_t count;
+
+	rotate(time(NULL));
+	count = count_source(hash);
+	if (!bloom_test_and_set(hash))
+		return SOURCE_NEW;
+	return count >= (uint32_t)config_get()->heavy_threshold ? SOURCE_HEAVY : SOURCE_KNOWN;
+}
+
+/*
+ * Below half load everybody gets in. Above it heavy sources are parked,
+ * and close to the limit only new sources still get a session.
+ */
+enum admission fairness_admit(enum source_class class, int load)
+{
+	if (load < 50 || class == SOURCE_NEW)
+		return ADMIT;
+	if (class == SOURCE_KNOWN && load < 90)
+		return ADMIT;
+	return PARK;
+}
+
+/*
+ * Holds on to a connection until it expires. Fails when we are already
+ * holding as many as we are willing to.
+ */
+int fairness_park(int fd)
+{
+	int slot;
+
+	if (park_count == PARK_SLOTS)
+		return -1;
+	slot = (park_head + park_count++) % PARK_SLOTS;
+	parked[slot].fd = fd;
+	parked[slot].deadline = time(NULL) + config_get()->park_seconds;
+	return 0;
+}
+
+/*
+ * Hangs up on the parked connections whose time is up. They all get the
+ * same amount of time, so they expire in order; after a reload shortens
+ * park-seconds, some are held until the ones parked before them are due.
+ * Returns how many ms until the next one is due, or -1 if nothing is parked.
+ */
+int fairness_expire(void)
+{
+	time_t now = time(NULL);
+
+	while (park_count && parked[park_head].deadline <= now) {
+		close(parked[park_head].fd);
+		park_head = (park_head + 1) % PARK_SLOTS;
+		--park_count;
+	}
+	if (!park_count)
+		return -1;
+	return (int)(parked[park_head].deadline - now) * 1000;
+}
+
+/*
+ * Closes our copies of the parked connections, in a session child, which
+ * must not hold them open. The listener still has its own.
+ */
+void fairness_close_parked(void)
+{
+	int i;
+
+	for (i = 0; i < park_count; ++i)
+		close(parked[(park_head + i) % PARK_SLOTS].fd);
+	park_count = 0;
+}
@@ -0,0 +1,24 @@
+#ifndef FAIRNESS_H
+#define FAIRNESS_H
+
+#include <sys/socket.h>
+
+enum source_class {
+	SOURCE_NEW,	/* not seen recently, the most valuable kind */
+	SOURCE_KNOWN,	/* seen recently */
+	SOURCE_HEAVY	/* hammering us */
+};
+
+enum admission {
+	ADMIT,		/* fork off a session */
+	PARK,		/* hold the connection open in the listener, without a session */
+	SHED		/* hang up right away */
+};
+
+enum source_class fairness_classify(const struct sockaddr_storage *addr);
+enum admission fairness_admit(enum source_class class, int load);
+int fairness_park(int fd);
+int fairness_expire(void);
+void fairness_close_parked(void);
+
+#endif
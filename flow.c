@@ -0,0 +1,598 @@
+/*
+ * flow.c
+ *
+ *
+ * Session flows for decoys that need no C: a script is compiled when we
+ * start into a compact array of instructions, and the flow protocol runs
+ * it on every connection of its port. A script is made of lines like
+ * these, where # starts a comment and labels end in a colon:
+ *
+ *     on-timeout "\r\nTimed out.\r\n"	# what a session gets cut off with
+ *     send "$p login: "		# $p is the persona, $0 to $7 registers
+ *     read r0				# a line from the peer, into a register
+ *     again:
+ *     send "Password: "
+ *     read r1
+ *     log r0 r1			# a credential, which takes the reply delay
+ *     in r1 "123456" "admin" otp	# jump if r1 is any of these
+ *     glob r0 "*@*" domain		# or if it matches, with * and ?
+ *     eq r0 "root" otp			# or if it is just that
+ *     after 3 otp			# jump on the third time through here
+ *     seen 3 shell			# or once anyone has tried the last logged
+ *					# credential 3 times, in any session
+ *     visits 5 tarpit			# or once the peer has had 5 sessions
+ *     delay retry			# ms, or the reply or retry delay
+ *     send "Login incorrect\r\n"
+ *     goto again
+ *     otp:
+ *     send "One-time code: "
+ *     read r2
+ *     close				# and so does running off the end
+ *
+ * Strings take \r, \n, \t, \\, \" and \xNN, and $$ sends a dollar sign.
+ * The peer is spoken to in plain lines, like the other text protocols.
+ *
+ * The interpreter is direct-threaded: when the script is loaded, every
+ * instruction gets the address of the code that runs it, and each one
+ * ends by jumping straight to the next one's. A session has nothing of
+ * its own but its registers and counters, which are static, since every
+ * session is a process of its own anyway.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#include "flow.h"
+#include "protocol.h"
+#include "session.h"
+#include "config.h"
+#include "hash.h"
+
+#define FLOW_INSNS_MAX		1024
+#define FLOW_TEXT_MAX		65536
+#define FLOW_SET_MAX		16384	/* hash slots for all the sets of in together */
+#define FLOW_SET_STRINGS_MAX	2048	/* more than fit on a line */
+#define FLOW_LABELS_MAX		256
+#define FLOW_COUNTERS_MAX	64
+#define FLOW_REGISTERS		8
+#define FLOW_REGISTER_SIZE	256
+
+enum op {
+	OP_SEND,
+	OP_READ,
+	OP_LOG,
+	OP_EQ,
+	OP_GLOB,
+	OP_IN,
+	OP_AFTER,
+	OP_SEEN,
+	OP_VISITS,
+	OP_DELAY,
+	OP_GOTO,
+	OP_CLOSE,
+	OP_COUNT
+};
+
+/* Delays that are not a number of ms, but whatever the session policy says. */
+#define DELAY_REPLY	-1
+#define DELAY_RETRY	-2
+
+struct insn {
+	const void *handler;		/* where the interpreter runs it, once threaded */
+	unsigned char op;
+	unsigned char reg, reg2;
+	unsigned short counter;		/* for after */
+	int number;			/* ms for delay, times for after, seen and visits */
+	int target;			/* instruction to jump to */
+	unsigned int text, len;		/* into the text, or the slots of a set */
+};
+
+static struct insn program[FLOW_INSNS_MAX];
+static int insn_count = 0;
+static char text[FLOW_TEXT_MAX];
+static unsigned int text_len = 0;
+static uint64_t sets[FLOW_SET_MAX];
+static unsigned int sets_len = 0;
+static int counter_count = 0;
+static char *timeout_text = 0, *shutdown_text = 0;
+
+static struct {
+	char name[32];
+	int insn;
+} labels[FLOW_LABELS_MAX];
+static int label_count = 0;
+
+/* Jumps to labels that were not defined yet when we got to them. */
+static struct {
+	char name[32];
+	int insn, line;
+} fixups[FLOW_INSNS_MAX];
+static int fixup_count = 0;
+
+/* What a session keeps. */
+static char registers[FLOW_REGISTERS][FLOW_REGISTER_SIZE];
+static unsigned int counters[FLOW_COUNTERS_MAX];
+static FILE *output = 0;
+static const struct session_policy *policy = 0;
+static unsigned int visits = 0;
+static unsigned int seen = 0;		/* tries of the credential logged last */
+
+
+/*
+ * Takes the next word or string off the line. Strings have their escapes
+ * undone, in place. Returns 0 at the end of the line, and sets *quoted
+ * to whether it was a string.
+ */
+static char *next_token(char **line, int *quoted, size_t *len)
+{
+	char *start, *in, *out;
+	unsigned int byte;
+
+	*line += strspn(*line, " \t\r\n");
+	if (!**line || **line == '#')
+		return 0;
+	start = *line;
+	*quoted = *start == '"';
+	if (!*quoted) {
+		*line += strcspn(*line, " \t\r\n");
+		if (**line)
+			*(*line)++ = 0;
+		*len = strlen(start);
+		return start;
+	}
+	for (in = out = ++start; *in && *in != '"'; ++in) {
+		if (*in != '\\' || !in[1]) {
+			*out++ = *in;
+			continue;
+		}
+		switch (*++in) {
+			case 'r': *out++ = '\r'; break;
+			case 'n': *out++ = '\n'; break;
+			case 't': *out++ = '\t'; break;
+			case 'x':
+				if (isxdigit((unsigned char)in[1]) && isxdigit((unsigned char)in[2])) {
+					sscanf(in + 1, "%2x", &byte);
+					*out++ = byte;
+					in += 2;
+					break;
+				}
+				/* Fall through - it is just an x. */
+			default: *out++ = *in; break;
+		}
+	}
+	if (*in != '"')
+		return 0;
+	*line = in + 1;
+	*len = out - start;
+	return start;
+}
+
+static int add_text(const char *string, size_t len, struct insn *insn)
+{
+	if (text_len + len >= sizeof(text))
+		return -1;
+	memcpy(text + text_len, string, len);
+	insn->text = text_len;
+	insn->len = len;
+	text_len += len;
+	text[text_len++] = 0;
+	return 0;
+}
+
+static int parse_register(const char *token, unsigned char *reg)
+{
+	if (!token || token[0] != 'r' || token[1] < '0' || token[1] >= '0' + FLOW_REGISTERS || token[2])
+		return -1;
+	*reg = token[1] - '0';
+	return 0;
+}
+
+/*
+ * Points the instruction at a label, now if it is known and later if not.
+ */
+static int jump_to(const char *label, int line)
+{
+	int i;
+
+	if (!label || strlen(label) >= sizeof(labels[0].name))
+		return -1;
+	for (i = 0; i < label_count; ++i) {
+		if (!strcmp(labels[i].name, label)) {
+			program[insn_count].target = labels[i].insn;
+			return 0;
+		}
+	}
+	strcpy(fixups[fixup_count].name, label);
+	fixups[fixup_count].insn = insn_count;
+	fixups[fixup_count].line = line;
+	++fixup_count;
+	return 0;
+}
+
+/*
+ * Builds the hash set of in out of the strings that follow the register,
+ * the last token being the label. Sets are open addressed, at most half
+ * full, with 0 for an empty slot.
+ */
+static const char *parse_set(char **line, struct insn *insn, char **label)
+{
+	char *tokens[FLOW_SET_STRINGS_MAX], *token;
+	size_t lens[FLOW_SET_STRINGS_MAX], len;
+	unsigned int count = 0, slots = 2, i, slot;
+	uint64_t hash;
+	int quoted;
+
+	while ((token = next_token(line, &quoted, &len))) {
+		if (count == FLOW_SET_STRINGS_MAX)
+			return "too many strings";
+		tokens[count] = token;
+		lens[count++] = quoted ? len : (size_t)-1;
+	}
+	if (count < 2 || lens[count - 1] != (size_t)-1)
+		return "expected strings and a label";
+	*label = tokens[--count];
+	while (slots < count * 2)
+		slots *= 2;
+	if (sets_len + slots > FLOW_SET_MAX)
+		return "too many strings";
+	insn->text = sets_len;
+	insn->len = slots;
+	for (i = 0; i < count; ++i) {
+		if (lens[i] == (size_t)-1)
+			return "expected a string";
+		hash = hash_bytes(tokens[i], lens[i]) | 1;
+		for (slot = hash & (slots - 1); sets[sets_len + slot] && sets[sets_len + slot] != hash; slot = (slot + 1) & (slots - 1));
+		sets[sets_len + slot] = hash;
+	}
+	sets_len += slots;
+	return 0;
+}
+
+/*
+ * Compiles one line of the script. Returns what is wrong with it, if
+ * anything.
+ */
+static const char *parse_line(char *line, int line_number)
+{
+	static const char *names[OP_COUNT] = { "send", "read", "log", "eq", "glob", "in", "after", "seen", "visits", "delay", "goto", "close" };
+	struct insn *insn = &program[insn_count];
+	char *token, *word, *label = 0;
+	const char *error;
+	size_t len;
+	int quoted, op;
+
+	word = next_token(&line, &quoted, &len);
+	if (!word)
+		return 0;
+	if (quoted)
+		return "expected an instruction or a label";
+	if (len > 1 && word[len - 1] == ':' && !(token = next_token(&line, &quoted, &len))) {
+		word[len - 1] = 0;
+		if (label_count == FLOW_LABELS_MAX || strlen(word) >= sizeof(labels[0].name))
+			return "too many labels, or one too long";
+		for (op = 0; op < label_count; ++op) {
+			if (!strcmp(labels[op].name, word))
+				return "label defined twice";
+		}
+		strcpy(labels[label_count].name, word);
+		labels[label_count++].insn = insn_count;
+		return 0;
+	}
+	if (!strcmp(word, "on-timeout") || !strcmp(word, "on-shutdown")) {
+		token = next_token(&line, &quoted, &len);
+		if (!token || !quoted || next_token(&line, &quoted, &len))
+			return "expected a string";
+		*(word[3] == 't' ? &timeout_text : &shutdown_text) = strdup(token);
+		return 0;
+	}
+	for (op = 0; op < OP_COUNT && strcmp(word, names[op]); ++op);
+	if (op == OP_COUNT)
+		return "unknown instruction";
+	/* Room for the close at the end. */
+	if (insn_count == FLOW_INSNS_MAX - 1)
+		return "too many instructions";
+	memset(insn, 0, sizeof(*insn));
+	insn->op = op;
+
+	switch (op) {
+		case OP_SEND:
+			token = next_token(&line, &quoted, &len);
+			if (!token || !quoted || add_text(token, len, insn) < 0)
+				return "expected a string";
+			break;
+		case OP_READ:
+			if (parse_register(next_token(&line, &quoted, &len), &insn->reg) < 0)
+				return "expected a register";
+			break;
+		case OP_LOG:
+			if (parse_register(next_token(&line, &quoted, &len), &insn->reg) < 0
+					|| parse_register(next_token(&line, &quoted, &len), &insn->reg2) < 0)
+				return "expected the registers of the username and the password";
+			break;
+		case OP_EQ:
+		case OP_GLOB:
+			if (parse_register(next_token(&line, &quoted, &len), &insn->reg) < 0)
+				return "expected a register";
+			token = next_token(&line, &quoted, &len);
+			if (!token || !quoted || add_text(token, len, insn) < 0)
+				return "expected a string";
+			label = next_token(&line, &quoted, &len);
+			break;
+		case OP_IN:
+			if (parse_register(next_token(&line, &quoted, &len), &insn->reg) < 0)
+				return "expected a register";
+			if ((error = parse_set(&line, insn, &label)))
+				return error;
+			break;
+		case OP_AFTER:
+			token = next_token(&line, &quoted, &len);
+			insn->number = token ? atoi(token) : 0;
+			if (insn->number < 1)
+				return "expected how many times";
+			if (counter_count == FLOW_COUNTERS_MAX)
+				return "too many counters";
+			insn->counter = counter_count++;
+			label = next_token(&line, &quoted, &len);
+			break;
+		case OP_SEEN:
+		case OP_VISITS:
+			token = next_token(&line, &quoted, &len);
+			insn->number = token ? atoi(token) : 0;
+			if (insn->number < 1)
+				return "expected how many times";
+			label = next_token(&line, &quoted, &len);
+			break;
+		case OP_DELAY:
+			token = next_token(&line, &quoted, &len);
+			if (!token)
+				return "expected ms, reply or retry";
+			if (!strcmp(token, "reply"))
+				insn->number = DELAY_REPLY;
+			else if (!strcmp(token, "retry"))
+				insn->number = DELAY_RETRY;
+			else if ((insn->number = atoi(token)) <= 0 || insn->number > 60000)
+				return "expected ms, reply or retry";
+			break;
+		case OP_GOTO:
+			label = next_token(&line, &quoted, &len);
+			break;
+	}
+	if ((op == OP_EQ || op == OP_GLOB || op == OP_AFTER || op == OP_SEEN || op == OP_VISITS || op == OP_GOTO) && (!label || jump_to(label, line_number) < 0))
+		return "expected a label";
+	if (op == OP_IN && jump_to(label, line_number) < 0)
+		return "expected a label";
+	if (next_token(&line, &quoted, &len))
+		return "too many arguments";
+	++insn_count;
+	return 0;
+}
+
+
+static int glob_match(const char *pattern, const char *string)
+{
+	for (; *pattern; ++pattern, ++string) {
+		if (*pattern == '*') {
+			while (*++pattern == '*');
+			if (!*pattern)
+				return 1;
+			for (; *string; ++string) {
+				if (glob_match(pattern, string))
+					return 1;
+			}
+			return 0;
+		}
+		if (!*string || (*pattern != '?' && *pattern != *string))
+			return 0;
+	}
+	return !*string;
+}
+
+static int set_has(const struct insn *insn, const char *string)
+{
+	uint64_t hash = hash_bytes(string, strlen(string)) | 1;
+	const uint64_t *set = sets + insn->text;
+	unsigned int slot;
+
+	for (slot = hash & (insn->len - 1); set[slot]; slot = (slot + 1) & (insn->len - 1)) {
+		if (set[slot] == hash)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Sends a string, with the persona and the registers filled in.
+ */
+static void send_text(const char *string, size_t len)
+{
+	const char *end = string + len, *dollar;
+
+	while (string < end) {
+		dollar = memchr(string, '$', end - string);
+		if (!dollar || dollar + 1 == end) {
+			fwrite(string, 1, end - string, output);
+			return;
+		}
+		fwrite(string, 1, dollar - string, output);
+		if (dollar[1] == 'p')
+			fputs(config_get()->persona, output);
+		else if (dollar[1] >= '0' && dollar[1] < '0' + FLOW_REGISTERS)
+			fputs(registers[dollar[1] - '0'], output);
+		else
+			putc(dollar[1], output);
+		string = dollar + 2;
+	}
+}
+
+/*
+ * Runs the program from the top, until it closes. Called with thread set
+ * instead, it only gives every instruction the address of its handler,
+ * which has to come from in here.
+ */
+static void run(int thread)
+{
+	static const void *const handlers[OP_COUNT] = {
+		[OP_SEND] = &&op_send,
+		[OP_READ] = &&op_read,
+		[OP_LOG] = &&op_log,
+		[OP_EQ] = &&op_eq,
+		[OP_GLOB] = &&op_glob,
+		[OP_IN] = &&op_in,
+		[OP_AFTER] = &&op_after,
+		[OP_DELAY] = &&op_delay,
+		[OP_SEEN] = &&op_seen,
+		[OP_VISITS] = &&op_visits,
+		[OP_GOTO] = &&op_goto,
+		[OP_CLOSE] = &&op_close
+	};
+	const struct insn *ip = program;
+	int i;
+
+	if (thread) {
+		for (i = 0; i < insn_count; ++i)
+			program[i].handler = handlers[program[i].op];
+		return;
+	}
+
+#define NEXT		goto *(++ip)->handler
+#define JUMP		do { ip = program + ip->target; goto *ip->handler; } while (0)
+
+	goto *ip->handler;
+
+op_send:
+	send_text(text + ip->text, ip->len);
+	NEXT;
+op_read:
+	session_flush();
+	session_read_line(registers[ip->reg], FLOW_REGISTER_SIZE);
+	NEXT;
+op_log:
+	seen = session_credential(registers[ip->reg], registers[ip->reg2]);
+	NEXT;
+op_eq:
+	if (!strcmp(registers[ip->reg], text + ip->text))
+		JUMP;
+	NEXT;
+op_glob:
+	if (glob_match(text + ip->text, registers[ip->reg]))
+		JUMP;
+	NEXT;
+op_in:
+	if (set_has(ip, registers[ip->reg]))
+		JUMP;
+	NEXT;
+op_after:
+	if (++counters[ip->counter] == (unsigned int)ip->number)
+		JUMP;
+	NEXT;
+op_seen:
+	if (seen >= (unsigned int)ip->number)
+		JUMP;
+	NEXT;
+op_visits:
+	if (visits >= (unsigned int)ip->number)
+		JUMP;
+	NEXT;
+op_delay:
+	session_flush();
+	if (ip->number == DELAY_REPLY)
+		session_tarpit(policy->reply_delay);
+	else if (ip->number == DELAY_RETRY)
+		session_tarpit(policy->retry_delay);
+	else
+		session_tarpit(ip->number);
+	NEXT;
+op_goto:
+	JUMP;
+op_close:
+	session_flush();
+	session_exit(SESSION_CLOSED);
+
+#undef NEXT
+#undef JUMP
+}
+
+/*
+ * Compiles the script, and threads it.
+ */
+int flow_load(const char *path)
+{
+	char line[4096];
+	const char *error;
+	int line_number = 0, i, j;
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (!file) {
+		perror("fopen");
+		return -1;
+	}
+	while (fgets(line, sizeof(line), file)) {
+		++line_number;
+		error = parse_line(line, line_number);
+		if (error) {
+			fprintf(stderr, "%s:%d: %s.\n", path, line_number, error);
+			fclose(file);
+			return -1;
+		}
+	}
+	fclose(file);
+
+	for (i = 0; i < fixup_count; ++i) {
+		for (j = 0; j < label_count && strcmp(labels[j].name, fixups[i].name); ++j);
+		if (j == label_count) {
+			fprintf(stderr, "%s:%d: no such label: %s.\n", path, fixups[i].line, fixups[i].name);
+			return -1;
+		}
+		program[fixups[i].insn].target = labels[j].insn;
+	}
+	/* Whatever runs off the end closes. */
+	memset(&program[insn_count], 0, sizeof(program[0]));
+	program[insn_count++].op = OP_CLOSE;
+	run(1);
+	printf("Loaded flow from %s: %d instructions, %u bytes of text, %d labels.\n", path, insn_count, text_len, label_count);
+	return 0;
+}
+
+int flow_loaded(void)
+{
+	return insn_count > 0;
+}
+
+
+static void flow_serve(struct session *session, FILE *input, FILE *new_output)
+{
+	(void) input;
+	output = new_output;
+	policy = &session->policy;
+	visits = session->visits;
+
+	session_login();
+	run(0);
+}
+
+static int flow_timeout(FILE *output)
+{
+	if (timeout_text)
+		fputs(timeout_text, output);
+	return SESSION_CLOSED;
+}
+
+static void flow_shutdown(FILE *output)
+{
+	if (shutdown_text)
+		fputs(shutdown_text, output);
+}
+
+const struct protocol flow_protocol = {
+	.name = "flow",
+	.port = 23,
+	.serve = flow_serve,
+	.timeout = flow_timeout,
+	.shutdown = flow_shutdown
+};
@@ -0,0 +1,7 @@
+#ifndef FLOW_H
+#define FLOW_H
+
+int flow_load(const char *path);
+int flow_loaded(void);
+
+#endif
@@ -0,0 +1,314 @@
+/*
+ * geo.c
+ *
+ *
+ * Tags each source with its ASN and country from a local prefix database,
+ * in the TSV format of iptoasn.com (ip2asn-combined.tsv or ip2asn-v4.tsv):
+ *     RANGE_START	RANGE_END	AS_NUMBER	COUNTRY_CODE	AS_DESCRIPTION
+ *
+ * The ranges are loaded before the chroot into a read-only mapping that all
+ * the workers share, with the range starts in Eytzinger (breadth first)
+ * order: the first few levels of every search hit the same cache lines,
+ * and the next ones can be prefetched, so a lookup costs a few cache misses
+ * at most. Sessions are also counted per ASN, in shared memory.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+
+#include "geo.h"
+
+#define ASN_SLOTS	4096
+#define ASN_TOP		5
+
+typedef unsigned __int128 geo_key;
+
+struct geo_range {
+	geo_key start, end;
+	unsigned int asn;
+	char country[3];
+};
+
+/*
+ * IPv4 and IPv6 prefixes are kept apart, so that the IPv4 starts, which
+ * is what almost every lookup goes through, are four bytes each.
+ */
+struct geo_info4 {
+	uint32_t end;
+	unsigned int asn;
+	char country[3];
+};
+
+struct geo_info6 {
+	geo_key end;
+	unsigned int asn;
+	char country[3];
+};
+
+struct asn_count {
+	unsigned int asn;
+	unsigned long long sessions;
+};
+
+/* Both 1-based, with the starts in Eytzinger order and the rest alongside. */
+static uint32_t *starts4 = 0;
+static struct geo_info4 *infos4 = 0;
+static size_t count4 = 0;
+static geo_key *starts6 = 0;
+static struct geo_info6 *infos6 = 0;
+static size_t count6 = 0;
+static struct asn_count *asn_counts = 0;
+
+#define V4_MAPPED(key)	((key) >> 32 == 0xffff)
+
+/*
+ * Addresses are parsed as IPv6, with IPv4 mapped into ::ffff:0:0/96.
+ */
+static int parse_key(const char *address, geo_key *key)
+{
+	unsigned char bytes[16] = { [10] = 0xff, [11] = 0xff };
+	int i;
+
+	if (inet_pton(AF_INET6, address, bytes) != 1 && inet_pton(AF_INET, address, bytes + 12) != 1)
+		return -1;
+	*key = 0;
+	for (i = 0; i < 16; ++i)
+		*key = *key << 8 | bytes[i];
+	return 0;
+}
+
+static int by_start(const void *a, const void *b)
+{
+	const struct geo_range *x = a, *y = b;
+
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/*
+ * Works out which of the count sorted ranges goes to each position of the
+ * Eytzinger layout, by an in-order walk of the implicit tree. Returns the
+ * next sorted index to place.
+ */
+static size_t layout(size_t *order, size_t count, size_t next, size_t k)
+{
+	if (k > count)
+		return next;
+	next = layout(order, count, next, 2 * k);
+	order[k] = next;
+	return layout(order, count, next + 1, 2 * k + 1);
+}
+
+int geo_load(const char *path)
+{
+	char line[512], *start, *end, *asn, *country, *saveptr;
+	struct geo_range *ranges = 0, *grown, *range;
+	size_t allocated = 0, count = 0, size, k, *order;
+	FILE *file;
+	void *map;
+
+	file = fopen(path, "r");
+	if (!file) {
+		perror("fopen");
+		return -1;
+	}
+	while (fgets(line, sizeof(line), file)) {
+		start = strtok_r(line, "\t", &saveptr);
+		end = strtok_r(NULL, "\t", &saveptr);
+		asn = strtok_r(NULL, "\t", &saveptr);
+		country = strtok_r(NULL, "\t\n", &saveptr);
+		/* AS 0 is what the database calls not routed. */
+		if (!start || !end || !asn || !country || !atoi(asn))
+			continue;
+		if (count == allocated) {
+			allocated = allocated ? allocated * 2 : 65536;
+			grown = realloc(ranges, allocated * sizeof(*ranges));
+			if (!grown) {
+				perror("realloc");
+				free(ranges);
+				fclose(file);
+				return -1;
+			}
+			ranges = grown;
+		}
+		if (parse_key(start, &ranges[count].start) < 0 || parse_key(end, &ranges[count].end) < 0)
+			continue;
+		ranges[count].asn = strtoul(asn, NULL, 10);
+		ranges[count].country[0] = country[0];
+		ranges[count].country[1] = country[0] ? country[1] : 0;
+		ranges[count].country[2] = 0;
+		++count;
+	}
+	fclose(file);
+	if (!count) {
+		fprintf(stderr, "No prefixes in %s.\n", path);
+		free(ranges);
+		return -1;
+	}
+	qsort(ranges, count, sizeof(*ranges), by_start);
+	/* The IPv4 ranges sort together, between the rest of the IPv6 ones. */
+	for (k = 0; k < count; ++k) {
+		if (V4_MAPPED(ranges[k].start) && V4_MAPPED(ranges[k].end))
+			++count4;
+	}
+	count6 = count - count4;
+
+	size = (count4 + 1) * (sizeof(*starts4) + sizeof(*infos4)) + (count6 + 1) * (sizeof(*starts6) + sizeof(*infos6));
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	order = calloc(count + 1, sizeof(*order));
+	if (map == MAP_FAILED || !order) {
+		perror("mmap");
+		free(ranges);
+		return -1;
+	}
+	starts6 = map;
+	infos6 = (struct geo_info6 *)(starts6 + count6 + 1);
+	starts4 = (uint32_t *)(infos6 + count6 + 1);
+	infos4 = (struct geo_info4 *)(starts4 + count4 + 1);
+
+	/* Split the sorted ranges by family, IPv4 to the front. */
+	for (k = 0, range = ranges; k < count; ++k) {
+		if (V4_MAPPED(ranges[k].start) && V4_MAPPED(ranges[k].end))
+			order[range++ - ranges] = k;
+	}
+	for (k = 0; k < count; ++k) {
+		if (!(V4_MAPPED(ranges[k].start) && V4_MAPPED(ranges[k].end)))
+			order[range++ - ranges] = k;
+	}
+	grown = malloc(count * sizeof(*grown));
+	if (!grown) {
+		perror("malloc");
+		free(ranges);
+		free(order);
+		return -1;
+	}
+	for (k = 0; k < count; ++k)
+		grown[k] = ranges[order[k]];
+	free(ranges);
+	ranges = grown;
+
+	layout(order, count4, 0, 1);
+	for (k = 1; k <= count4; ++k) {
+		range = &ranges[order[k]];
+		starts4[k] = (uint32_t)range->start;
+		infos4[k].end = (uint32_t)range->end;
+		infos4[k].asn = range->asn;
+		memcpy(infos4[k].country, range->country, sizeof(infos4[k].country));
+	}
+	layout(order, count6, 0, 1);
+	for (k = 1; k <= count6; ++k) {
+		range = &ranges[count4 + order[k]];
+		starts6[k] = range->start;
+		infos6[k].end = range->end;
+		infos6[k].asn = range->asn;
+		memcpy(infos6[k].country, range->country, sizeof(infos6[k].country));
+	}
+	free(ranges);
+	free(order);
+	/* Nobody writes to it from here on, so the workers keep sharing every page. */
+	mprotect(map, size, PROT_READ);
+
+	map = mmap(NULL, ASN_SLOTS * sizeof(*asn_counts), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	asn_counts = map;
+	printf("Loaded %zu IPv4 and %zu IPv6 prefixes from %s, %zu KiB.\n", count4, count6, path, size / 1024);
+	return 0;
+}
+
+void geo_lookup(const struct sockaddr_storage *addr, struct geo *geo)
+{
+	const unsigned char *bytes;
+	size_t k = 1, best = 0;
+	uint32_t key4;
+	geo_key key6 = 0;
+	int i;
+
+	geo->asn = 0;
+	geo->country[0] = 0;
+	if (addr->ss_family == AF_INET6) {
+		bytes = ((const struct sockaddr_in6 *)addr)->sin6_addr.s6_addr;
+		for (i = 0; i < 16; ++i)
+			key6 = key6 << 8 | bytes[i];
+		if (!V4_MAPPED(key6)) {
+			/* The last start at or below the key. */
+			while (k <= count6) {
+				__builtin_prefetch(&starts6[k * 4]);
+				best = starts6[k] <= key6 ? k : best;
+				k = 2 * k + (starts6[k] <= key6);
+			}
+			if (!best || infos6[best].end < key6)
+				return;
+			geo->asn = infos6[best].asn;
+			memcpy(geo->country, infos6[best].country, sizeof(geo->country));
+			return;
+		}
+		key4 = (uint32_t)key6;
+	} else if (addr->ss_family == AF_INET)
+		key4 = ntohl(((const struct sockaddr_in *)addr)->sin_addr.s_addr);
+	else
+		return;
+
+	/* Sixteen starts to a cache line, so we can prefetch four levels down. */
+	while (k <= count4) {
+		__builtin_prefetch(&starts4[k * 16]);
+		best = starts4[k] <= key4 ? k : best;
+		k = 2 * k + (starts4[k] <= key4);
+	}
+	if (!best || infos4[best].end < key4)
+		return;
+	geo->asn = infos4[best].asn;
+	memcpy(geo->country, infos4[best].country, sizeof(geo->country));
+}
+
+/*
+ * Counts a session against its ASN. Once the table is full, new ASNs
+ * are not counted.
+ */
+void geo_count(const struct geo *geo)
+{
+	unsigned int slot, probe, seen;
+
+	if (!asn_counts || !geo->asn)
+		return;
+	for (probe = 0, slot = geo->asn * 2654435761u % ASN_SLOTS; probe < 64; ++probe, slot = (slot + 1) % ASN_SLOTS) {
+		seen = __atomic_load_n(&asn_counts[slot].asn, __ATOMIC_RELAXED);
+		if (!seen && __atomic_compare_exchange_n(&asn_counts[slot].asn, &seen, geo->asn, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			seen = geo->asn;
+		if (seen == geo->asn) {
+			__atomic_fetch_add(&asn_counts[slot].sessions, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+}
+
+/*
+ * Prints the ASNs we got the most sessions from.
+ */
+void geo_report(void)
+{
+	struct asn_count top[ASN_TOP] = { { 0, 0 } }, current;
+	int slot, i, j;
+
+	if (!asn_counts)
+		return;
+	for (slot = 0; slot < ASN_SLOTS; ++slot) {
+		current.asn = __atomic_load_n(&asn_counts[slot].asn, __ATOMIC_RELAXED);
+		current.sessions = __atomic_load_n(&asn_counts[slot].sessions, __ATOMIC_RELAXED);
+		for (i = 0; i < ASN_TOP && current.sessions <= top[i].sessions; ++i);
+		if (i == ASN_TOP)
+			continue;
+		for (j = ASN_TOP - 1; j > i; --j)
+			top[j] = top[j - 1];
+		top[i] = current;
+	}
+	for (i = 0; i < ASN_TOP && top[i].sessions; ++i)
+		printf("Stats: %llu sessions from AS%u.\n", top[i].sessions, top[i].asn);
+}
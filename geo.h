@@ -0,0 +1,20 @@
+#ifndef GEO_H
+#define GEO_H
+
+#include <sys/socket.h>
+
+/*
+ * Where an address is announced from, as far as the prefix database
+ * knows. asn is 0 and country empty for addresses it does not cover.
+ */
+struct geo {
+	unsigned int asn;
+	char country[3];
+};
+
+int geo_load(const char *path);
+void geo_lookup(const struct sockaddr_storage *addr, struct geo *geo);
+void geo_count(const struct geo *geo);
+void geo_report(void);
+
+#endif
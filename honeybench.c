@@ -0,0 +1,361 @@
+/*
+ * honeybench.c
+ *
+ *
+ * Throws synthetic traffic at a running honeypot. There are two modes:
+ *
+ * Bursts (the default) open connections back to back and report how many
+ * of the offered connections were actually served. A connection counts as
+ * served once the honeypot has sent us its first bytes, which only happens
+ * after it has been accepted and forked off.
+ *
+ * Sessions (--sessions) behave like a typical telnet bot instead: they
+ * negotiate a terminal type, wait for the prompts, send a username and a
+ * password, wait to be told it was wrong, and hang up. This is the
+ * training workload for make pgo.
+ *
+ * Run the honeypot on loopback, e.g.:
+ *     ./honeypot --port=2323 --backlog=16 &
+ *     ./honeybench --port=2323 --connections=2000 --burst=500
+ *     ./honeybench --port=2323 --sessions --connections=2000 --sources=256
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "telnet.h"
+
+enum state {
+	CONNECTING,
+	CONNECTED,
+	NEGOTIATING,
+	USERNAME,
+	PASSWORD,
+	VERDICT,
+	DONE
+};
+
+struct connection {
+	int fd;
+	enum state state;
+	int attempts;
+};
+
+static const char *usernames[] = { "root", "admin", "user", "support", "guest", "ubnt", "pi", "test" };
+static const char *passwords[] = { "123456", "admin", "password", "root", "12345", "default", "1234", "raspberry", "xc3511", "vizxv" };
+
+static struct connection *connections;
+static struct pollfd *pfds;
+static struct sockaddr_in addr;
+static int sessions = 0, sources = 1, attempts = 1;
+static int offered = 0, handshakes = 0, served = 0, completed = 0, refused = 0, live = 0;
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void finish(int i)
+{
+	struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+
+	/* Reset rather than FIN, so we do not pile up TIME_WAIT sockets. */
+	setsockopt(connections[i].fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+	close(connections[i].fd);
+	connections[i].state = DONE;
+	pfds[i].fd = -1;
+	--live;
+}
+
+/*
+ * Opens connection i, from one of the loopback sources if we were asked to
+ * spread them out, so that the honeypot does not see a single heavy source.
+ */
+static void start(int i)
+{
+	struct sockaddr_in source;
+	int fd;
+
+	pfds[i].fd = -1;
+	connections[i].state = DONE;
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return;
+	}
+	if (sources > 1) {
+		memset(&source, 0, sizeof(source));
+		source.sin_family = AF_INET;
+		source.sin_addr.s_addr = htonl(0x7f010000 + 1 + i % sources);
+		bind(fd, (struct sockaddr *)&source, sizeof(source));
+	}
+	++offered;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+		++refused;
+		close(fd);
+		return;
+	}
+	connections[i].fd = pfds[i].fd = fd;
+	connections[i].state = CONNECTING;
+	connections[i].attempts = 0;
+	pfds[i].events = POLLOUT;
+	++live;
+}
+
+static void send_string(int i, const char *string, size_t len)
+{
+	if (send(connections[i].fd, string, len, MSG_NOSIGNAL) != (ssize_t)len)
+		finish(i);
+}
+
+/*
+ * Moves a bot session along, based on what the honeypot just sent us.
+ */
+static void converse(int i, const char *buffer, size_t len)
+{
+	static const char will_ttype[] = { (char)IAC, (char)WILL, TTYPE };
+	static const char ttype_send[] = { (char)IAC, (char)SB, TTYPE, SEND };
+	static const char ttype_is[] = { (char)IAC, (char)SB, TTYPE, IS, 'x', 't', 'e', 'r', 'm', (char)IAC, (char)SE };
+	char line[64];
+
+	switch (connections[i].state) {
+		case CONNECTED:
+			send_string(i, will_ttype, sizeof(will_ttype));
+			if (connections[i].state == DONE)
+				return;
+			connections[i].state = NEGOTIATING;
+			/* Fall through - the request for the terminal type may already be here. */
+		case NEGOTIATING:
+			if (!memmem(buffer, len, ttype_send, sizeof(ttype_send)))
+				break;
+			send_string(i, ttype_is, sizeof(ttype_is));
+			if (connections[i].state != DONE)
+				connections[i].state = USERNAME;
+			break;
+		case USERNAME:
+			if (!memmem(buffer, len, "Username: ", 10))
+				break;
+			snprintf(line, sizeof(line), "%s\r\n", usernames[(i + connections[i].attempts) % (sizeof(usernames) / sizeof(usernames[0]))]);
+			send_string(i, line, strlen(line));
+			if (connections[i].state != DONE)
+				connections[i].state = PASSWORD;
+			break;
+		case PASSWORD:
+			if (!memmem(buffer, len, "Password: ", 10))
+				break;
+			snprintf(line, sizeof(line), "%s\r\n", passwords[(i + connections[i].attempts) % (sizeof(passwords) / sizeof(passwords[0]))]);
+			send_string(i, line, strlen(line));
+			if (connections[i].state != DONE)
+				connections[i].state = VERDICT;
+			break;
+		case VERDICT:
+			/* Like most bots, wait to hear whether it worked before moving on. */
+			if (!memmem(buffer, len, "Invalid credentials", 19))
+				break;
+			if (++connections[i].attempts < attempts) {
+				connections[i].state = USERNAME;
+				break;
+			}
+			++completed;
+			finish(i);
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Waits for progress on the outstanding connections for up to timeout ms.
+ */
+static void pump(int count, int timeout)
+{
+	char buffer[4096];
+	int i, error;
+	ssize_t len;
+	socklen_t error_len;
+
+	if (poll(pfds, count, timeout) <= 0)
+		return;
+	for (i = 0; i < count; ++i) {
+		if (pfds[i].fd < 0 || !pfds[i].revents)
+			continue;
+		if (connections[i].state == CONNECTING) {
+			error_len = sizeof(error);
+			if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 || error) {
+				++refused;
+				finish(i);
+				continue;
+			}
+			++handshakes;
+			connections[i].state = CONNECTED;
+			pfds[i].events = POLLIN;
+			continue;
+		}
+		len = recv(pfds[i].fd, buffer, sizeof(buffer), 0);
+		if (len <= 0) {
+			finish(i);
+			continue;
+		}
+		if (connections[i].state == CONNECTED)
+			++served;
+		if (!sessions) {
+			finish(i);
+			continue;
+		}
+		converse(i, buffer, len);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int port = 23, total = 1000, burst = 100, interval = 10, wait_ms = 5000, concurrency = 64;
+	int option, option_index = 0, i, j, next;
+	const char *host = "127.0.0.1";
+	struct rlimit limit;
+	double begin, elapsed, deadline;
+	static struct option long_options[] = {
+		{"host", required_argument, NULL, 'H'},
+		{"port", required_argument, NULL, 'p'},
+		{"connections", required_argument, NULL, 'n'},
+		{"burst", required_argument, NULL, 'b'},
+		{"interval", required_argument, NULL, 'i'},
+		{"wait", required_argument, NULL, 'w'},
+		{"sessions", no_argument, NULL, 'S'},
+		{"concurrency", required_argument, NULL, 'c'},
+		{"sources", required_argument, NULL, 's'},
+		{"attempts", required_argument, NULL, 'a'},
+		{"help", no_argument, NULL, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	while ((option = getopt_long(argc, argv, "H:p:n:b:i:w:Sc:s:a:h", long_options, &option_index)) != -1) {
+		switch (option) {
+			case 'H':
+				host = optarg;
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'n':
+				total = atoi(optarg);
+				break;
+			case 'b':
+				burst = atoi(optarg);
+				break;
+			case 'i':
+				interval = atoi(optarg);
+				break;
+			case 'w':
+				wait_ms = atoi(optarg);
+				break;
+			case 'S':
+				sessions = 1;
+				break;
+			case 'c':
+				concurrency = atoi(optarg);
+				break;
+			case 's':
+				sources = atoi(optarg);
+				break;
+			case 'a':
+				attempts = atoi(optarg);
+				break;
+			case 'h':
+			case '?':
+			default:
+				fprintf(stderr, "Usage: %s [OPTION]...\n", argv[0]);
+				fprintf(stderr, "  -H ADDR, --host=ADDR         IPv4 address of the honeypot (default 127.0.0.1)\n");
+				fprintf(stderr, "  -p PORT, --port=PORT         port of the honeypot (default 23)\n");
+				fprintf(stderr, "  -n N, --connections=N        offer N connections in total (default 1000)\n");
+				fprintf(stderr, "  -b N, --burst=N              open N connections back to back per burst (default 100)\n");
+				fprintf(stderr, "  -i MS, --interval=MS         pause MS milliseconds between bursts (default 10)\n");
+				fprintf(stderr, "  -w MS, --wait=MS             wait up to MS milliseconds for stragglers (default 5000)\n");
+				fprintf(stderr, "  -S, --sessions               run full bot login sessions instead of bursts\n");
+				fprintf(stderr, "  -c N, --concurrency=N        keep N sessions going at once (default 64)\n");
+				fprintf(stderr, "  -s N, --sources=N            spread connections over N loopback source addresses (default 1)\n");
+				fprintf(stderr, "  -a N, --attempts=N           try N passwords per session (default 1)\n");
+				fprintf(stderr, "  -h, --help                   display this message\n");
+				return option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (total < 1 || burst < 1 || interval < 0 || concurrency < 1 || attempts < 1 || sources < 1 || sources > 65534 || port <= 0 || port > 65535) {
+		fprintf(stderr, "Invalid arguments.\n");
+		return EXIT_FAILURE;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+		fprintf(stderr, "Invalid address: %s\n", host);
+		return EXIT_FAILURE;
+	}
+
+	if (!getrlimit(RLIMIT_NOFILE, &limit)) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	connections = calloc(total, sizeof(*connections));
+	pfds = calloc(total, sizeof(*pfds));
+	if (!connections || !pfds) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < total; ++i) {
+		pfds[i].fd = -1;
+		connections[i].state = DONE;
+	}
+
+	begin = now();
+	if (sessions) {
+		/* Keep the same number of bots going until all of them have had their turn. */
+		for (next = 0; next < total || live;) {
+			while (live < concurrency && next < total)
+				start(next++);
+			pump(next, 100);
+		}
+	} else {
+		for (i = 0; i < total; i += burst) {
+			for (j = i; j < total && j < i + burst; ++j)
+				start(j);
+			pump(j, interval);
+		}
+		deadline = now() + wait_ms / 1e3;
+		while (live && now() < deadline)
+			pump(total, 50);
+	}
+	elapsed = now() - begin;
+	for (i = 0; i < total; ++i) {
+		if (connections[i].state != DONE)
+			finish(i);
+	}
+
+	printf("offered:    %d\n", offered);
+	printf("handshakes: %d\n", handshakes);
+	printf("served:     %d (%.1f%%)\n", served, offered ? 100.0 * served / offered : 0);
+	printf("refused:    %d\n", refused);
+	if (sessions)
+		printf("completed:  %d\n", completed);
+	printf("elapsed:    %.3f s\n", elapsed);
+	printf("served/s:   %.1f\n", served / elapsed);
+	if (sessions)
+		printf("sessions/s: %.1f\n", completed / elapsed);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,645 @@
+/*
+ * honeycoro.c
+ *
+ *
+ * Measures what it would save to run sessions as coroutines in an event
+ * loop, from coro.h, rather than as a process each. It times a coroutine
+ * switch against a switch between two processes, and a fork against
+ * both. Then it runs the same login script both ways against a client
+ * that talks to it over loopback in lock step, like a bot does.
+ *
+ * The script has the shape of a telnet session without the negotiation:
+ * a banner, then a login prompt, a password prompt, an optional delay
+ * and a rejection, over and over until the client hangs up. In coro mode
+ * one server process runs every session from epoll. In fork mode the
+ * server forks a child per connection, which runs the script with
+ * blocking reads and sleeps, as the honeypot does.
+ *
+ *     ./honeycoro --sessions=2000 --concurrency=64 --attempts=3
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "coro.h"
+
+#define EVENTS_MAX	256
+#define CLIENT_BUFFER	256
+
+/* Shared with the server process, which counts for us. */
+struct counters {
+	unsigned long long resumes;
+	unsigned long long credentials;
+	unsigned long long peak_live;
+};
+
+/* Everything a session needs between two lines. */
+struct script {
+	struct coro coro;
+	int fd;
+	int closed;			/* the peer went away */
+	size_t len, used;		/* bytes in line, and how many of them the last line took */
+	char line[128];
+	char username[128];
+	unsigned long long deadline;	/* ns, while awaiting a delay */
+	struct script *next_sleeper;
+};
+
+struct client {
+	int fd;
+	int expect;			/* which prompt we wait for */
+	int attempts;
+	size_t len;
+	char buffer[CLIENT_BUFFER];
+};
+
+static const char *usernames[] = { "root", "admin", "user", "support", "guest", "ubnt", "pi", "test" };
+static const char *passwords[] = { "123456", "admin", "password", "root", "12345", "default", "1234", "raspberry", "xc3511", "vizxv" };
+static const char *prompts[] = { "login: ", "Password: ", "incorrect" };
+
+static struct counters *counters;
+static struct sockaddr_in addr;
+static int delay_ms = 0, attempts = 3;
+
+static unsigned long long now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double now()
+{
+	return now_ns() / 1e9;
+}
+
+static long long cpu_us(const struct rusage *usage)
+{
+	return (usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1000000LL + usage->ru_utime.tv_usec + usage->ru_stime.tv_usec;
+}
+
+
+/*
+ * The cheapest coroutine there is, for timing a switch on its own.
+ */
+struct counter {
+	struct coro coro;
+	unsigned long long count;
+};
+
+static __attribute__((noinline)) int count_up(struct counter *c)
+{
+	CORO_BEGIN(&c->coro);
+	for (;;) {
+		++c->count;
+		CORO_YIELD(&c->coro, CORO_WANT_READ);
+	}
+	CORO_END(&c->coro);
+}
+
+static double coro_switch_ns(unsigned long long iterations)
+{
+	struct counter c = { { 0 }, 0 };
+	unsigned long long i, start = now_ns();
+
+	for (i = 0; i < iterations; ++i)
+		count_up(&c);
+	return (double)(now_ns() - start) / iterations;
+}
+
+/*
+ * Bounces a byte between two processes over a pair of pipes. Every
+ * bounce is two switches.
+ */
+static double process_switch_ns(unsigned long long iterations)
+{
+	int there[2], back[2];
+	unsigned long long i, start;
+	char byte = 0;
+	pid_t child;
+
+	if (pipe(there) < 0 || pipe(back) < 0) {
+		perror("pipe");
+		return 0;
+	}
+	child = fork();
+	if (child < 0) {
+		perror("fork");
+		return 0;
+	}
+	if (!child) {
+		close(there[1]);
+		close(back[0]);
+		while (read(there[0], &byte, 1) == 1 && write(back[1], &byte, 1) == 1);
+		_exit(0);
+	}
+	close(there[0]);
+	close(back[1]);
+	start = now_ns();
+	for (i = 0; i < iterations; ++i) {
+		if (write(there[1], &byte, 1) != 1 || read(back[0], &byte, 1) != 1)
+			break;
+	}
+	start = now_ns() - start;
+	close(there[1]);
+	close(back[0]);
+	waitpid(child, NULL, 0);
+	return (double)start / (2 * iterations);
+}
+
+/*
+ * What it costs to fork a child that does nothing, and reap it.
+ */
+static double fork_us(int iterations)
+{
+	unsigned long long start = now_ns();
+	pid_t child;
+	int i;
+
+	for (i = 0; i < iterations; ++i) {
+		child = fork();
+		if (child < 0) {
+			perror("fork");
+			return 0;
+		}
+		if (!child)
+			_exit(0);
+		waitpid(child, NULL, 0);
+	}
+	return (now_ns() - start) / 1e3 / iterations;
+}
+
+
+static void say(struct script *s, const char *text)
+{
+	/* Small enough to always fit into the socket buffer. */
+	if (write(s->fd, text, strlen(text)) < 0)
+		s->closed = 1;
+}
+
+/*
+ * Whether a whole line is in, reading whatever is there if not. The line
+ * is left NUL-terminated at the start of the buffer. When the peer went
+ * away instead, closed is set, and that counts as in as well.
+ */
+static int next_line(struct script *s)
+{
+	char *end;
+	ssize_t len;
+
+	if (s->used) {
+		memmove(s->line, s->line + s->used, s->len - s->used);
+		s->len -= s->used;
+		s->used = 0;
+	}
+	for (;;) {
+		end = memchr(s->line, '\n', s->len);
+		if (end) {
+			s->used = end - s->line + 1;
+			*end = 0;
+			if (end > s->line && end[-1] == '\r')
+				end[-1] = 0;
+			return 1;
+		}
+		/* Lines that do not fit are thrown away. */
+		if (s->len == sizeof(s->line))
+			s->len = 0;
+		len = read(s->fd, s->line + s->len, sizeof(s->line) - s->len);
+		if (len > 0) {
+			s->len += len;
+			continue;
+		}
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		s->closed = 1;
+		return 1;
+	}
+}
+
+/*
+ * The session, as it reads. It runs the same whether it is driven by
+ * an event loop, or by a process of its own that blocks where it waits.
+ */
+static int script(struct script *s)
+{
+	CORO_BEGIN(&s->coro);
+	say(s, "Welcome\r\n");
+	while (!s->closed) {
+		say(s, "login: ");
+		CORO_AWAIT(&s->coro, next_line(s), CORO_WANT_READ);
+		if (s->closed)
+			break;
+		snprintf(s->username, sizeof(s->username), "%s", s->line);
+		say(s, "Password: ");
+		CORO_AWAIT(&s->coro, next_line(s), CORO_WANT_READ);
+		if (s->closed)
+			break;
+		__atomic_add_fetch(&counters->credentials, 1, __ATOMIC_RELAXED);
+		if (delay_ms) {
+			s->deadline = now_ns() + delay_ms * 1000000ULL;
+			CORO_AWAIT(&s->coro, now_ns() >= s->deadline, CORO_WANT_TIMER);
+		}
+		say(s, "Login incorrect\r\n");
+	}
+	CORO_END(&s->coro);
+}
+
+static struct script *new_script(int fd)
+{
+	struct script *s = calloc(1, sizeof(*s));
+	int one = 1;
+
+	/* The prompt goes out right behind the rejection. */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (!s) {
+		perror("calloc");
+		return 0;
+	}
+	CORO_INIT(&s->coro);
+	s->fd = fd;
+	return s;
+}
+
+
+/* The coro server's sessions, by descriptor, and those of them asleep. */
+static struct script **scripts, *sleepers = 0, **last_sleeper = &sleepers;
+static int epoll_fd = -1;
+static unsigned long long live = 0;
+
+/*
+ * Runs a session up to where it waits next, and sees to what it waits on.
+ */
+static void resume(struct script *s)
+{
+	struct epoll_event event = { .events = EPOLLIN, .data.fd = s->fd };
+	int status;
+
+	__atomic_add_fetch(&counters->resumes, 1, __ATOMIC_RELAXED);
+	status = script(s);
+	if (status == CORO_DONE) {
+		close(s->fd);
+		scripts[s->fd] = 0;
+		free(s);
+		--live;
+	} else if (status == CORO_WANT_TIMER) {
+		/* Input can wait until it wakes up. */
+		event.events = 0;
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->fd, &event);
+		s->next_sleeper = 0;
+		*last_sleeper = s;
+		last_sleeper = &s->next_sleeper;
+	} else if (s->deadline) {
+		s->deadline = 0;
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->fd, &event);
+	}
+}
+
+/*
+ * Runs every session in one process. Sleepers all wait the same delay,
+ * so they are due in the order they went to sleep and a queue will do.
+ */
+static void serve_coro(int listen_fd)
+{
+	struct epoll_event event, events[EVENTS_MAX];
+	unsigned long long due;
+	int fd_max, count, timeout, i, fd;
+	struct script *s;
+
+	fd_max = sysconf(_SC_OPEN_MAX);
+	scripts = calloc(fd_max, sizeof(*scripts));
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (!scripts || epoll_fd < 0) {
+		perror("epoll_create1");
+		_exit(1);
+	}
+	event.events = EPOLLIN;
+	event.data.fd = listen_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+
+	for (;;) {
+		timeout = -1;
+		if (sleepers) {
+			due = now_ns();
+			timeout = sleepers->deadline > due ? (sleepers->deadline - due + 999999) / 1000000 : 0;
+		}
+		count = epoll_wait(epoll_fd, events, EVENTS_MAX, timeout);
+		if (count < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			_exit(1);
+		}
+		for (i = 0; i < count; ++i) {
+			if (events[i].data.fd != listen_fd) {
+				/* Sleepers still hear of hangups; they can wait. */
+				s = scripts[events[i].data.fd];
+				if (s && !s->deadline)
+					resume(s);
+				continue;
+			}
+			while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+				if (fd >= fd_max || !(scripts[fd] = new_script(fd))) {
+					close(fd);
+					continue;
+				}
+				event.events = EPOLLIN;
+				event.data.fd = fd;
+				epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+				if (++live > counters->peak_live)
+					counters->peak_live = live;
+				/* Up to its first wait, which is for a username. */
+				resume(scripts[fd]);
+			}
+		}
+		due = now_ns();
+		while (sleepers && sleepers->deadline <= due) {
+			s = sleepers;
+			sleepers = s->next_sleeper;
+			if (!sleepers)
+				last_sleeper = &sleepers;
+			resume(s);
+		}
+	}
+}
+
+static volatile sig_atomic_t stopping = 0;
+
+static void SIGTERM_handler(int sig)
+{
+	(void) sig;
+	stopping = 1;
+}
+
+/*
+ * Forks a child per connection, which runs the script to the end,
+ * blocking wherever it waits.
+ */
+static void serve_fork(int listen_fd)
+{
+	struct sigaction action = { .sa_handler = SIGTERM_handler };
+	struct timespec ts;
+	unsigned long long left;
+	struct script *s;
+	int fd, status;
+
+	/* Without SA_RESTART, so that SIGTERM breaks us out of accept(). */
+	sigaction(SIGTERM, &action, NULL);
+	fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) & ~O_NONBLOCK);
+	while (!stopping) {
+		while (waitpid(-1, NULL, WNOHANG) > 0)
+			--live;
+		fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0)
+			continue;
+		if (++live > counters->peak_live)
+			counters->peak_live = live;
+		if (fork()) {
+			close(fd);
+			continue;
+		}
+		close(listen_fd);
+		s = new_script(fd);
+		if (!s)
+			_exit(1);
+		do {
+			__atomic_add_fetch(&counters->resumes, 1, __ATOMIC_RELAXED);
+			status = script(s);
+			if (status == CORO_WANT_TIMER) {
+				left = s->deadline - now_ns();
+				ts.tv_sec = left / 1000000000ULL;
+				ts.tv_nsec = left % 1000000000ULL;
+				if (s->deadline > now_ns())
+					nanosleep(&ts, NULL);
+			}
+		} while (status != CORO_DONE);
+		_exit(0);
+	}
+	/* So that what the sessions used counts for us. */
+	while (wait(NULL) > 0 || errno == EINTR);
+	_exit(0);
+}
+
+
+static int client_connect(struct client *client)
+{
+	struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+	int one = 1;
+
+	client->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (client->fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	/* Reset rather than FIN, so we do not pile up TIME_WAIT sockets. */
+	setsockopt(client->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+	setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(client->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("connect");
+		close(client->fd);
+		return -1;
+	}
+	client->expect = 0;
+	client->attempts = 0;
+	client->len = 0;
+	return 0;
+}
+
+/*
+ * Reads what the server said, and answers every prompt in it. Returns 1
+ * once the client is done with its attempts, or is cut off.
+ */
+static int client_step(struct client *client)
+{
+	char answer[64], *found;
+	ssize_t len;
+
+	len = read(client->fd, client->buffer + client->len, sizeof(client->buffer) - 1 - client->len);
+	if (len <= 0)
+		return 1;
+	client->len += len;
+	client->buffer[client->len] = 0;
+	while ((found = strstr(client->buffer, prompts[client->expect]))) {
+		found += strlen(prompts[client->expect]);
+		client->len -= found - client->buffer;
+		memmove(client->buffer, found, client->len + 1);
+		if (client->expect == 0)
+			snprintf(answer, sizeof(answer), "%s\r\n", usernames[rand() % (sizeof(usernames) / sizeof(usernames[0]))]);
+		else if (client->expect == 1)
+			snprintf(answer, sizeof(answer), "%s\r\n", passwords[rand() % (sizeof(passwords) / sizeof(passwords[0]))]);
+		else if (++client->attempts == attempts)
+			return 1;
+		client->expect = (client->expect + 1) % 3;
+		if (client->expect && write(client->fd, answer, strlen(answer)) < 0)
+			return 1;
+	}
+	/* Whatever does not hold a prompt by now never will. */
+	if (client->len == sizeof(client->buffer) - 1)
+		client->len = 0;
+	return 0;
+}
+
+/*
+ * Runs the sessions against a server in its own process, and prints
+ * what it took.
+ */
+static void run(const char *mode, void (*serve)(int), int total, int concurrency)
+{
+	struct client *clients;
+	struct pollfd *pfds;
+	socklen_t addr_len = sizeof(addr);
+	int listen_fd, started = 0, completed = 0, i;
+	struct rusage usage;
+	double start, elapsed;
+	pid_t server;
+
+	memset(counters, 0, sizeof(*counters));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+			|| listen(listen_fd, SOMAXCONN) < 0 || getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) < 0) {
+		perror("listen");
+		exit(EXIT_FAILURE);
+	}
+	server = fork();
+	if (server < 0) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+	if (!server)
+		serve(listen_fd);
+	close(listen_fd);
+
+	clients = calloc(concurrency, sizeof(*clients));
+	pfds = calloc(concurrency, sizeof(*pfds));
+	if (!clients || !pfds) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	start = now();
+	while (completed < total) {
+		for (i = 0; i < concurrency; ++i) {
+			if (pfds[i].fd > 0 || started == total)
+				continue;
+			if (client_connect(&clients[i]) < 0)
+				exit(EXIT_FAILURE);
+			pfds[i].fd = clients[i].fd;
+			pfds[i].events = POLLIN;
+			++started;
+		}
+		if (poll(pfds, concurrency, 10000) <= 0) {
+			fprintf(stderr, "The server stopped answering.\n");
+			break;
+		}
+		for (i = 0; i < concurrency; ++i) {
+			if (pfds[i].fd <= 0 || !pfds[i].revents)
+				continue;
+			if (client_step(&clients[i])) {
+				close(clients[i].fd);
+				pfds[i].fd = 0;
+				++completed;
+			}
+		}
+	}
+	elapsed = now() - start;
+
+	kill(server, SIGTERM);
+	/* This covers the sessions the server forked and reaped, too. */
+	if (wait4(server, NULL, 0, &usage) < 0)
+		memset(&usage, 0, sizeof(usage));
+	printf("%s:%*s%d sessions, %llu credentials, %.1f sessions/s, %llu at once at most\n", mode, (int)(10 - strlen(mode)), "",
+		completed, counters->credentials, completed / elapsed, counters->peak_live);
+	printf("%*s%llu resumes, %.1f us of server CPU per session, %ld KB peak RSS of a process\n", 11, "",
+		counters->resumes, completed ? (double)cpu_us(&usage) / completed : 0, usage.ru_maxrss);
+	free(clients);
+	free(pfds);
+}
+
+int main(int argc, char *argv[])
+{
+	int total = 1000, concurrency = 64, option, option_index = 0, do_coro = 1, do_fork = 1;
+	static struct option long_options[] = {
+		{"sessions", required_argument, NULL, 'n'},
+		{"concurrency", required_argument, NULL, 'c'},
+		{"attempts", required_argument, NULL, 'a'},
+		{"delay", required_argument, NULL, 'd'},
+		{"mode", required_argument, NULL, 'm'},
+		{"help", no_argument, NULL, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	while ((option = getopt_long(argc, argv, "n:c:a:d:m:h", long_options, &option_index)) != -1) {
+		switch (option) {
+			case 'n':
+				total = atoi(optarg);
+				break;
+			case 'c':
+				concurrency = atoi(optarg);
+				break;
+			case 'a':
+				attempts = atoi(optarg);
+				break;
+			case 'd':
+				delay_ms = atoi(optarg);
+				break;
+			case 'm':
+				do_coro = !strcmp(optarg, "coro") || !strcmp(optarg, "both");
+				do_fork = !strcmp(optarg, "fork") || !strcmp(optarg, "both");
+				if (do_coro || do_fork)
+					break;
+				fprintf(stderr, "Invalid mode: %s\n", optarg);
+				return EXIT_FAILURE;
+			case 'h':
+			case '?':
+			default:
+				fprintf(stderr, "Usage: %s [OPTION]...\n", argv[0]);
+				fprintf(stderr, "  -n N, --sessions=N           run N login sessions each way (default 1000)\n");
+				fprintf(stderr, "  -c N, --concurrency=N        keep N sessions going at once (default 64)\n");
+				fprintf(stderr, "  -a N, --attempts=N           try N passwords per session (default 3)\n");
+				fprintf(stderr, "  -d MS, --delay=MS            await MS milliseconds before each rejection (default 0)\n");
+				fprintf(stderr, "  -m MODE, --mode=MODE         coro, fork or both (default both)\n");
+				fprintf(stderr, "  -h, --help                   display this message\n");
+				return option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (total < 1 || concurrency < 1 || attempts < 1 || delay_ms < 0) {
+		fprintf(stderr, "Sessions, concurrency and attempts have to be positive.\n");
+		return EXIT_FAILURE;
+	}
+	counters = mmap(NULL, sizeof(*counters), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (counters == MAP_FAILED) {
+		perror("mmap");
+		return EXIT_FAILURE;
+	}
+
+	printf("switch:    %.1f ns between coroutines, %.1f ns between processes\n",
+		coro_switch_ns(100000000), process_switch_ns(100000));
+	printf("fork:      %.1f us to fork and reap a process\n", fork_us(1000));
+	printf("state:     %zu bytes per coroutine session\n", sizeof(struct script));
+	if (do_coro)
+		run("coro", serve_coro, total, concurrency);
+	if (do_fork)
+		run("fork", serve_fork, total, concurrency);
+	return 0;
+}
@@ -0,0 +1,372 @@
+/*
+ * honeylog.c
+ *
+ *
+ * The log of collected credentials. Sessions append records to it; how
+ * soon those reach the disk depends on the durability mode. In group
+ * mode, whichever listener gets to it first syncs everything that piled
+ * up since the last sync, so a burst of records costs one fdatasync.
+ * Either way, the newest records are also kept in the ring, if there is one.
+ *
+ * A session's attempts are gathered up in the session itself, and written
+ * as a single record when it ends, so that one bot's run is one line:
+ *     ADDRESS - session<TAB>session=ID<TAB>start=EPOCH.MS<TAB>duration_ms=N
+ *         <TAB>end=REASON<TAB>fp=FINGERPRINT<TAB>attempts=N<TAB>creds=USER:PASS,...
+ * In the list, %, comma, slash and the colon in usernames are escaped as
+ * %XX. An attempt that sampling kept to stand for N of its kind has /N
+ * after it. With --log-mode=attempts or both, every attempt that is not
+ * only counted is also written as it comes in, as "ADDRESS - USER:PASS"
+ * with the session=ID token, and sample=1/N when it was sampled. Both kinds
+ * of record say which port the session came in on and which persona it
+ * was shown with port=PORT and persona=NAME, and sessions on anything but
+ * telnet say which protocol with proto=NAME.
+ *
+ * Sessions are the default because they are the compact record of what a
+ * bot did, but they only reach the log when the session ends. A session
+ * that is killed outright, by the CPU limit, seccomp or the OOM killer,
+ * never gets to write its record, whatever the durability mode. So the
+ * attempt lines always go into the ring as they come in, whatever the
+ * log mode, where they also do not have to fit a whole session's list
+ * into a slot. Where every attempt has to make it to the disk, use both.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "honeylog.h"
+#include "ring.h"
+#include "credindex.h"
+#include "sampling.h"
+#include "protocol.h"
+#include "config.h"
+
+#define DEFAULT_INTERVAL_MS	100
+#define ATTEMPTS_MAX		3072	/* bytes of the attempt list that go into a session record */
+
+/*
+ * Shared between the listeners and the sessions. The lag is the time from
+ * when the oldest unsynced record was written until it was on the disk.
+ */
+struct honeylog_state {
+	unsigned long long records;
+	unsigned long long oldest_unsynced_ns;	/* 0 when everything is synced */
+	unsigned long long syncs;
+	unsigned long long synced_records;
+	unsigned long long lag_sum_ns;
+	unsigned long long lag_max_ns;		/* since the last report */
+	unsigned long long sync_sum_ns;
+	unsigned long long records_at_sync;
+} __attribute__((aligned(64)));
+
+static FILE *logfile = 0;
+static struct honeylog_state *state = 0;
+static enum durability mode = DURABILITY_NONE;
+static int interval = DEFAULT_INTERVAL_MS;
+static unsigned long long next_tick_ns = 0;
+static enum log_mode log_mode = LOG_SESSIONS;
+
+/* The attempts of the session we are in, if we are one. */
+static char attempts[ATTEMPTS_MAX];
+static size_t attempts_len = 0;
+static unsigned int attempt_count = 0, attempts_listed = 0, attempts_counted = 0;
+static int attempts_cut = 0;
+
+static const char *mode_names[] = { "none", "group", "dsync" };
+static const char *log_mode_names[] = { "sessions", "attempts", "both" };
+
+static unsigned long long now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * Parses none, dsync, group or group:MS.
+ */
+int honeylog_parse_durability(const char *arg, enum durability *durability, int *interval_ms)
+{
+	if (!strcmp(arg, "none"))
+		*durability = DURABILITY_NONE;
+	else if (!strcmp(arg, "dsync"))
+		*durability = DURABILITY_DSYNC;
+	else if (!strncmp(arg, "group", 5) && (!arg[5] || arg[5] == ':')) {
+		*durability = DURABILITY_GROUP;
+		*interval_ms = arg[5] ? atoi(arg + 6) : DEFAULT_INTERVAL_MS;
+		if (*interval_ms < 1)
+			return -1;
+	} else
+		return -1;
+	return 0;
+}
+
+int honeylog_parse_mode(const char *arg, enum log_mode *mode)
+{
+	int i;
+
+	for (i = 0; i <= LOG_BOTH; ++i) {
+		if (!strcmp(arg, log_mode_names[i])) {
+			*mode = i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Opens the log before the chroot, and maps the state that the sessions
+ * report their writes to.
+ */
+int honeylog_open(const char *path, enum durability durability, int interval_ms, enum log_mode mode_of_log)
+{
+	struct stat sbuf;
+	void *map;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC | (durability == DURABILITY_DSYNC ? O_DSYNC : 0), 0666);
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+	logfile = fdopen(fd, "a");
+	if (!logfile) {
+		perror("fdopen");
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, sizeof(struct honeylog_state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	state = map;
+	mode = durability;
+	interval = interval_ms;
+	log_mode = mode_of_log;
+	/* There is nothing to sync on a pipe or /dev/null. */
+	if (mode != DURABILITY_NONE && !fstat(fd, &sbuf) && !S_ISREG(sbuf.st_mode)) {
+		fprintf(stderr, "Warning: %s is not a regular file, ignoring the durability mode.\n", path);
+		mode = DURABILITY_NONE;
+	}
+	return 0;
+}
+
+/*
+ * Appends a record. Called by the sessions, so this may not do anything
+ * the seccomp filter would object to.
+ */
+void honeylog_printf(const char *format, ...)
+{
+	unsigned long long expected = 0;
+	char record[4096];
+	va_list args;
+	int len;
+
+	va_start(args, format);
+	len = vsnprintf(record, sizeof(record), format, args);
+	va_end(args);
+	if (len < 0)
+		return;
+	if (len >= (int)sizeof(record))
+		len = sizeof(record) - 1;
+	fwrite(record, 1, len, logfile);
+	fflush(logfile);
+	/* The ring keeps each record on its own, without the newline. */
+	ring_append(record, len && record[len - 1] == '\n' ? len - 1 : len);
+	__atomic_fetch_add(&state->records, 1, __ATOMIC_RELAXED);
+	if (mode == DURABILITY_GROUP)
+		__atomic_compare_exchange_n(&state->oldest_unsynced_ns, &expected, now_ns(), 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+/*
+ * Add to the attempt list at *len, escaping % and whatever else is in
+ * escapes. They return -1 when it is full.
+ */
+static int list_put(char c, size_t *len)
+{
+	if (*len + 1 >= sizeof(attempts))
+		return -1;
+	attempts[(*len)++] = c;
+	return 0;
+}
+
+static int list_append(const char *value, const char *escapes, size_t *len)
+{
+	for (; *value; ++value) {
+		if (*value != '%' && !strchr(escapes, *value)) {
+			if (list_put(*value, len) < 0)
+				return -1;
+			continue;
+		}
+		if (*len + 4 >= sizeof(attempts))
+			return -1;
+		*len += sprintf(attempts + *len, "%%%02X", (unsigned char)*value);
+	}
+	return 0;
+}
+
+/*
+ * Notes a password collected from a session, and indexes it. What else
+ * we know about the source follows as tab separated key=value tokens.
+ * With --sample, repeats may only be counted, or logged as a sample that
+ * stands for N attempts, which the record says; seen, the count from
+ * seen_credential(), tells the repeats apart.
+ */
+void honeylog_credential(const struct session *session, const char *username, const char *password, unsigned int seen)
+{
+	unsigned int weight = sampling_decide(username, password, session->ipaddr, seen);
+	char sample[16] = "", tokens[160] = "", record[RING_SLOT_SIZE];
+	size_t len = attempts_len;
+
+	credindex_update(password, session->ipaddr);
+	++attempt_count;
+	if (!weight) {
+		++attempts_counted;
+		return;
+	}
+	if (weight > 1)
+		snprintf(sample, sizeof(sample), "/%u", weight);
+
+	/* Once an attempt does not fit, the list ends there. */
+	if (!attempts_cut && (!attempts_listed || !list_put(',', &len)) && !list_append(username, ",/:", &len)
+			&& !list_put(':', &len) && !list_append(password, ",/", &len) && !list_append(sample, "", &len)) {
+		attempts_len = len;
+		++attempts_listed;
+	} else
+		attempts_cut = 1;
+	/* Whatever did not fit may have run past the end of the list. */
+	attempts[attempts_len] = 0;
+
+	if (weight > 1)
+		snprintf(tokens, sizeof(tokens), "\tsample=1%s", sample);
+	snprintf(tokens + strlen(tokens), sizeof(tokens) - strlen(tokens), "\tport=%d\tpersona=%s", session->port, config_get()->persona);
+	if (session->geo.asn)
+		snprintf(tokens + strlen(tokens), sizeof(tokens) - strlen(tokens), "\tasn=%u\tcc=%s", session->geo.asn, session->geo.country);
+	if (session->protocol != &telnet_protocol)
+		snprintf(tokens + strlen(tokens), sizeof(tokens) - strlen(tokens), "\tproto=%s", session->protocol->name);
+	if (log_mode != LOG_SESSIONS) {
+		honeylog_printf("%s - %s:%s\tsession=%llx%s\n", session->ipaddr, username, password, session->id, tokens);
+		return;
+	}
+	/* Only into the ring, so that it survives the session being killed. */
+	len = snprintf(record, sizeof(record), "%s - %s:%s\tsession=%llx%s", session->ipaddr, username, password, session->id, tokens);
+	ring_append(record, len < sizeof(record) ? len : sizeof(record) - 1);
+}
+
+/*
+ * Writes the session record, once the session is over. The list stops at
+ * the first attempt that did not fit; listed= says how many made it then.
+ * Attempts that sampling only counted are left out of it, and counted=
+ * says how many.
+ */
+void honeylog_session_end(const struct session *session, const char *reason, const char *fingerprint)
+{
+	struct timespec now, wall;
+	long long duration_ms, start_ms;
+	char tokens[192] = "";
+
+	if (log_mode == LOG_ATTEMPTS || !logfile)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	clock_gettime(CLOCK_REALTIME, &wall);
+	duration_ms = (now.tv_sec - session->start.tv_sec) * 1000LL + (now.tv_nsec - session->start.tv_nsec) / 1000000;
+	start_ms = wall.tv_sec * 1000LL + wall.tv_nsec / 1000000 - duration_ms;
+	if (attempts_cut)
+		snprintf(tokens, sizeof(tokens), "\tlisted=%u", attempts_listed);
+	if (attempts_counted)
+		snprintf(tokens + strlen(tokens), sizeof(tokens) - strlen(tokens), "\tcounted=%u", attempts_counted);
+	snprintf(tokens + strlen(tokens), sizeof(tokens) - strlen(tokens), "\tport=%d\tpersona=%s", session->port, config_get()->persona);
+	if (session->geo.asn)
+		snprintf(tokens + strlen(tokens), sizeof(tokens) - strlen(tokens), "\tasn=%u\tcc=%s", session->geo.asn, session->geo.country);
+	if (session->protocol != &telnet_protocol)
+		snprintf(tokens + strlen(tokens), sizeof(tokens) - strlen(tokens), "\tproto=%s", session->protocol->name);
+	honeylog_printf("%s - session\tsession=%llx\tstart=%lld.%03lld\tduration_ms=%lld\tend=%s\tfp=%s\tattempts=%u\tcreds=%s%s\n",
+		session->ipaddr, session->id, start_ms / 1000, start_ms % 1000, duration_ms, reason, fingerprint,
+		attempt_count, attempts, tokens);
+}
+
+/*
+ * Syncs whatever has been written since the last sync, unless another
+ * listener already took care of it.
+ */
+void honeylog_sync(void)
+{
+	unsigned long long oldest, records, start, done, lag, max;
+
+	if (mode != DURABILITY_GROUP)
+		return;
+	records = __atomic_load_n(&state->records, __ATOMIC_RELAXED);
+	oldest = __atomic_exchange_n(&state->oldest_unsynced_ns, 0, __ATOMIC_ACQUIRE);
+	if (!oldest)
+		return;
+	start = now_ns();
+	if (fdatasync(fileno(logfile)) < 0) {
+		perror("fdatasync");
+		return;
+	}
+	done = now_ns();
+	lag = done - oldest;
+	__atomic_fetch_add(&state->syncs, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&state->lag_sum_ns, lag, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&state->sync_sum_ns, done - start, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&state->lag_max_ns, __ATOMIC_RELAXED);
+	while (lag > max && !__atomic_compare_exchange_n(&state->lag_max_ns, &max, lag, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	__atomic_store_n(&state->records_at_sync, records, __ATOMIC_RELAXED);
+}
+
+/*
+ * Called from the listener loops. Returns how many ms until the next
+ * sync is due, or -1 when we never need to wake up for one.
+ */
+int honeylog_tick(void)
+{
+	unsigned long long now;
+
+	if (mode != DURABILITY_GROUP)
+		return -1;
+	now = now_ns();
+	if (now >= next_tick_ns) {
+		honeylog_sync();
+		next_tick_ns = now + interval * 1000000ULL;
+	}
+	return (next_tick_ns - now + 999999) / 1000000;
+}
+
+/*
+ * Prints how far the disk is behind the log to the debug log.
+ */
+void honeylog_report(void)
+{
+	unsigned long long records, syncs, max;
+
+	if (!state)
+		return;
+	records = __atomic_load_n(&state->records, __ATOMIC_RELAXED);
+	if (mode != DURABILITY_GROUP) {
+		printf("Log: %llu records, durability %s.\n", records, mode_names[mode]);
+		return;
+	}
+	syncs = __atomic_load_n(&state->syncs, __ATOMIC_RELAXED);
+	max = __atomic_exchange_n(&state->lag_max_ns, 0, __ATOMIC_RELAXED);
+	printf("Log: %llu records, %llu not yet durable, %llu syncs, durable lag %llu ms average and %llu ms at most, %llu us per sync.\n",
+		records, records - __atomic_load_n(&state->records_at_sync, __ATOMIC_RELAXED), syncs,
+		syncs ? __atomic_load_n(&state->lag_sum_ns, __ATOMIC_RELAXED) / syncs / 1000000 : 0, max / 1000000,
+		syncs ? __atomic_load_n(&state->sync_sum_ns, __ATOMIC_RELAXED) / syncs / 1000 : 0);
+}
+
+void honeylog_close(void)
+{
+	honeylog_sync();
+	fclose(logfile);
+}
@@ -0,0 +1,36 @@
+#ifndef HONEYLOG_H
+#define HONEYLOG_H
+
+#include "telnet_srv.h"
+
+/*
+ * How hard we try to get the collected credentials onto the disk.
+ */
+enum durability {
+	DURABILITY_NONE,	/* leave it to the page cache */
+	DURABILITY_GROUP,	/* the listener syncs whatever piled up, every few ms */
+	DURABILITY_DSYNC	/* every record is on disk before the session moves on */
+};
+
+/*
+ * What goes into the log: a record per session when it ends, with all of
+ * its attempts in it, and optionally a record per attempt as it happens.
+ */
+enum log_mode {
+	LOG_SESSIONS,
+	LOG_ATTEMPTS,
+	LOG_BOTH
+};
+
+int honeylog_open(const char *path, enum durability durability, int interval_ms, enum log_mode log_mode);
+int honeylog_parse_durability(const char *arg, enum durability *durability, int *interval_ms);
+int honeylog_parse_mode(const char *arg, enum log_mode *log_mode);
+void honeylog_printf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void honeylog_credential(const struct session *session, const char *username, const char *password, unsigned int seen);
+void honeylog_session_end(const struct session *session, const char *reason, const char *fingerprint);
+int honeylog_tick(void);
+void honeylog_sync(void);
+void honeylog_report(void);
+void honeylog_close(void);
+
+#endif
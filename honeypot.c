@@ -40,9 +40,12 @@
  * 
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <sched.h>
 #include <ctype.h>
 #include <unistd.h>
 #include <signal.h>
@@ -56,16 +59,76 @@
 #include <sys/stat.h>
 #include <sys/resource.h>
 #include <sys/wait.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <grp.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
 
 #include "telnet_srv.h"
+#include "session.h"
+#include "protocol.h"
+#include "flow.h"
+#include "stats.h"
+#include "overload.h"
+#include "fairness.h"
+#include "profile.h"
+#include "probes.h"
+#include "accounting.h"
+#include "honeylog.h"
+#include "ring.h"
+#include "credindex.h"
+#include "geo.h"
+#include "sampling.h"
+#include "seen.h"
+#include "rate.h"
+#include "config.h"
 
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
 
 
 
+#ifdef PGO_TRAINING
+const volatile int pgo_training = 1;
+#else
+const volatile int pgo_training = 0;
+#endif
+
+static int workers = 1;
+static int port = 23;
+static int backlog = SOMAXCONN;
+static int stats_interval = 60;
+static const char *config_file = 0;
+
+/*
+ * What we speak on which port; telnet on --port unless --listen says
+ * otherwise. Each worker has a socket for every one of them, laid out
+ * one worker after the other.
+ */
+#define LISTENERS_MAX 8
+static struct listener {
+	const struct protocol *protocol;
+	int port;		/* 0 until the options are all in */
+} listeners[LISTENERS_MAX];
+static int listener_count = 0;
+
+/* How many sessions each worker may have running at once. */
+#define SESSIONS_PER_WORKER 100
+
+/* How long we let sessions finish after SIGTERM. */
+#define DRAIN_SECONDS 10
+
+/* How many connections we take off the accept queue per wakeup. */
+#define ACCEPT_BATCH 64
+static volatile sig_atomic_t stats_due = 0;
+static volatile sig_atomic_t stopping = 0;
+static volatile sig_atomic_t reload_due = 0;
+static struct stats_shard *shard = 0;
+
 /*
  * A child has exited.
  */
@@ -75,8 +138,64 @@ static void SIGCHLD_handler(int sig)
 	int status;
 	pid_t pid;
 
-	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		stats_inc(shard, exited);
+		if (WIFEXITED(status) && WEXITSTATUS(status) == SESSION_IDLE)
+			stats_inc(shard, idle_reclaimed);
+		else if (WIFEXITED(status) && WEXITSTATUS(status) == SESSION_DEAD_PEER)
+			stats_inc(shard, dead_reclaimed);
 		printf("Process %d has exited with code %d.\n", pid, WEXITSTATUS(status));
+	}
+}
+
+/*
+ * Time to print the stats.
+ */
+static void SIGALRM_handler(int sig)
+{
+	(void) sig;
+
+	stats_due = 1;
+	alarm(stats_interval);
+}
+
+/*
+ * Time to stop accepting, let the sessions finish, and exit.
+ */
+static void SIGTERM_handler(int sig)
+{
+	(void) sig;
+
+	stopping = 1;
+}
+
+/*
+ * Time to read the config and the sampling policy again.
+ */
+static void SIGHUP_handler(int sig)
+{
+	(void) sig;
+
+	reload_due = 1;
+}
+
+/*
+ * Starts the stats alarm and takes over SIGTERM and SIGHUP. They must interrupt
+ * poll() and wait() so that we act on them right away, so no SA_RESTART
+ * here.
+ */
+static void watch_signals()
+{
+	struct sigaction action;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = SIGALRM_handler;
+	sigaction(SIGALRM, &action, NULL);
+	action.sa_handler = SIGTERM_handler;
+	sigaction(SIGTERM, &action, NULL);
+	action.sa_handler = SIGHUP_handler;
+	sigaction(SIGHUP, &action, NULL);
+	alarm(stats_interval);
 }
 
 /*
@@ -87,7 +206,9 @@ static void drop_privileges()
 	struct passwd *user;
 	struct rlimit limit;
 	
-	if (!geteuid()) {
+	if (profiling())
+		fprintf(stderr, "Warning: this is a profiling build, it does not drop privileges or sandbox sessions.\n");
+	else if (!geteuid()) {
 		user = getpwnam("nobody");
 		if (!user) {
 			perror("getpwnam");
@@ -130,7 +251,9 @@ static void drop_privileges()
 	setrlimit(RLIMIT_AS, &limit);
 	limit.rlim_cur = limit.rlim_max = 0;
 	setrlimit(RLIMIT_CORE, &limit);
-	limit.rlim_cur = limit.rlim_max = 100;
+	/* The process cap is per user, so every worker gets its own share,
+	 * on top of the workers themselves and the supervisor. */
+	limit.rlim_cur = limit.rlim_max = (SESSIONS_PER_WORKER + 1) * workers + 1;
 	setrlimit(RLIMIT_NPROC, &limit);
 
 	if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0)) {
@@ -144,33 +267,543 @@ static void drop_privileges()
 	}
 }
 
+/*
+ * The kernel silently clamps the backlog to net.core.somaxconn, so
+ * complain if that is going to happen. This has to read /proc before
+ * the chroot.
+ */
+static void check_backlog()
+{
+	FILE *file;
+	int somaxconn;
 
+	file = fopen("/proc/sys/net/core/somaxconn", "r");
+	if (!file)
+		return;
+	if (fscanf(file, "%d", &somaxconn) == 1 && somaxconn < backlog)
+		fprintf(stderr, "Warning: listen backlog %d is clamped to net.core.somaxconn = %d.\n", backlog, somaxconn);
+	fclose(file);
+}
 
-
-int main(int argc, char *argv[])
+/*
+ * Creates a socket listening on a port. When there is more than one
+ * worker, each gets its own socket and the kernel spreads the incoming
+ * connections between them with SO_REUSEPORT.
+ */
+static int open_listener(int port)
 {
-	int listen_fd, connection_fd, flag;
+	int listen_fd, flag;
 	struct sockaddr_in6 listen_addr;
-	struct sockaddr_storage connection_addr;
-	socklen_t connection_addr_len;
+
+	/* Non-blocking, so that serve() can drain the queue until it is empty. */
+	listen_fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	flag = 1;
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+	if (workers > 1 && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag)) < 0) {
+		perror("setsockopt(SO_REUSEPORT)");
+		close(listen_fd);
+		return -1;
+	}
+	flag = 0;
+	setsockopt(listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &flag, sizeof(flag));
+	
+	memset(&listen_addr, 0, sizeof(listen_addr));
+	listen_addr.sin6_family = AF_INET6;
+	listen_addr.sin6_addr = in6addr_any;
+	listen_addr.sin6_port = htons(port);
+	if (bind(listen_fd, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) < 0) {
+		perror("bind");
+		close(listen_fd);
+		return -1;
+	}
+	if (listen(listen_fd, backlog) < 0) {
+		perror("listen");
+		close(listen_fd);
+		return -1;
+	}
+	return listen_fd;
+}
+
+/*
+ * Attaches a classic BPF program to the reuseport group, which picks the
+ * socket (and so the worker) by hashing the source address. The value it
+ * returns is the index of the socket in the order they were bound, so each
+ * source always lands on the same worker, and whatever per-source state
+ * that worker keeps never has to be shared.
+ */
+static void attach_steering(int listen_fd)
+{
+	struct sock_filter filter[] = {
+		BPF_STMT(BPF_LD+BPF_H+BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, ETH_P_IPV6, 2, 0),
+		/* IPv4: the source address is at offset 12. */
+		BPF_STMT(BPF_LD+BPF_W+BPF_ABS, SKF_NET_OFF + 12),
+		BPF_STMT(BPF_JMP+BPF_JA, 4),
+		/*
+		 * IPv6: fold the two words of the /64 starting at offset 8, the
+		 * same /64 that fairness takes a source by, so that all of it
+		 * ends up on one worker.
+		 */
+		BPF_STMT(BPF_LD+BPF_W+BPF_ABS, SKF_NET_OFF + 8),
+		BPF_STMT(BPF_MISC+BPF_TAX, 0),
+		BPF_STMT(BPF_LD+BPF_W+BPF_ABS, SKF_NET_OFF + 12),
+		BPF_STMT(BPF_ALU+BPF_XOR+BPF_X, 0),
+		/* Mix the bits, since neighbouring addresses only differ at the bottom. */
+		BPF_STMT(BPF_ALU+BPF_MUL+BPF_K, 0x9e3779b1),
+		BPF_STMT(BPF_ALU+BPF_RSH+BPF_K, 16),
+		BPF_STMT(BPF_ALU+BPF_MOD+BPF_K, workers),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+	struct sock_fprog prog = {
+		.len = (unsigned short)(sizeof(filter) / sizeof(filter[0])),
+		.filter = filter
+	};
+
+	if (setsockopt(listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+		perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+}
+
+/* A connection we accepted, with fd -1 once it is handed out, parked or shed. */
+struct pending_connection {
+	int fd;
+	struct sockaddr_storage addr;
+	enum source_class class;
+	int listener;
+};
+
+/*
+ * Serves one freshly accepted connection in a child process, which has
+ * no use for the sockets of the worker it was forked from: neither the
+ * listeners, nor the rest of the batch, nor what the worker has parked.
+ * Without an exec, CLOEXEC does not get rid of them, and if the child
+ * kept them, those peers would not see us hang up until it exits.
+ */
+static void fork_connection(int *listen_fds, const struct pending_connection *batch, int batch_count, int listener, int connection_fd, struct sockaddr_storage *connection_addr, enum source_class class)
+{
+	struct session session;
+	struct in6_addr *v6;
 	pid_t child;
+	int i;
+
+	memset(&session, 0, sizeof(session));
+	session.fd = connection_fd;
+	session.protocol = listeners[listener].protocol;
+	session.listener = listener;
+	session.port = listeners[listener].port;
+	session.id = stats_next_session_id();
+	clock_gettime(CLOCK_MONOTONIC, &session.start);
+	/* Heavy sources get the sessions we would hand out at a higher load. */
+	overload_policy(&session.policy, class == SOURCE_HEAVY ? config_get()->heavy_penalty : 0);
+	if (connection_addr->ss_family == AF_INET6) {
+		v6 = &(((struct sockaddr_in6 *)connection_addr)->sin6_addr);
+		if (v6->s6_addr32[0] == 0 && v6->s6_addr32[1] == 0 && v6->s6_addr16[4] == 0 && v6->s6_addr16[5] == 0xFFFF)
+			inet_ntop(AF_INET, &v6->s6_addr32[3], session.ipaddr, INET_ADDRSTRLEN);
+		else
+			inet_ntop(AF_INET6, v6, session.ipaddr, INET6_ADDRSTRLEN);
+	} else if (connection_addr->ss_family == AF_INET)
+		inet_ntop(AF_INET, &(((struct sockaddr_in *)connection_addr)->sin_addr), session.ipaddr, INET_ADDRSTRLEN);
+	geo_lookup(connection_addr, &session.geo);
+	geo_count(&session.geo);
+	PROBE3(accept, session.id, connection_fd, (int)class);
+
+	stats_inc(shard, accepted);
+	child = fork();
+	if (child < 0) {
+		perror("fork");
+		stats_inc(shard, fork_failed);
+		close(connection_fd);
+		return;
+	}
+	if (!child) {
+		prctl(PR_SET_PDEATHSIG, SIGINT);
+		if (getppid() == 1)
+			kill(getpid(), SIGINT);
+		prctl(PR_SET_NAME, "honeypot serve");
+		signal(SIGTERM, SIG_DFL);
+		for (i = 0; i < listener_count; ++i)
+			close(listen_fds[i]);
+		for (i = 0; i < batch_count; ++i) {
+			if (batch[i].fd >= 0 && batch[i].fd != connection_fd)
+				close(batch[i].fd);
+		}
+		fairness_close_parked();
+		config_close();
+		printf("Forked process %d for connection %s, session %llx.\n", getpid(), session.ipaddr, session.id);
+		handle_connection(&session);
+		_exit(EXIT_FAILURE);
+	}
+	close(connection_fd);
+}
+
+/*
+ * Hands out sessions to a batch of accepted connections, new sources
+ * first, so that they get the slots if we run out partway through.
+ */
+static void schedule(int *listen_fds, struct pending_connection *pending, int count)
+{
+	int pass, i, load;
+
+	load = overload_load();
+	for (pass = 0; pass < 2; ++pass) {
+		for (i = 0; i < count; ++i) {
+			if ((pass == 0) != (pending[i].class == SOURCE_NEW))
+				continue;
+			switch (fairness_admit(pending[i].class, load)) {
+				case ADMIT:
+					if (pending[i].class == SOURCE_NEW)
+						stats_inc(shard, new_sources);
+					fork_connection(listen_fds, pending, count, pending[i].listener, pending[i].fd, &pending[i].addr, pending[i].class);
+					load = overload_load();
+					break;
+				case PARK:
+					if (!fairness_park(pending[i].fd)) {
+						stats_inc(shard, parked);
+						break;
+					}
+					/* Fall through - there is no room to park it. */
+				case SHED:
+					stats_inc(shard, shed);
+					close(pending[i].fd);
+					break;
+			}
+			pending[i].fd = -1;
+		}
+	}
+}
+
+/*
+ * Puts a config into effect, whether it is the first or a reload.
+ * Sessions that are already running keep what they were forked with.
+ */
+static void apply_config(void)
+{
+	const struct config *config = config_get();
+
+	prepare_screens(config->persona);
+	if (config->sample)
+		sampling_set_rate(config->sample);
+}
+
+static void reload_config(void)
+{
+	if (config_file && !config_reload())
+		apply_config();
+}
+
+/*
+ * Takes what is waiting on a listener off its accept queue, adding it to
+ * the batch until the queue is empty or the batch is full. Returns how
+ * big the batch is now.
+ */
+static int accept_batch(int listen_fd, int listener, struct pending_connection *pending, int count)
+{
+	socklen_t connection_addr_len;
+	int connection_fd;
+
+	while (count < ACCEPT_BATCH) {
+		connection_addr_len = sizeof(pending[count].addr);
+		connection_fd = accept4(listen_fd, (struct sockaddr *)&pending[count].addr, &connection_addr_len, SOCK_CLOEXEC);
+		if (connection_fd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			/* The peer gave up before we got to it. */
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept4");
+			/* Out of descriptors or memory; back off rather than spin. */
+			usleep(10000);
+			break;
+		}
+		if (config_ignored(&pending[count].addr)) {
+			stats_inc(shard, ignored);
+			close(connection_fd);
+			continue;
+		}
+		rate_accept(listener);
+		pending[count].fd = connection_fd;
+		pending[count].class = fairness_classify(&pending[count].addr);
+		pending[count].listener = listener;
+		++count;
+	}
+	return count;
+}
+
+/*
+ * Accepts connections forever on every listener of the worker, forking
+ * off a child for each one. Every wakeup drains the accept queues in a
+ * batch, so that a burst of SYNs does not sit in the backlog while we go
+ * around poll() once per connection, and so that sources are treated the
+ * same whichever port they come in on. The connections themselves stay
+ * blocking, since the children talk to them through stdio.
+ */
+static void serve(int *listen_fds)
+{
+	static struct pending_connection pending[ACCEPT_BATCH];
+	struct pollfd pfds[LISTENERS_MAX];
+	int count, timeout, log_timeout, i;
+
+	for (i = 0; i < listener_count; ++i) {
+		pfds[i].fd = listen_fds[i];
+		pfds[i].events = POLLIN;
+	}
+	while (!stopping) {
+		if (stats_due) {
+			stats_due = 0;
+			stats_report();
+			overload_report();
+			accounting_report();
+			honeylog_report();
+			geo_report();
+			sampling_report();
+			seen_report();
+			rate_report();
+		}
+		if (reload_due) {
+			reload_due = 0;
+			sampling_reload();
+			reload_config();
+		}
+		timeout = fairness_expire();
+		log_timeout = honeylog_tick();
+		if (log_timeout >= 0 && (timeout < 0 || log_timeout < timeout))
+			timeout = log_timeout;
+		if (poll(pfds, listener_count, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return;
+		}
+		for (i = 0, count = 0; i < listener_count; ++i) {
+			if (pfds[i].revents & POLLIN)
+				count = accept_batch(listen_fds[i], i, pending, count);
+		}
+		schedule(listen_fds, pending, count);
+	}
+}
+
+/*
+ * Gives the sessions that are still running a few seconds to finish.
+ */
+static void drain()
+{
+	int waited;
+
+	for (waited = 0; waited < DRAIN_SECONDS * 10; ++waited) {
+		if (shard->accepted - shard->fork_failed - shard->exited == 0)
+			break;
+		usleep(100000);
+	}
+}
+
+/*
+ * Prints how much CPU time we spent per session, which is what sizes a
+ * deployment. Sessions only count once they have been reaped, so call
+ * drain() first.
+ */
+static void report_usage()
+{
+	struct rusage self, children;
+	unsigned long long sessions;
+	long long self_us, children_us;
+
+	getrusage(RUSAGE_SELF, &self);
+	getrusage(RUSAGE_CHILDREN, &children);
+	self_us = (self.ru_utime.tv_sec + self.ru_stime.tv_sec) * 1000000LL + self.ru_utime.tv_usec + self.ru_stime.tv_usec;
+	children_us = (children.ru_utime.tv_sec + children.ru_stime.tv_sec) * 1000000LL + children.ru_utime.tv_usec + children.ru_stime.tv_usec;
+	sessions = shard->exited;
+	printf("Served %llu sessions, using %lld ms of CPU in the listener and %lld ms in the sessions, %lld us per session.\n",
+		sessions, self_us / 1000, children_us / 1000, sessions ? (self_us + children_us) / (long long)sessions : 0);
+}
+
+/*
+ * Pins the calling process to the index'th CPU we are allowed to run on.
+ */
+static void pin_to_cpu(int index, cpu_set_t *allowed)
+{
+	cpu_set_t set;
+	int cpu, count = CPU_COUNT(allowed);
+
+	if (!count)
+		return;
+	index %= count;
+	for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (CPU_ISSET(cpu, allowed) && !index--)
+			break;
+	}
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0)
+		perror("sched_setaffinity");
+	else
+		printf("Worker %d pinned to CPU %d.\n", getpid(), cpu);
+}
+
+/*
+ * Forks off a worker that runs its own accept loop on its own sockets.
+ */
+static pid_t spawn_worker(int index, int *listen_fds, cpu_set_t *allowed)
+{
+	pid_t pid;
+	int i;
+
+	pid = fork();
+	if (pid)
+		return pid;
+
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	if (getppid() == 1)
+		kill(getpid(), SIGTERM);
+	prctl(PR_SET_NAME, "honeypot worker");
+	for (i = 0; i < workers * listener_count; ++i) {
+		if (i / listener_count != index)
+			close(listen_fds[i]);
+	}
+	pin_to_cpu(index, allowed);
+	shard = stats_shard(index);
+	watch_signals();
+	/* The supervisor does the reporting. */
+	alarm(0);
+	signal(SIGCHLD, SIGCHLD_handler);
+	listen_fds += index * listener_count;
+	serve(listen_fds);
+	if (!stopping)
+		_exit(EXIT_FAILURE);
+	for (i = 0; i < listener_count; ++i)
+		close(listen_fds[i]);
+	drain();
+	honeylog_sync();
+	report_usage();
+	exit(EXIT_SUCCESS);
+}
+
+/*
+ * Keeps one worker per set of sockets running, and reports on their behalf.
+ */
+static void supervise(int *listen_fds)
+{
+	cpu_set_t allowed;
+	pid_t *pids, pid;
+	int i, status;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+		perror("sched_getaffinity");
+		CPU_ZERO(&allowed);
+	}
+	pids = calloc(workers, sizeof(*pids));
+	if (!pids) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < workers; ++i) {
+		pids[i] = spawn_worker(i, listen_fds, &allowed);
+		if (pids[i] < 0)
+			perror("fork");
+	}
+
+	watch_signals();
+
+	while (!stopping) {
+		pid = wait(&status);
+		if (stats_due) {
+			stats_due = 0;
+			stats_report();
+			overload_report();
+			accounting_report();
+			honeylog_report();
+			geo_report();
+			sampling_report();
+			seen_report();
+			rate_report();
+		}
+		/* The workers reload for themselves, and we do too, so that workers
+		 * we restart later start out with what is in effect. */
+		if (reload_due) {
+			reload_due = 0;
+			reload_config();
+			for (i = 0; i < workers; ++i) {
+				if (pids[i] > 0)
+					kill(pids[i], SIGHUP);
+			}
+		}
+		if (stopping)
+			break;
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			/* Every worker failed to fork; try again shortly. */
+			sleep(1);
+		}
+		for (i = 0; i < workers; ++i) {
+			if (pids[i] > 0 && pids[i] != pid)
+				continue;
+			if (pids[i] > 0)
+				printf("Worker %d has exited with code %d, restarting.\n", pid, WEXITSTATUS(status));
+			sleep(1);
+			pids[i] = spawn_worker(i, listen_fds, &allowed);
+			if (pids[i] < 0)
+				perror("fork");
+			break;
+		}
+	}
+
+	/* Pass the SIGTERM on, and wait for the workers to drain. */
+	for (i = 0; i < workers; ++i) {
+		if (pids[i] > 0)
+			kill(pids[i], SIGTERM);
+	}
+	while (wait(&status) > 0 || errno == EINTR);
+	accounting_report();
+}
+
+
+
+
+int main(int argc, char *argv[])
+{
+	int *listen_fds, i, j;
 
-	int daemonize = 0, option_index = 0, debug_file, option;
-	char *debug_log = 0, *honey_log = 0, *pid_file = 0;
-	FILE *pidfile;
+	int daemonize = 0, accounting = 0, option_index = 0, debug_file, option, durability_interval = 0;
+	enum durability durability = DURABILITY_NONE;
+	enum log_mode log_mode = LOG_SESSIONS;
+	char *debug_log = 0, *honey_log = 0, *pid_file = 0, *ring_file = 0, *index_file = 0, *geo_file = 0, *sample = 0, *flow_file = 0, *rate_file = 0, *separator;
+	unsigned long long ring_slots = RING_DEFAULT_SLOTS, index_entries = CREDINDEX_DEFAULT_ENTRIES;
+	unsigned long counters = SEEN_DEFAULT_ENTRIES;
+	char sample_rate[16];
+	const struct protocol *protocol;
+	FILE *pidfile = 0;
 	static struct option long_options[] = {
 		{"daemonize", no_argument, NULL, 'd'},
 		{"foreground", no_argument, NULL, 'f'},
 		{"debug-log", required_argument, NULL, 'l'},
 		{"honey-log", required_argument, NULL, 'o'},
 		{"pid-file", required_argument, NULL, 'p'},
+		{"port", required_argument, NULL, 'P'},
+		{"listen", required_argument, NULL, 't'},
+		{"backlog", required_argument, NULL, 'b'},
+		{"workers", required_argument, NULL, 'w'},
+		{"stats-interval", required_argument, NULL, 's'},
+		{"accounting", no_argument, NULL, 'a'},
+		{"durability", required_argument, NULL, 'D'},
+		{"log-mode", required_argument, NULL, 'L'},
+		{"ring", required_argument, NULL, 'r'},
+		{"index", required_argument, NULL, 'i'},
+		{"geo", required_argument, NULL, 'g'},
+		{"sample", required_argument, NULL, 'S'},
+		{"config", required_argument, NULL, 'c'},
+		{"flow", required_argument, NULL, 'F'},
+		{"counters", required_argument, NULL, 'C'},
+		{"rates", required_argument, NULL, 'R'},
 		{"help", no_argument, NULL, 'h'},
 		{0, 0, 0, 0}
 	};
 
 	close(STDIN_FILENO);
 
-	while ((option = getopt_long(argc, argv, "dfl:o:p:h", long_options, &option_index)) != -1) {
+	while ((option = getopt_long(argc, argv, "dfl:o:p:P:t:b:w:s:aD:L:r:i:g:S:c:F:C:R:h", long_options, &option_index)) != -1) {
 		switch (option) {
 			case 'd':
 				daemonize = 1;
@@ -187,6 +820,111 @@ int main(int argc, char *argv[])
 			case 'p':
 				pid_file = optarg;
 				break;
+			case 'P':
+				port = atoi(optarg);
+				if (port <= 0 || port > 65535) {
+					fprintf(stderr, "Invalid port: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 't':
+				separator = strchr(optarg, ':');
+				if (separator)
+					*separator = 0;
+				protocol = protocol_find(optarg);
+				if (!protocol) {
+					fprintf(stderr, "Unknown protocol: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				if (listener_count == LISTENERS_MAX) {
+					fprintf(stderr, "Too many listeners, at most %d.\n", LISTENERS_MAX);
+					return EXIT_FAILURE;
+				}
+				listeners[listener_count].protocol = protocol;
+				listeners[listener_count].port = 0;
+				if (separator) {
+					listeners[listener_count].port = atoi(separator + 1);
+					if (listeners[listener_count].port <= 0 || listeners[listener_count].port > 65535) {
+						fprintf(stderr, "Invalid port: %s\n", separator + 1);
+						return EXIT_FAILURE;
+					}
+				}
+				++listener_count;
+				break;
+			case 'b':
+				backlog = atoi(optarg);
+				if (backlog < 1)
+					backlog = SOMAXCONN;
+				break;
+			case 'w':
+				workers = atoi(optarg);
+				if (!workers)
+					workers = sysconf(_SC_NPROCESSORS_ONLN);
+				if (workers < 1)
+					workers = 1;
+				break;
+			case 's':
+				stats_interval = atoi(optarg);
+				if (stats_interval < 0)
+					stats_interval = 0;
+				break;
+			case 'a':
+				accounting = 1;
+				break;
+			case 'D':
+				if (honeylog_parse_durability(optarg, &durability, &durability_interval) < 0) {
+					fprintf(stderr, "Invalid durability mode: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'L':
+				if (honeylog_parse_mode(optarg, &log_mode) < 0) {
+					fprintf(stderr, "Invalid log mode: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'r':
+				ring_file = optarg;
+				separator = strrchr(optarg, ':');
+				if (separator) {
+					*separator = 0;
+					ring_slots = strtoull(separator + 1, NULL, 10);
+					if (!ring_slots) {
+						fprintf(stderr, "Invalid ring size: %s\n", separator + 1);
+						return EXIT_FAILURE;
+					}
+				}
+				break;
+			case 'i':
+				index_file = optarg;
+				separator = strrchr(optarg, ':');
+				if (separator) {
+					*separator = 0;
+					index_entries = strtoull(separator + 1, NULL, 10);
+					if (!index_entries) {
+						fprintf(stderr, "Invalid index size: %s\n", separator + 1);
+						return EXIT_FAILURE;
+					}
+				}
+				break;
+			case 'g':
+				geo_file = optarg;
+				break;
+			case 'S':
+				sample = optarg;
+				break;
+			case 'c':
+				config_file = optarg;
+				break;
+			case 'F':
+				flow_file = optarg;
+				break;
+			case 'C':
+				counters = strtoul(optarg, NULL, 10);
+				break;
+			case 'R':
+				rate_file = optarg;
+				break;
 			case 'h':
 			case '?':
 			default:
@@ -197,6 +935,37 @@ int main(int argc, char *argv[])
 				fprintf(stderr, "  -l FILE, --debug-log=FILE    log debug messages to FILE instead of to stdout/stderr\n");
 				fprintf(stderr, "  -o FILE, --honey-log=FILE    log collected honey information to FILE\n");
 				fprintf(stderr, "  -p FILE, --pid-file=FILE     write pid of listener process to FILE\n");
+				fprintf(stderr, "  -P PORT, --port=PORT         listen on PORT instead of the telnet port 23\n");
+				fprintf(stderr, "  -t PROTO[:PORT], --listen=PROTO[:PORT]\n");
+				fprintf(stderr, "                               speak PROTO on PORT, which defaults to the usual port of\n");
+				fprintf(stderr, "                               PROTO, or to --port for telnet and flow; can be given more\n");
+				fprintf(stderr, "                               than once, for telnet, ftp, pop3, http and flow (default telnet)\n");
+				fprintf(stderr, "  -b N, --backlog=N            allow N connections to queue up in the kernel (default %d)\n", SOMAXCONN);
+				fprintf(stderr, "  -w N, --workers=N            run N pinned listener processes, 0 for one per CPU (default 1)\n");
+				fprintf(stderr, "  -s SECS, --stats-interval=SECS\n");
+				fprintf(stderr, "                               print stats every SECS seconds, 0 to disable (default 60)\n");
+				fprintf(stderr, "  -a, --accounting             report the CPU time and I/O calls sessions cost\n");
+				fprintf(stderr, "  -D MODE, --durability=MODE   when to sync the honey log: none (default), group[:MS]\n");
+				fprintf(stderr, "                               to sync every MS ms (default 100), or dsync for every record\n");
+				fprintf(stderr, "  -L MODE, --log-mode=MODE     sessions (default) logs a record per session when it ends,\n");
+				fprintf(stderr, "                               attempts one per attempt as it comes in, or both; the\n");
+				fprintf(stderr, "                               ring gets every attempt as it comes in either way\n");
+				fprintf(stderr, "  -r FILE[:N], --ring=FILE[:N] also keep the last N honey log records in FILE, which\n");
+				fprintf(stderr, "                               survives crashes and can be read with honeyring (default %d)\n", RING_DEFAULT_SLOTS);
+				fprintf(stderr, "  -i FILE[:N], --index=FILE[:N]\n");
+				fprintf(stderr, "                               index up to N passwords in FILE, for honeyquery (default %d)\n", CREDINDEX_DEFAULT_ENTRIES);
+				fprintf(stderr, "  -g FILE, --geo=FILE          tag sources with their ASN and country from FILE, an\n");
+				fprintf(stderr, "                               ip2asn TSV prefix database as published by iptoasn.com\n");
+				fprintf(stderr, "  -S N, --sample=N             under load, log new credentials and sources in full but only\n");
+				fprintf(stderr, "                               1 in N repeats, and count the rest; N can also be read from\n");
+				fprintf(stderr, "                               a file, which is read again on SIGHUP\n");
+				fprintf(stderr, "  -c FILE, --config=FILE       read timeouts, limits, the persona, the sampling rate and\n");
+				fprintf(stderr, "                               prefixes to ignore from FILE, and again on SIGHUP\n");
+				fprintf(stderr, "  -F FILE, --flow=FILE         run the session script in FILE for the flow protocol\n");
+				fprintf(stderr, "  -C N, --counters=N           count tries of up to N credentials and sessions of up to N\n");
+				fprintf(stderr, "                               sources across sessions, 0 to disable (default %d)\n", SEEN_DEFAULT_ENTRIES);
+				fprintf(stderr, "  -R FILE, --rates=FILE        keep the per second, minute and hour rates in FILE, where\n");
+				fprintf(stderr, "                               honeyrate and dashboards can read them\n");
 				fprintf(stderr, "  -h, --help                   display this message\n");
 				return option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
 		}
@@ -219,41 +988,90 @@ int main(int argc, char *argv[])
 		setbuf(stdout, NULL);
 		setbuf(stderr, NULL);
 	}
+	if (profiling() && !__gcov_dump) {
+		fprintf(stderr, "This is a training build without libgcov, it would only run unsandboxed for nothing.\n");
+		return EXIT_FAILURE;
+	}
+	if (!profiling() && __gcov_dump) {
+		fprintf(stderr, "This build links libgcov but was not built for training with make pgo, refusing to start.\n");
+		return EXIT_FAILURE;
+	}
 	if (!honey_log) {
 		fprintf(stderr, "Warning: collected honey information is not being logged anywhere. See the --honey-log option.\n");
 		honey_log = "/dev/null";
 	}
 	
 	/* We open the log file before chrooting. */
-	logfile = fopen(honey_log, "a");
-	if (!logfile) {
-		perror("fopen");
+	if (honeylog_open(honey_log, durability, durability_interval, log_mode) < 0)
 		return EXIT_FAILURE;
-	}
-	
-	/* We bind to port 23 before chrooting, as well. */
-	listen_fd = socket(AF_INET6, SOCK_STREAM, 0);
-	if (listen_fd < 0) {
-		perror("socket");
+	if (durability != DURABILITY_NONE && log_mode == LOG_SESSIONS)
+		fprintf(stderr, "Warning: with --log-mode=sessions, attempts only reach the log when their session ends, and not at all if it is killed. See --log-mode=both, or --ring.\n");
+	if (ring_file && ring_open(ring_file, ring_slots) < 0)
+		return EXIT_FAILURE;
+	if (index_file && credindex_open(index_file, index_entries) < 0)
+		return EXIT_FAILURE;
+	if (geo_file && geo_load(geo_file) < 0)
 		return EXIT_FAILURE;
+	if (config_file && config_open(config_file) < 0)
+		return EXIT_FAILURE;
+	if (flow_file && flow_load(flow_file) < 0)
+		return EXIT_FAILURE;
+	if (!sample && config_get()->sample) {
+		snprintf(sample_rate, sizeof(sample_rate), "%d", config_get()->sample);
+		sample = sample_rate;
 	}
-	flag = 1;
-	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
-	flag = 0;
-	setsockopt(listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &flag, sizeof(flag));
-	
-	memset(&listen_addr, 0, sizeof(listen_addr));
-	listen_addr.sin6_family = AF_INET6;
-	listen_addr.sin6_addr = in6addr_any;
-	listen_addr.sin6_port = htons(23);
-	if (bind(listen_fd, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) < 0) {
-		perror("bind");
+	if (sample && sampling_init(sample) < 0)
+		return EXIT_FAILURE;
+	if (counters && seen_init(counters) < 0)
 		return EXIT_FAILURE;
+	
+	if (!listener_count)
+		listeners[listener_count++].protocol = &telnet_protocol;
+	for (i = 0; i < listener_count; ++i) {
+		if (!listeners[i].port)
+			listeners[i].port = listeners[i].protocol == &telnet_protocol || listeners[i].protocol == &flow_protocol ? port : listeners[i].protocol->port;
+		if (listeners[i].protocol == &flow_protocol && !flow_loaded()) {
+			fprintf(stderr, "Listening for flow needs a script. See the --flow option.\n");
+			return EXIT_FAILURE;
+		}
+		for (j = 0; j < i; ++j) {
+			if (listeners[j].port == listeners[i].port) {
+				fprintf(stderr, "Port %d is taken by both %s and %s.\n", listeners[i].port, listeners[j].protocol->name, listeners[i].protocol->name);
+				return EXIT_FAILURE;
+			}
+		}
 	}
-	if (listen(listen_fd, 5) < 0) {
-		perror("listen");
+	if (rate_open(rate_file) < 0)
 		return EXIT_FAILURE;
+	for (i = 0; i < listener_count; ++i)
+		rate_listener(i, listeners[i].protocol->name, listeners[i].port);
+
+	/* We bind to port 23 and the others before chrooting, as well. */
+	check_backlog();
+	listen_fds = calloc(workers * listener_count, sizeof(*listen_fds));
+	if (!listen_fds) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < workers; ++i) {
+		for (j = 0; j < listener_count; ++j) {
+			listen_fds[i * listener_count + j] = open_listener(listeners[j].port);
+			if (listen_fds[i * listener_count + j] < 0)
+				return EXIT_FAILURE;
+		}
 	}
+	/* Every port is its own reuseport group, steered the same way. */
+	for (j = 0; workers > 1 && j < listener_count; ++j)
+		attach_steering(listen_fds[j]);
+	for (j = 0; j < listener_count; ++j)
+		printf("Listening for %s on port %d.\n", listeners[j].protocol->name, listeners[j].port);
+	if (stats_init(workers) < 0)
+		return EXIT_FAILURE;
+	stats_watch_netstat();
+	overload_init(SESSIONS_PER_WORKER * workers);
+	if (accounting && accounting_init() < 0)
+		return EXIT_FAILURE;
+	shard = stats_shard(0);
 
 	if (pid_file) {
 		pidfile = fopen(pid_file, "w");
@@ -276,45 +1094,32 @@ int main(int argc, char *argv[])
 		fclose(pidfile);
 	}
 	
+	apply_config();
+
 	/* Before accepting any connections, we chroot. */
 	drop_privileges();
 
+	if (workers > 1) {
+		prctl(PR_SET_NAME, "honeypot super");
+		supervise(listen_fds);
+		honeylog_close();
+		honeylog_report();
+		return 0;
+	}
+
 	prctl(PR_SET_NAME, "honeypot listen");
 	
 	/* Print message when child exits. */
 	signal(SIGCHLD, SIGCHLD_handler);
+	watch_signals();
 	
-	while ((connection_addr_len = sizeof(connection_addr)) &&
-		(connection_fd = accept(listen_fd, (struct sockaddr *)&connection_addr, &connection_addr_len)) >= 0) {
-		child = fork();
-		if (child < 0) {
-			perror("fork");
-			close(connection_fd);
-			continue;
-		}
-		if (!child) {
-			char ipaddr[INET6_ADDRSTRLEN];
-			struct in6_addr *v6;
-			prctl(PR_SET_PDEATHSIG, SIGINT);
-			if (getppid() == 1)
-				kill(getpid(), SIGINT);
-			prctl(PR_SET_NAME, "honeypot serve");
-			close(listen_fd);
-			memset(ipaddr, 0, sizeof(ipaddr));
-			if (connection_addr.ss_family == AF_INET6) {
-				v6 = &(((struct sockaddr_in6 *)&connection_addr)->sin6_addr);
-				if (v6->s6_addr32[0] == 0 && v6->s6_addr32[1] == 0 && v6->s6_addr16[4] == 0 && v6->s6_addr16[5] == 0xFFFF)
-					inet_ntop(AF_INET, &v6->s6_addr32[3], ipaddr, INET_ADDRSTRLEN);
-				else
-					inet_ntop(AF_INET6, v6, ipaddr, INET6_ADDRSTRLEN);
-			} else if (connection_addr.ss_family == AF_INET)
-				inet_ntop(AF_INET, &(((struct sockaddr_in *)&connection_addr)->sin_addr), ipaddr, INET_ADDRSTRLEN);
-			printf("Forked process %d for connection %s.\n", getpid(), ipaddr);
-			handle_connection(connection_fd, ipaddr);
-			_exit(EXIT_FAILURE);
-		} else
-			close(connection_fd);
-	}
-	fclose(logfile);
+	serve(listen_fds);
+	for (i = 0; i < listener_count; ++i)
+		close(listen_fds[i]);
+	drain();
+	report_usage();
+	accounting_report();
+	honeylog_close();
+	honeylog_report();
 	return 0;
 }
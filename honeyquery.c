@@ -0,0 +1,147 @@
+/*
+ * honeyquery.c
+ *
+ *
+ * Looks passwords up in a honeypot's credential index (see --index):
+ * when each was first and last seen, how many times, and from where.
+ *     ./honeyquery /var/lib/honeypot/index xc3511 vizxv
+ *     ./honeyquery --top=20 /var/lib/honeypot/index
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "credindex.h"
+
+static void format_time(char *buffer, size_t size, uint64_t seconds)
+{
+	time_t when = seconds;
+	struct tm tm;
+
+	strftime(buffer, size, "%Y-%m-%d %H:%M:%S", localtime_r(&when, &tm));
+}
+
+static void print_entry(const struct credindex_entry *entry)
+{
+	char first[32], last[32], source[INET6_ADDRSTRLEN];
+	uint32_t i, sources = entry->source_count < CREDINDEX_SOURCES ? entry->source_count : CREDINDEX_SOURCES;
+
+	format_time(first, sizeof(first), entry->first_seen);
+	format_time(last, sizeof(last), entry->last_seen);
+	printf("%.*s: %llu times, first seen %s, last seen %s, from", (int)entry->password_len, entry->password,
+		(unsigned long long)entry->count, first, last);
+	for (i = 0; i < sources; ++i) {
+		if (!memcmp(entry->sources[i], "\0\0\0\0\0\0\0\0\0\0\xff\xff", 12))
+			inet_ntop(AF_INET, entry->sources[i] + 12, source, sizeof(source));
+		else
+			inet_ntop(AF_INET6, entry->sources[i], source, sizeof(source));
+		printf("%s %s", i ? "," : "", source);
+	}
+	if (entry->source_count > sources)
+		printf(" and %u more", entry->source_count - sources);
+	printf("\n");
+}
+
+static int by_count(const void *a, const void *b)
+{
+	const struct credindex_entry *x = *(const struct credindex_entry **)a, *y = *(const struct credindex_entry **)b;
+
+	return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int option, option_index = 0, top = 0, fd, i, status = EXIT_SUCCESS;
+	struct credindex_header *header;
+	struct credindex_entry *entry, **sorted;
+	uint64_t used, slot;
+	struct stat sbuf;
+	static struct option long_options[] = {
+		{"top", required_argument, NULL, 't'},
+		{"help", no_argument, NULL, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	while ((option = getopt_long(argc, argv, "t:h", long_options, &option_index)) != -1) {
+		switch (option) {
+			case 't':
+				top = atoi(optarg);
+				break;
+			case 'h':
+			case '?':
+			default:
+				fprintf(stderr, "Usage: %s [OPTION]... INDEX [PASSWORD]...\n", argv[0]);
+				fprintf(stderr, "  -t N, --top=N                list the N most tried passwords\n");
+				fprintf(stderr, "  -h, --help                   display this message\n");
+				return option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc || top < 0 || (!top && optind == argc - 1)) {
+		fprintf(stderr, "Invalid arguments.\n");
+		return EXIT_FAILURE;
+	}
+
+	fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror("open");
+		return EXIT_FAILURE;
+	}
+	if (fstat(fd, &sbuf) < 0) {
+		perror("fstat");
+		return EXIT_FAILURE;
+	}
+	if ((size_t)sbuf.st_size < sizeof(*header)) {
+		fprintf(stderr, "%s is not a credential index.\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+	header = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED) {
+		perror("mmap");
+		return EXIT_FAILURE;
+	}
+	close(fd);
+	if (header->magic != CREDINDEX_MAGIC || header->version != CREDINDEX_VERSION || header->entry_size != CREDINDEX_ENTRY_SIZE ||
+	    !header->entry_count || (size_t)sbuf.st_size != sizeof(*header) + header->entry_count * CREDINDEX_ENTRY_SIZE) {
+		fprintf(stderr, "%s is not a credential index we understand.\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	for (i = optind + 1; i < argc; ++i) {
+		entry = credindex_find(header, argv[i], strlen(argv[i]));
+		if (entry)
+			print_entry(entry);
+		else {
+			printf("%s: never seen\n", argv[i]);
+			status = EXIT_FAILURE;
+		}
+	}
+
+	if (top) {
+		sorted = calloc(header->entry_count, sizeof(*sorted));
+		if (!sorted) {
+			perror("calloc");
+			return EXIT_FAILURE;
+		}
+		for (used = 0, slot = 0; slot < header->entry_count; ++slot) {
+			entry = &credindex_entries(header)[slot];
+			if (entry->hash && !(entry->hash & CREDINDEX_BUSY))
+				sorted[used++] = entry;
+		}
+		qsort(sorted, used, sizeof(*sorted), by_count);
+		for (slot = 0; slot < used && slot < (uint64_t)top; ++slot)
+			print_entry(sorted[slot]);
+		if (header->full)
+			printf("The index is full; %llu passwords were not indexed.\n", (unsigned long long)header->full);
+	}
+	return status;
+}
@@ -0,0 +1,188 @@
+/*
+ * honeyrate.c
+ *
+ *
+ * Prints the rates in a honeypot's rates file (see --rates): connections
+ * and attempts per second over the last 10 seconds, minute, five minutes,
+ * hour and day, for every listener, persona and busy source, or the
+ * buckets of one of them, e.g. to see the last scan wave come and go:
+ *     ./honeyrate /var/lib/honeypot/rates
+ *     ./honeyrate --follow /var/lib/honeypot/rates
+ *     ./honeyrate --series="attempts on telnet:23" --resolution=minute /var/lib/honeypot/rates
+ *
+ * Reading is only loads from the mapping, so it can be done as often as
+ * a dashboard likes without the honeypot noticing.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rate.h"
+
+/*
+ * What a series is called, which for personas and sources is only the
+ * persona or the source, going by where it is in the file.
+ */
+static void series_label(struct rate_header *header, int index, char *label, size_t size)
+{
+	struct rate_series *series = &rate_series(header)[index];
+	const char *prefix = index < 2 * RATE_LISTENERS ? "" : index < 2 * RATE_LISTENERS + RATE_PERSONAS ? "attempts as " : "attempts from ";
+
+	snprintf(label, size, "%s%.*s", prefix, (int)sizeof(series->name), series->name);
+}
+
+static int series_live(struct rate_series *series)
+{
+	uint64_t key = __atomic_load_n(&series->key, __ATOMIC_ACQUIRE);
+
+	return key && !(key & RATE_BUSY);
+}
+
+static void print_table(struct rate_header *header)
+{
+	struct rate_series *series;
+	char label[80];
+	uint64_t now = time(NULL);
+	int i;
+
+	printf("%-40s %8s %8s %8s %8s %8s\n", "per second", "10s", "1m", "5m", "1h", "24h");
+	for (i = 0; i < RATE_SERIES_MAX; ++i) {
+		series = &rate_series(header)[i];
+		if (!series_live(series))
+			continue;
+		series_label(header, i, label, sizeof(label));
+		printf("%-40s %8.2f %8.2f %8.2f %8.2f %8.2f\n", label,
+			rate_sum(series, RATE_SECOND, 10, now) / 10.0,
+			rate_sum(series, RATE_SECOND, 60, now) / 60.0,
+			rate_sum(series, RATE_SECOND, 300, now) / 300.0,
+			rate_sum(series, RATE_MINUTE, 60, now) / 3600.0,
+			rate_sum(series, RATE_HOUR, 24, now) / 86400.0);
+	}
+}
+
+/*
+ * Prints every whole bucket the series has at the resolution, oldest
+ * first, as when it started and how many there were in it.
+ */
+static int print_series(struct rate_header *header, const char *name, enum rate_resolution resolution)
+{
+	struct rate_series *series = 0;
+	char label[80], when[32];
+	uint32_t slot, i;
+	time_t start;
+	struct tm tm;
+
+	for (i = 0; i < RATE_SERIES_MAX && !series; ++i) {
+		series_label(header, i, label, sizeof(label));
+		if (series_live(&rate_series(header)[i]) && !strcmp(label, name))
+			series = &rate_series(header)[i];
+	}
+	if (!series) {
+		fprintf(stderr, "No series called %s.\n", name);
+		return -1;
+	}
+	slot = time(NULL) / rate_span(resolution);
+	for (i = rate_size(resolution) - 1; i > 0; --i) {
+		start = (time_t)(slot - i) * rate_span(resolution);
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&start, &tm));
+		printf("%s %u\n", when, rate_bucket(series, resolution, slot - i));
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int option, option_index = 0, follow = 0, fd;
+	enum rate_resolution resolution = RATE_SECOND;
+	struct rate_header *header;
+	const char *name = 0;
+	struct stat sbuf;
+	static struct option long_options[] = {
+		{"series", required_argument, NULL, 's'},
+		{"resolution", required_argument, NULL, 'r'},
+		{"follow", no_argument, NULL, 'f'},
+		{"help", no_argument, NULL, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	while ((option = getopt_long(argc, argv, "s:r:fh", long_options, &option_index)) != -1) {
+		switch (option) {
+			case 's':
+				name = optarg;
+				break;
+			case 'r':
+				if (!strcmp(optarg, "second"))
+					resolution = RATE_SECOND;
+				else if (!strcmp(optarg, "minute"))
+					resolution = RATE_MINUTE;
+				else if (!strcmp(optarg, "hour"))
+					resolution = RATE_HOUR;
+				else {
+					fprintf(stderr, "Invalid resolution: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'f':
+				follow = 1;
+				break;
+			case 'h':
+			case '?':
+			default:
+				fprintf(stderr, "Usage: %s [OPTION]... RATES\n", argv[0]);
+				fprintf(stderr, "  -s NAME, --series=NAME       print the buckets of the series NAME, as listed\n");
+				fprintf(stderr, "  -r RES, --resolution=RES     of a second (default), a minute or an hour each\n");
+				fprintf(stderr, "  -f, --follow                 print the rates again every second\n");
+				fprintf(stderr, "  -h, --help                   display this message\n");
+				return option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "Invalid arguments.\n");
+		return EXIT_FAILURE;
+	}
+
+	fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror("open");
+		return EXIT_FAILURE;
+	}
+	if (fstat(fd, &sbuf) < 0) {
+		perror("fstat");
+		return EXIT_FAILURE;
+	}
+	if ((size_t)sbuf.st_size != sizeof(*header) + RATE_SERIES_MAX * sizeof(struct rate_series)) {
+		fprintf(stderr, "%s is not a rates file we understand.\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+	header = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED) {
+		perror("mmap");
+		return EXIT_FAILURE;
+	}
+	close(fd);
+	if (header->magic != RATE_MAGIC || header->version != RATE_VERSION || header->series_count != RATE_SERIES_MAX) {
+		fprintf(stderr, "%s is not a rates file we understand.\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	if (name)
+		return print_series(header, name, resolution) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	for (;;) {
+		print_table(header);
+		if (!follow)
+			break;
+		printf("\n");
+		fflush(stdout);
+		sleep(1);
+	}
+	return EXIT_SUCCESS;
+}
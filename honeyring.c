@@ -0,0 +1,131 @@
+/*
+ * honeyring.c
+ *
+ *
+ * Prints the records in a honeypot's ring file (see --ring), oldest first,
+ * e.g. to see what was captured in the minutes before a crash:
+ *     ./honeyring --minutes=10 /var/lib/honeypot/ring
+ *     ./honeyring --follow /var/lib/honeypot/ring
+ *
+ * Works on the file of a running honeypot as well as on one left behind;
+ * records that were torn by a crash fail their checksum and are skipped.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ring.h"
+
+static void print_record(const struct ring_slot *slot, uint64_t seq)
+{
+	char when[32];
+	time_t seconds = slot->time_ns / 1000000000ULL;
+	struct tm tm;
+
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&seconds, &tm));
+	printf("%s.%03llu %llu %.*s\n", when, (unsigned long long)(slot->time_ns / 1000000 % 1000),
+		(unsigned long long)seq, (int)slot->len, slot->data);
+}
+
+int main(int argc, char *argv[])
+{
+	int option, option_index = 0, minutes = 0, follow = 0, stalls = 0, fd;
+	uint64_t seq, next, since_ns = 0;
+	struct ring_header *ring;
+	struct ring_slot copy;
+	struct timespec now;
+	struct stat sbuf;
+	static struct option long_options[] = {
+		{"minutes", required_argument, NULL, 'm'},
+		{"follow", no_argument, NULL, 'f'},
+		{"help", no_argument, NULL, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	while ((option = getopt_long(argc, argv, "m:fh", long_options, &option_index)) != -1) {
+		switch (option) {
+			case 'm':
+				minutes = atoi(optarg);
+				break;
+			case 'f':
+				follow = 1;
+				break;
+			case 'h':
+			case '?':
+			default:
+				fprintf(stderr, "Usage: %s [OPTION]... RING\n", argv[0]);
+				fprintf(stderr, "  -m N, --minutes=N            only print records from the last N minutes\n");
+				fprintf(stderr, "  -f, --follow                 keep printing new records as they come in\n");
+				fprintf(stderr, "  -h, --help                   display this message\n");
+				return option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1 || minutes < 0) {
+		fprintf(stderr, "Invalid arguments.\n");
+		return EXIT_FAILURE;
+	}
+
+	fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror("open");
+		return EXIT_FAILURE;
+	}
+	if (fstat(fd, &sbuf) < 0) {
+		perror("fstat");
+		return EXIT_FAILURE;
+	}
+	if ((size_t)sbuf.st_size < sizeof(*ring)) {
+		fprintf(stderr, "%s is not a ring file.\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+	ring = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED) {
+		perror("mmap");
+		return EXIT_FAILURE;
+	}
+	close(fd);
+	if (ring->magic != RING_MAGIC || ring->version != RING_VERSION || ring->slot_size != RING_SLOT_SIZE ||
+	    !ring->slot_count || (size_t)sbuf.st_size != sizeof(*ring) + ring->slot_count * RING_SLOT_SIZE) {
+		fprintf(stderr, "%s is not a ring file we understand.\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	if (minutes) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		since_ns = (now.tv_sec - minutes * 60ULL) * 1000000000ULL;
+	}
+	next = __atomic_load_n(&ring->next, __ATOMIC_ACQUIRE);
+	seq = next > ring->slot_count ? next - ring->slot_count : 0;
+	for (;;) {
+		for (; seq < next; ++seq) {
+			if (!ring_read(ring, seq, &copy)) {
+				stalls = 0;
+				if (copy.time_ns >= since_ns)
+					print_record(&copy, seq);
+				continue;
+			}
+			/* Give a record that is still being written a second to show up. */
+			if (follow && __atomic_load_n(&ring_slot(ring, seq)->seq, __ATOMIC_RELAXED) == (RING_BUSY | seq) && ++stalls < 10)
+				break;
+			stalls = 0;
+		}
+		if (!follow)
+			break;
+		fflush(stdout);
+		usleep(100000);
+		next = __atomic_load_n(&ring->next, __ATOMIC_ACQUIRE);
+		/* Records we could not keep up with have been overwritten. */
+		if (next - seq > ring->slot_count)
+			seq = next - ring->slot_count;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,441 @@
+/*
+ * honeytail.c
+ *
+ *
+ * Follows the honey log like tail -f | grep, but keeps up with floods: it
+ * sleeps on inotify instead of polling, reads whatever has piled up in
+ * large chunks, and throws away non-matching lines with memmem() on a
+ * literal taken from the filter before it parses anything. It follows
+ * the log across rotation, too.
+ *
+ *     ./honeytail --source=203.0.113.0/24 --username='admin*' honey.log
+ *     ./honeytail --match=port=2323 --match='persona=router*' --from-start honey.log
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#define READ_SIZE	(1 << 20)
+#define MAX_MATCHES	8
+
+/*
+ * A glob, along with the longest stretch of it that has to appear
+ * literally, which is what we look for first.
+ */
+struct pattern {
+	const char *glob;
+	char literal[64];
+	size_t literal_len;
+};
+
+/* Matches key=value tokens, such as port=23, after the credentials. */
+struct token_match {
+	char key[32];
+	size_t key_len;
+	struct pattern value;
+};
+
+struct filter {
+	int source_family;
+	unsigned char source[16];
+	int source_bits;
+	struct pattern username, password;
+	struct token_match tokens[MAX_MATCHES];
+	int token_count;
+};
+
+static struct filter filter;
+
+static void compile_pattern(struct pattern *pattern, const char *glob)
+{
+	const char *run, *end;
+
+	pattern->glob = glob;
+	pattern->literal_len = 0;
+	for (run = glob; *run; run = end) {
+		/* Session records escape these, so the literal cannot span them. */
+		end = run + strcspn(run, "*?[\\%,:/");
+		if ((size_t)(end - run) > pattern->literal_len && (size_t)(end - run) < sizeof(pattern->literal)) {
+			memcpy(pattern->literal, run, end - run);
+			pattern->literal_len = end - run;
+		}
+		if (*end == '\\' && end[1])
+			++end;
+		/* A bracket expression is one character of several, never part of the literal. */
+		else if (*end == '[') {
+			run = end + 1 + (end[1] == '!' || end[1] == '^');
+			run += *run == ']';
+			while (*run && *run != ']') {
+				/* Classes such as [:digit:] have a ] of their own. */
+				if (*run == '[' && (run[1] == ':' || run[1] == '.' || run[1] == '=') && strchr(run + 2, ']'))
+					run = strchr(run + 2, ']');
+				++run;
+			}
+			/* Without a closing ], fnmatch takes the [ literally, and so do we, as a break. */
+			if (*run)
+				end = run;
+		}
+		if (*end)
+			++end;
+	}
+}
+
+static int compile_source(const char *prefix)
+{
+	char address[INET6_ADDRSTRLEN];
+	const char *slash = strchr(prefix, '/');
+	size_t len = slash ? (size_t)(slash - prefix) : strlen(prefix);
+
+	if (len >= sizeof(address))
+		return -1;
+	memcpy(address, prefix, len);
+	address[len] = 0;
+	if (inet_pton(AF_INET, address, filter.source) == 1) {
+		filter.source_family = AF_INET;
+		filter.source_bits = slash ? atoi(slash + 1) : 32;
+		return filter.source_bits >= 0 && filter.source_bits <= 32 ? 0 : -1;
+	}
+	if (inet_pton(AF_INET6, address, filter.source) == 1) {
+		filter.source_family = AF_INET6;
+		filter.source_bits = slash ? atoi(slash + 1) : 128;
+		return filter.source_bits >= 0 && filter.source_bits <= 128 ? 0 : -1;
+	}
+	return -1;
+}
+
+static int compile_token(const char *match)
+{
+	struct token_match *token = &filter.tokens[filter.token_count];
+	const char *equals = strchr(match, '=');
+
+	if (!equals || filter.token_count == MAX_MATCHES || (size_t)(equals - match) >= sizeof(token->key) - 1)
+		return -1;
+	/* Tokens are tab separated, so the tab is part of what we look for. */
+	token->key[0] = '\t';
+	memcpy(token->key + 1, match, equals - match);
+	token->key[equals - match + 1] = '=';
+	token->key_len = equals - match + 2;
+	compile_pattern(&token->value, equals + 1);
+	++filter.token_count;
+	return 0;
+}
+
+static int match_pattern(const struct pattern *pattern, const char *value, size_t len)
+{
+	char copy[1024];
+
+	if (!pattern->glob)
+		return 1;
+	if (pattern->literal_len && !memmem(value, len, pattern->literal, pattern->literal_len))
+		return 0;
+	if (len >= sizeof(copy))
+		len = sizeof(copy) - 1;
+	memcpy(copy, value, len);
+	copy[len] = 0;
+	return !fnmatch(pattern->glob, copy, 0);
+}
+
+static int match_source(const char *address, size_t len)
+{
+	unsigned char parsed[16];
+	char copy[INET6_ADDRSTRLEN];
+	int bytes = filter.source_bits / 8, bits = filter.source_bits % 8;
+
+	if (!filter.source_family)
+		return 1;
+	if (len >= sizeof(copy))
+		return 0;
+	memcpy(copy, address, len);
+	copy[len] = 0;
+	if (inet_pton(filter.source_family, copy, parsed) != 1)
+		return 0;
+	if (memcmp(parsed, filter.source, bytes))
+		return 0;
+	return !bits || !((parsed[bytes] ^ filter.source[bytes]) & (0xff << (8 - bits)));
+}
+
+/*
+ * Undoes the %XX escapes of the attempt lists in session records.
+ */
+static size_t unescape(char *out, size_t size, const char *in, size_t len)
+{
+	size_t i, out_len = 0;
+	unsigned int c;
+
+	for (i = 0; i < len && out_len < size - 1; ++i) {
+		if (in[i] == '%' && i + 2 < len && sscanf(in + i + 1, "%2x", &c) == 1) {
+			out[out_len++] = c;
+			i += 2;
+		} else
+			out[out_len++] = in[i];
+	}
+	out[out_len] = 0;
+	return out_len;
+}
+
+/*
+ * Session records carry their attempts as creds=USER:PASS,... and match
+ * when any one of them does.
+ */
+static int match_attempts(const char *tokens, const char *end)
+{
+	const char *list, *list_end, *entry, *entry_end, *colon, *weight;
+	char username[512], password[512];
+	size_t username_len, password_len;
+
+	list = memmem(tokens, end - tokens, "\tcreds=", 7);
+	if (!list)
+		return 0;
+	list += 7;
+	list_end = memchr(list, '\t', end - list);
+	if (!list_end)
+		list_end = end;
+	for (entry = list; entry < list_end; entry = entry_end + 1) {
+		entry_end = memchr(entry, ',', list_end - entry);
+		if (!entry_end)
+			entry_end = list_end;
+		colon = memchr(entry, ':', entry_end - entry);
+		if (!colon)
+			continue;
+		/* Sampled attempts end in /N. */
+		weight = memchr(colon, '/', entry_end - colon);
+		username_len = unescape(username, sizeof(username), entry, colon - entry);
+		password_len = unescape(password, sizeof(password), colon + 1, (weight ? weight : entry_end) - colon - 1);
+		if (match_pattern(&filter.username, username, username_len) && match_pattern(&filter.password, password, password_len))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Lines look like "ADDRESS - USERNAME:PASSWORD", optionally followed by
+ * tab separated key=value tokens, or "ADDRESS - session" followed by the
+ * tokens of a whole session.
+ */
+static int match_line(const char *line, size_t len)
+{
+	const char *end = line + len, *credentials, *colon, *tokens, *value, *value_end;
+	int i;
+
+	/* Cheap rejections first, on the raw line. */
+	if (filter.username.literal_len && !memmem(line, len, filter.username.literal, filter.username.literal_len))
+		return 0;
+	if (filter.password.literal_len && !memmem(line, len, filter.password.literal, filter.password.literal_len))
+		return 0;
+	for (i = 0; i < filter.token_count; ++i) {
+		if (!memmem(line, len, filter.tokens[i].key, filter.tokens[i].key_len))
+			return 0;
+	}
+
+	credentials = memmem(line, len, " - ", 3);
+	if (!credentials)
+		return 0;
+	if (!match_source(line, credentials - line))
+		return 0;
+	credentials += 3;
+	tokens = memchr(credentials, '\t', end - credentials);
+	if (!tokens)
+		tokens = end;
+	colon = memchr(credentials, ':', tokens - credentials);
+	if (!colon) {
+		if (tokens - credentials != 7 || memcmp(credentials, "session", 7))
+			return 0;
+		if ((filter.username.glob || filter.password.glob) && !match_attempts(tokens, end))
+			return 0;
+	} else if (!match_pattern(&filter.username, credentials, colon - credentials)
+			|| !match_pattern(&filter.password, colon + 1, tokens - colon - 1))
+		return 0;
+	for (i = 0; i < filter.token_count; ++i) {
+		value = memmem(tokens, end - tokens, filter.tokens[i].key, filter.tokens[i].key_len);
+		if (!value)
+			return 0;
+		value += filter.tokens[i].key_len;
+		value_end = memchr(value, '\t', end - value);
+		if (!match_pattern(&filter.tokens[i].value, value, (value_end ? value_end : end) - value))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Prints the matching lines out of buffer, and returns how many bytes
+ * are left over at the end, without a newline yet.
+ */
+static size_t filter_buffer(const char *buffer, size_t len)
+{
+	const char *line = buffer, *newline, *end = buffer + len;
+
+	while ((newline = memchr(line, '\n', end - line))) {
+		if (match_line(line, newline - line))
+			fwrite(line, 1, newline - line + 1, stdout);
+		line = newline + 1;
+	}
+	return end - line;
+}
+
+static int open_log(const char *path, int inotify_fd, int *watch)
+{
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	*watch = inotify_add_watch(inotify_fd, path, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB);
+	if (*watch < 0) {
+		perror("inotify_add_watch");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int main(int argc, char *argv[])
+{
+	int option, option_index = 0, from_start = 0, inotify_fd, fd, watch, rotated;
+	char *buffer, events[4096];
+	size_t pending = 0;
+	ssize_t len;
+	off_t offset;
+	struct stat sbuf;
+	const struct inotify_event *event;
+	const char *path;
+	static struct option long_options[] = {
+		{"source", required_argument, NULL, 's'},
+		{"username", required_argument, NULL, 'u'},
+		{"password", required_argument, NULL, 'p'},
+		{"match", required_argument, NULL, 'm'},
+		{"from-start", no_argument, NULL, 'a'},
+		{"help", no_argument, NULL, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	while ((option = getopt_long(argc, argv, "s:u:p:m:ah", long_options, &option_index)) != -1) {
+		switch (option) {
+			case 's':
+				if (compile_source(optarg) < 0) {
+					fprintf(stderr, "Invalid source prefix: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'u':
+				compile_pattern(&filter.username, optarg);
+				break;
+			case 'p':
+				compile_pattern(&filter.password, optarg);
+				break;
+			case 'm':
+				if (compile_token(optarg) < 0) {
+					fprintf(stderr, "Invalid match: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'a':
+				from_start = 1;
+				break;
+			case 'h':
+			case '?':
+			default:
+				fprintf(stderr, "Usage: %s [OPTION]... LOG\n", argv[0]);
+				fprintf(stderr, "  -s PREFIX, --source=PREFIX   only records from addresses in PREFIX, e.g. 192.0.2.0/24\n");
+				fprintf(stderr, "  -u GLOB, --username=GLOB     only records whose username matches GLOB\n");
+				fprintf(stderr, "  -p GLOB, --password=GLOB     only records whose password matches GLOB\n");
+				fprintf(stderr, "  -m KEY=GLOB, --match=KEY=GLOB\n");
+				fprintf(stderr, "                               only records with a KEY token matching GLOB, e.g. port=23\n");
+				fprintf(stderr, "                               or persona=NAME\n");
+				fprintf(stderr, "  -a, --from-start             print what is already in the log first\n");
+				fprintf(stderr, "  -h, --help                   display this message\n");
+				return option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "Invalid arguments.\n");
+		return EXIT_FAILURE;
+	}
+	path = argv[optind];
+
+	buffer = malloc(READ_SIZE);
+	if (!buffer) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+	inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (inotify_fd < 0) {
+		perror("inotify_init1");
+		return EXIT_FAILURE;
+	}
+	fd = open_log(path, inotify_fd, &watch);
+	if (fd < 0) {
+		perror("open");
+		return EXIT_FAILURE;
+	}
+	if (!from_start)
+		lseek(fd, 0, SEEK_END);
+
+	for (;;) {
+		/* Read everything there is, then wait to be told there is more. */
+		while ((len = read(fd, buffer + pending, READ_SIZE - pending)) > 0) {
+			pending += len;
+			len = filter_buffer(buffer, pending);
+			/* A line longer than the buffer is not a record; drop it. */
+			if ((size_t)len == READ_SIZE)
+				len = 0;
+			memmove(buffer, buffer + pending - len, len);
+			pending = len;
+		}
+		fflush(stdout);
+		if (len < 0 && errno != EINTR) {
+			perror("read");
+			return EXIT_FAILURE;
+		}
+		/* Truncated under us? Start over from the top. */
+		offset = lseek(fd, 0, SEEK_CUR);
+		if (!fstat(fd, &sbuf) && sbuf.st_size < offset) {
+			lseek(fd, 0, SEEK_SET);
+			pending = 0;
+			continue;
+		}
+
+		len = read(inotify_fd, events, sizeof(events));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			return EXIT_FAILURE;
+		}
+		rotated = 0;
+		for (event = (const struct inotify_event *)events; (const char *)event < events + len;
+		     event = (const struct inotify_event *)((const char *)event + sizeof(*event) + event->len)) {
+			if (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF))
+				rotated = 1;
+		}
+		if (!rotated)
+			continue;
+
+		/* Finish off the old file, then wait for the new one. */
+		while ((len = read(fd, buffer + pending, READ_SIZE - pending)) > 0) {
+			pending += len;
+			len = filter_buffer(buffer, pending);
+			memmove(buffer, buffer + pending - len, len);
+			pending = len;
+		}
+		fflush(stdout);
+		inotify_rm_watch(inotify_fd, watch);
+		close(fd);
+		pending = 0;
+		while ((fd = open_log(path, inotify_fd, &watch)) < 0)
+			usleep(100000);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,146 @@
+/*
+ * overload.c
+ *
+ *
+ * Picks the timeouts and tarpit delays for new sessions based on how close
+ * we are to running out of processes or memory. When we are idle, bots are
+ * held for longer, so each of them spends more time (and more passwords)
+ * on us; as we approach the limits, everything shrinks, so that sessions
+ * turn over quickly and new sources still get a slot. Both ends come
+ * from the config.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "overload.h"
+#include "stats.h"
+#include "config.h"
+#include "rate.h"
+
+static int session_capacity = 1;
+static int meminfo_fd = -1;
+static int memory_load = 0;
+static time_t memory_checked = 0;
+
+/*
+ * Opens /proc/meminfo before the chroot, like the netstat counters.
+ * The capacity is the number of sessions the process limit leaves us.
+ */
+void overload_init(int capacity)
+{
+	session_capacity = capacity > 0 ? capacity : 1;
+	meminfo_fd = open("/proc/meminfo", O_RDONLY | O_CLOEXEC);
+	if (meminfo_fd < 0)
+		perror("open(/proc/meminfo)");
+}
+
+static unsigned long long meminfo_field(const char *buffer, const char *name)
+{
+	const char *field;
+
+	field = strstr(buffer, name);
+	if (!field)
+		return 0;
+	return strtoull(field + strlen(name), NULL, 10);
+}
+
+/*
+ * Memory only starts to count once less than a fifth of it is available,
+ * and is at full pressure when we are down to the last 2%.
+ */
+static int read_memory_load()
+{
+	char buffer[4096];
+	unsigned long long total, available;
+	ssize_t len;
+	int used;
+
+	if (meminfo_fd < 0)
+		return 0;
+	len = pread(meminfo_fd, buffer, sizeof(buffer) - 1, 0);
+	if (len <= 0)
+		return 0;
+	buffer[len] = 0;
+	total = meminfo_field(buffer, "MemTotal:");
+	available = meminfo_field(buffer, "MemAvailable:");
+	if (!total)
+		return 0;
+	used = (int)(100 - available * 100 / total);
+	if (used <= 80)
+		return 0;
+	if (used >= 98)
+		return 100;
+	return (used - 80) * 100 / 18;
+}
+
+/*
+ * How close we are to a limit, in percent. Memory is sampled at most
+ * once a second, since this runs for every accepted connection.
+ */
+int overload_load(void)
+{
+	unsigned long long live;
+	time_t now;
+	int session_load;
+
+	now = time(NULL);
+	if (now != memory_checked) {
+		memory_checked = now;
+		memory_load = read_memory_load();
+	}
+	live = stats_live();
+	session_load = live >= (unsigned long long)session_capacity ? 100 : (int)(live * 100 / session_capacity);
+	return session_load > memory_load ? session_load : memory_load;
+}
+
+static int lerp(int from, int to, int percent)
+{
+	return from + (to - from) * percent / 100;
+}
+
+static void lerp_phase(struct phase_policy *phase, const struct phase_policy *from, const struct phase_policy *to, int percent)
+{
+	phase->idle = lerp(from->idle, to->idle, percent);
+	phase->keepalive_idle = lerp(from->keepalive_idle, to->keepalive_idle, percent);
+	phase->keepalive_interval = lerp(from->keepalive_interval, to->keepalive_interval, percent);
+	phase->keepalive_count = lerp(from->keepalive_count, to->keepalive_count, percent);
+	phase->user_timeout = lerp(from->user_timeout, to->user_timeout, percent);
+}
+
+/*
+ * Fills in the policy for a session that is about to start. The penalty
+ * is added to the load, so that sources we want less of get the kind of
+ * session we would hand out if we were busier than we are.
+ */
+void overload_policy(struct session_policy *policy, int penalty)
+{
+	const struct config *config = config_get();
+	const struct session_policy *relaxed = &config->relaxed, *tight = &config->tight;
+	int load = overload_load() + penalty;
+
+	if (load > 100)
+		load = 100;
+
+	lerp_phase(&policy->negotiate, &relaxed->negotiate, &tight->negotiate, load);
+	lerp_phase(&policy->login, &relaxed->login, &tight->login, load);
+	policy->negotiate_timeout = lerp(relaxed->negotiate_timeout, tight->negotiate_timeout, load);
+	policy->session_timeout = lerp(relaxed->session_timeout, tight->session_timeout, load);
+	policy->reply_delay = lerp(relaxed->reply_delay, tight->reply_delay, load);
+	policy->retry_delay = lerp(relaxed->retry_delay, tight->retry_delay, load);
+}
+
+void overload_report(void)
+{
+	struct session_policy policy;
+	int load = overload_load();
+
+	overload_policy(&policy, 0);
+	printf("Stats: load %d%% (memory %d%%) at %.1f connections/s, sessions get %ds to negotiate, %ds in total, %dms+%dms tarpit.\n",
+		load, memory_load, rate_accepts(60), policy.negotiate_timeout, policy.session_timeout, policy.reply_delay, policy.retry_delay);
+}
@@ -0,0 +1,11 @@
+#ifndef OVERLOAD_H
+#define OVERLOAD_H
+
+#include "telnet_srv.h"
+
+void overload_init(int capacity);
+int overload_load(void);
+void overload_policy(struct session_policy *policy, int penalty);
+void overload_report(void);
+
+#endif
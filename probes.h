@@ -0,0 +1,39 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * Static tracepoints on the session lifecycle, for bpftrace, perf or
+ * SystemTap, e.g.:
+ *     bpftrace -e 'usdt:./honeypot:honeypot:credential { printf("%s:%s\n", str(arg1), str(arg2)); }'
+ *
+ * Each one is a single nop with a note describing where its arguments live,
+ * so they cost next to nothing when nobody is attached. They need the
+ * <sys/sdt.h> header from systemtap (systemtap-sdt-dev or
+ * systemtap-sdt-devel); without it they compile to nothing.
+ *
+ *   accept      (session id, fd, source class)                  listener
+ *   negotiated  (session id, ms since accept, is a telnet client)
+ *   ttype       (session id, terminal type)
+ *   line        (session id, length, is a password)
+ *   credential  (session id, username, password)
+ *   timeout     (session id, ms since accept, is a telnet client)
+ *   exit        (session id, exit code, ms since accept)
+ */
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT
+#endif
+#endif
+
+#ifdef HAVE_SDT
+#define PROBE2(name, a, b)	DTRACE_PROBE2(honeypot, name, a, b)
+#define PROBE3(name, a, b, c)	DTRACE_PROBE3(honeypot, name, a, b, c)
+#else
+/* Keep the arguments looked at, but never evaluated. */
+#define PROBE2(name, a, b)	do { if (0) { (void)(a); (void)(b); } } while (0)
+#define PROBE3(name, a, b, c)	do { if (0) { (void)(a); (void)(b); (void)(c); } } while (0)
+#endif
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+/*
+ * The training stage of make pgo builds with -DPGO_TRAINING, which is
+ * the only thing that sets pgo_training, in honeypot.c. Checking it at
+ * runtime, rather than with an #ifdef here, keeps the code identical
+ * between the instrumented and the optimized build, so the profile
+ * matches every function.
+ *
+ * Profiles are written from the sessions, which normally have no way to
+ * write anything, so a training build runs without the sandbox. It must
+ * never be deployed. Whether libgcov, which provides __gcov_dump, is
+ * linked in says nothing about that: honeypot refuses to start when the
+ * two do not agree, rather than run a coverage build unsandboxed.
+ */
+extern void __gcov_dump(void) __attribute__((weak));
+extern const volatile int pgo_training;
+
+#define profiling() (pgo_training != 0)
+
+#endif
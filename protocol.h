@@ -0,0 +1,31 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdio.h>
+
+struct session;
+
+/*
+ * A service we collect credentials for. The session layer sets up the
+ * connection, the sandbox, the timers and the log, and hands the peer to
+ * serve(), which talks the protocol and never returns. The other two say
+ * goodbye in the protocol's own words when the session is cut short;
+ * timeout() returns the exit code to leave with.
+ */
+struct protocol {
+	const char *name;
+	int port;		/* where it usually listens */
+	void (*serve)(struct session *session, FILE *input, FILE *output);
+	int (*timeout)(FILE *output);
+	void (*shutdown)(FILE *output);
+};
+
+extern const struct protocol telnet_protocol;
+extern const struct protocol ftp_protocol;
+extern const struct protocol pop3_protocol;
+extern const struct protocol http_protocol;
+extern const struct protocol flow_protocol;
+
+const struct protocol *protocol_find(const char *name);
+
+#endif
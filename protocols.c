@@ -0,0 +1,331 @@
+/*
+ * protocols.c
+ *
+ *
+ * The plaintext services other than telnet that bots try passwords on:
+ * FTP, POP3 and HTTP basic auth. Each one only knows enough of its
+ * protocol to get to the credentials and turn them down, in the words of
+ * a real server going by the persona, and leaves the rest to the session.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "protocol.h"
+#include "session.h"
+#include "config.h"
+
+/* Request bodies we read past, at most; a bigger one ends the session. */
+#define HTTP_BODY_MAX	65536
+
+static FILE *output = 0;
+
+static const char base64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static const char http_body[] =
+	"<html><head><title>401 Unauthorized</title></head>"
+	"<body><h1>401 Unauthorized</h1></body></html>\n";
+
+/*
+ * Reads a command and splits off its argument, which is everything after
+ * the first space, since passwords may have spaces of their own.
+ */
+static const char *read_command(char *buffer, size_t size)
+{
+	char *argument;
+
+	session_read_line(buffer, size);
+	argument = strchr(buffer, ' ');
+	if (!argument)
+		return "";
+	*argument = 0;
+	return argument + 1;
+}
+
+/*
+ * Decodes base64, stopping at the padding or at whatever else is not
+ * part of it. Returns how many bytes came out, or -1 if they do not fit.
+ */
+static int base64_decode(const char *encoded, char *decoded, size_t size)
+{
+	unsigned int bits = 0, count = 0;
+	const char *digit;
+	size_t len = 0;
+
+	for (; *encoded && (digit = strchr(base64_alphabet, *encoded)); ++encoded) {
+		bits = (bits << 6 | (digit - base64_alphabet)) & 0xffff;
+		count += 6;
+		if (count < 8)
+			continue;
+		count -= 8;
+		if (len == size - 1)
+			return -1;
+		decoded[len++] = bits >> count;
+	}
+	decoded[len] = 0;
+	return len;
+}
+
+/*
+ * Drops the control characters from the first len bytes of a string.
+ */
+static void printable(char *string, size_t len)
+{
+	size_t i, kept = 0;
+
+	for (i = 0; i < len; ++i) {
+		if (!iscntrl((unsigned char)string[i]))
+			string[kept++] = string[i];
+	}
+	string[kept] = 0;
+}
+
+
+/*
+ * FTP: USER and then PASS, which is all a client may do before logging in.
+ */
+static void ftp_serve(struct session *session, FILE *input, FILE *new_output)
+{
+	char line[1024], username[1024] = "";
+	const char *argument;
+
+	(void) session;
+	(void) input;
+	output = new_output;
+
+	fprintf(output, "220 %s FTP server ready.\r\n", config_get()->persona);
+	session_flush();
+	session_login();
+
+	while (1) {
+		argument = read_command(line, sizeof(line));
+		if (!strcasecmp(line, "USER")) {
+			snprintf(username, sizeof(username), "%s", argument);
+			fprintf(output, "331 Please specify the password.\r\n");
+		} else if (!strcasecmp(line, "PASS")) {
+			if (!*username)
+				fprintf(output, "503 Login with USER first.\r\n");
+			else {
+				session_credential(username, argument);
+				fprintf(output, "530 Login incorrect.\r\n");
+				username[0] = 0;
+			}
+		} else if (!strcasecmp(line, "QUIT")) {
+			fprintf(output, "221 Goodbye.\r\n");
+			session_flush();
+			session_exit(SESSION_CLOSED);
+		} else
+			fprintf(output, "530 Please login with USER and PASS.\r\n");
+		session_flush();
+	}
+}
+
+static int ftp_timeout(FILE *output)
+{
+	fprintf(output, "421 Timeout.\r\n");
+	return SESSION_CLOSED;
+}
+
+static void ftp_shutdown(FILE *output)
+{
+	fprintf(output, "421 Service not available, closing control connection.\r\n");
+}
+
+
+/*
+ * POP3: USER and PASS, or AUTH PLAIN, with the credentials either on the
+ * same line or on the next one.
+ */
+static void pop3_auth_plain(const char *argument)
+{
+	char line[1024], decoded[768], *username, *password;
+	int len;
+
+	if (!*argument) {
+		fprintf(output, "+ \r\n");
+		session_flush();
+		session_read_line(line, sizeof(line));
+		argument = line;
+	}
+	/* The authorization identity, the username and the password, each ending in a NUL. */
+	len = base64_decode(argument, decoded, sizeof(decoded));
+	username = len > 0 ? memchr(decoded, 0, len) : 0;
+	password = username ? memchr(username + 1, 0, decoded + len - username - 1) : 0;
+	if (!password) {
+		fprintf(output, "-ERR Invalid AUTH PLAIN response.\r\n");
+		return;
+	}
+	++username;
+	++password;
+	printable(username, password - 1 - username);
+	printable(password, decoded + len - password);
+	session_credential(username, password);
+	fprintf(output, "-ERR [AUTH] Authentication failed.\r\n");
+}
+
+static void pop3_serve(struct session *session, FILE *input, FILE *new_output)
+{
+	char line[1024], username[1024] = "";
+	const char *argument;
+
+	(void) session;
+	(void) input;
+	output = new_output;
+
+	fprintf(output, "+OK %s POP3 server ready.\r\n", config_get()->persona);
+	session_flush();
+	session_login();
+
+	while (1) {
+		argument = read_command(line, sizeof(line));
+		if (!strcasecmp(line, "USER")) {
+			snprintf(username, sizeof(username), "%s", argument);
+			fprintf(output, "+OK\r\n");
+		} else if (!strcasecmp(line, "PASS")) {
+			if (!*username)
+				fprintf(output, "-ERR No username given.\r\n");
+			else {
+				session_credential(username, argument);
+				fprintf(output, "-ERR [AUTH] Authentication failed.\r\n");
+				username[0] = 0;
+			}
+		} else if (!strcasecmp(line, "AUTH") && !strncasecmp(argument, "PLAIN", 5) && (!argument[5] || argument[5] == ' '))
+			pop3_auth_plain(argument[5] ? argument + 6 : "");
+		else if (!strcasecmp(line, "CAPA"))
+			fprintf(output, "+OK\r\nCAPA\r\nUSER\r\nSASL PLAIN\r\n.\r\n");
+		else if (!strcasecmp(line, "QUIT")) {
+			fprintf(output, "+OK Logging out.\r\n");
+			session_flush();
+			session_exit(SESSION_CLOSED);
+		} else
+			fprintf(output, "-ERR Unknown command.\r\n");
+		session_flush();
+	}
+}
+
+static int pop3_timeout(FILE *output)
+{
+	fprintf(output, "-ERR Disconnected for inactivity.\r\n");
+	return SESSION_CLOSED;
+}
+
+static void pop3_shutdown(FILE *output)
+{
+	fprintf(output, "-ERR Server shutting down.\r\n");
+}
+
+
+/*
+ * HTTP: whatever is asked for needs basic auth, and any credentials in
+ * the Authorization header are wrong. The connection is kept alive, so
+ * a bot can go through its list without reconnecting, as it would with
+ * a real server.
+ */
+static void http_serve(struct session *session, FILE *input, FILE *new_output)
+{
+	char line[1024], credentials[768], *value, *password;
+	unsigned long body;
+	int len;
+
+	(void) session;
+	output = new_output;
+
+	session_login();
+
+	while (1) {
+		/* Skip the empty lines some clients send between requests. */
+		do
+			session_read_line(line, sizeof(line));
+		while (!*line);
+
+		len = -1;
+		body = 0;
+		while (session_read_line(line, sizeof(line)), *line) {
+			value = strchr(line, ':');
+			if (!value)
+				continue;
+			*value++ = 0;
+			value += strspn(value, " ");
+			if (!strcasecmp(line, "Authorization") && !strncasecmp(value, "Basic ", 6))
+				len = base64_decode(value + 6 + strspn(value + 6, " "), credentials, sizeof(credentials));
+			else if (!strcasecmp(line, "Content-Length"))
+				body = strtoul(value, NULL, 10);
+		}
+		if (body > HTTP_BODY_MAX)
+			session_exit(SESSION_CLOSED);
+		for (; body; --body) {
+			if (getc(input) == EOF)
+				session_exit(session_read_failure());
+		}
+
+		if (len > 0) {
+			printable(credentials, len);
+			password = strchr(credentials, ':');
+			if (password) {
+				*password++ = 0;
+				session_credential(credentials, password);
+			}
+		}
+		fprintf(output, "HTTP/1.1 401 Unauthorized\r\n"
+			"WWW-Authenticate: Basic realm=\"%s\"\r\n"
+			"Content-Type: text/html\r\n"
+			"Content-Length: %zu\r\n"
+			"\r\n"
+			"%s", config_get()->persona, sizeof(http_body) - 1, http_body);
+		session_flush();
+	}
+}
+
+static int http_timeout(FILE *output)
+{
+	(void) output;
+	return SESSION_CLOSED;
+}
+
+static void http_shutdown(FILE *output)
+{
+	(void) output;
+}
+
+
+const struct protocol ftp_protocol = {
+	.name = "ftp",
+	.port = 21,
+	.serve = ftp_serve,
+	.timeout = ftp_timeout,
+	.shutdown = ftp_shutdown
+};
+
+const struct protocol pop3_protocol = {
+	.name = "pop3",
+	.port = 110,
+	.serve = pop3_serve,
+	.timeout = pop3_timeout,
+	.shutdown = pop3_shutdown
+};
+
+const struct protocol http_protocol = {
+	.name = "http",
+	.port = 80,
+	.serve = http_serve,
+	.timeout = http_timeout,
+	.shutdown = http_shutdown
+};
+
+static const struct protocol *protocols[] = { &telnet_protocol, &ftp_protocol, &pop3_protocol, &http_protocol, &flow_protocol };
+
+const struct protocol *protocol_find(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(protocols) / sizeof(protocols[0]); ++i) {
+		if (!strcmp(protocols[i]->name, name))
+			return protocols[i];
+	}
+	return 0;
+}
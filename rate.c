@@ -0,0 +1,267 @@
+/*
+ * rate.c
+ *
+ *
+ * Rates of connections and attempts over the last seconds, minutes and
+ * hours, per listener, per persona and for the busiest sources, in fixed
+ * memory, so that the stats, the overload controller and dashboards can
+ * tell what is coming in right now without going through the logs. The
+ * listener counts what it accepts and the sessions what they are tried
+ * with, all with atomics on a shared mapping and no system calls.
+ *
+ * There are only so many slots for sources. One that has none can take
+ * over the quietest one, measured over the last five minutes, but only
+ * after as many attempts from sources without a slot have gone against
+ * it as it had in those minutes. Whoever makes the attempt that tips it
+ * gets the slot, which will most likely be a busy source, so sources that
+ * make more than their share of the attempts keep their slots while the
+ * long tail of the others churns through the last of them.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rate.h"
+#include "hash.h"
+
+/* Minutes a persona or source slot is judged by. */
+#define RATE_WINDOW_MINUTES	5
+
+static struct rate_header *rates = 0;
+static struct rate_series *accepts = 0, *attempts = 0, *personas = 0, *sources = 0;
+static int listener_count = 0;
+
+
+static uint64_t rate_now(void)
+{
+	struct timespec now;
+
+	/* Coarse is plenty for second buckets, and is never a system call. */
+	clock_gettime(CLOCK_REALTIME_COARSE, &now);
+	return now.tv_sec;
+}
+
+/*
+ * Maps the series, in the file if there is one so that they can be read
+ * from outside, and anonymously otherwise. Either way it happens before
+ * the fork, and a file is kept if it has the layout we want, so that the
+ * rates carry on across restarts.
+ */
+int rate_open(const char *path)
+{
+	size_t size = sizeof(struct rate_header) + RATE_SERIES_MAX * sizeof(struct rate_series);
+	struct stat sbuf = { .st_size = 0 };
+	void *map;
+	int fd;
+
+	if (!path)
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	else {
+		fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			perror("open");
+			return -1;
+		}
+		if (fstat(fd, &sbuf) < 0) {
+			perror("fstat");
+			close(fd);
+			return -1;
+		}
+		if ((size_t)sbuf.st_size != size && ftruncate(fd, size) < 0) {
+			perror("ftruncate");
+			close(fd);
+			return -1;
+		}
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+	}
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	rates = map;
+	accepts = rate_series(rates);
+	attempts = accepts + RATE_LISTENERS;
+	personas = attempts + RATE_LISTENERS;
+	sources = personas + RATE_PERSONAS;
+	if ((size_t)sbuf.st_size == size && rates->magic == RATE_MAGIC && rates->version == RATE_VERSION && rates->series_count == RATE_SERIES_MAX)
+		return 0;
+	if (sbuf.st_size)
+		fprintf(stderr, "Warning: %s does not have the rate series we keep, starting it over.\n", path);
+	memset(map, 0, size);
+	rates->version = RATE_VERSION;
+	rates->series_count = RATE_SERIES_MAX;
+	rates->started = rate_now();
+	__atomic_store_n(&rates->magic, RATE_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Names the series of a listener. Ones that used to be for something
+ * else, in the file of an earlier run, start over.
+ */
+void rate_listener(int index, const char *protocol, int port)
+{
+	char name[sizeof(accepts->name)];
+
+	if (!rates || index >= RATE_LISTENERS)
+		return;
+	snprintf(name, sizeof(name), "accepted on %s:%d", protocol, port);
+	if (strcmp(accepts[index].name, name))
+		memset(&accepts[index], 0, sizeof(accepts[index]));
+	strcpy(accepts[index].name, name);
+	accepts[index].key = 1;
+	snprintf(name, sizeof(name), "attempts on %s:%d", protocol, port);
+	if (strcmp(attempts[index].name, name))
+		memset(&attempts[index], 0, sizeof(attempts[index]));
+	strcpy(attempts[index].name, name);
+	attempts[index].key = 1;
+	if (index >= listener_count)
+		listener_count = index + 1;
+}
+
+static void bucket_add(uint64_t *ring, uint32_t size, uint32_t slot)
+{
+	uint64_t *bucket = &ring[slot % size], seen = __atomic_load_n(bucket, __ATOMIC_RELAXED);
+
+	/* Whoever gets here first in a new second, minute or hour starts the bucket over. */
+	while ((uint32_t)(seen >> 32) < slot) {
+		if (__atomic_compare_exchange_n(bucket, &seen, (uint64_t)slot << 32 | 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			return;
+	}
+	/* A straggler from a bucket that already started over is dropped. */
+	if ((uint32_t)(seen >> 32) == slot)
+		__atomic_fetch_add(bucket, 1, __ATOMIC_RELAXED);
+}
+
+static void count(struct rate_series *series, uint64_t now)
+{
+	bucket_add(series->seconds, RATE_SECONDS, now);
+	bucket_add(series->minutes, RATE_MINUTES, now / 60);
+	bucket_add(series->hours, RATE_HOURS, now / 3600);
+}
+
+/*
+ * Finds the slot of a persona or source, or hands it one, as described
+ * at the top. Returns 0 if it has none to count in.
+ */
+static struct rate_series *keyed(struct rate_series *slots, int slot_count, const char *name, uint64_t now)
+{
+	uint64_t key = (hash_bytes(name, strlen(name)) | 1) & ~RATE_BUSY, held, recent, quietest = UINT64_MAX;
+	struct rate_series *series = 0;
+	int i;
+
+	for (i = 0; i < slot_count; ++i) {
+		held = __atomic_load_n(&slots[i].key, __ATOMIC_ACQUIRE);
+		if (held == key)
+			return &slots[i];
+		if (held & RATE_BUSY)
+			continue;
+		recent = held ? rate_sum(&slots[i], RATE_MINUTE, RATE_WINDOW_MINUTES, now) : 0;
+		if (recent < quietest) {
+			quietest = recent;
+			series = &slots[i];
+		}
+	}
+	if (!series || __atomic_add_fetch(&series->challenges, 1, __ATOMIC_RELAXED) <= quietest)
+		return 0;
+	held = __atomic_load_n(&series->key, __ATOMIC_RELAXED);
+	if (held & RATE_BUSY || !__atomic_compare_exchange_n(&series->key, &held, key | RATE_BUSY, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return 0;
+	/* Counts that race with this may land in either owner's buckets. */
+	memset(series->seconds, 0, sizeof(series->seconds));
+	memset(series->minutes, 0, sizeof(series->minutes));
+	memset(series->hours, 0, sizeof(series->hours));
+	snprintf(series->name, sizeof(series->name), "%s", name);
+	__atomic_store_n(&series->challenges, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&series->key, key, __ATOMIC_RELEASE);
+	return series;
+}
+
+/*
+ * Counts a connection the listener accepted, on one of its listeners.
+ */
+void rate_accept(int listener)
+{
+	if (!rates || listener >= RATE_LISTENERS)
+		return;
+	count(&accepts[listener], rate_now());
+}
+
+/*
+ * Counts a credential a session was tried with. Called by the sessions,
+ * so this may not make any system calls.
+ */
+void rate_attempt(int listener, const char *persona, const char *ipaddr)
+{
+	struct rate_series *series;
+	uint64_t now;
+
+	if (!rates || listener >= RATE_LISTENERS)
+		return;
+	now = rate_now();
+	count(&attempts[listener], now);
+	series = keyed(personas, RATE_PERSONAS, persona, now);
+	if (series)
+		count(series, now);
+	series = keyed(sources, RATE_SOURCES, ipaddr, now);
+	if (series)
+		count(series, now);
+}
+
+/*
+ * Connections accepted per second on all listeners over the last whole
+ * seconds, up to five minutes of them. Cheap enough to ask all the time.
+ */
+double rate_accepts(uint32_t seconds)
+{
+	uint64_t now, sum = 0;
+	int i;
+
+	if (!rates || !seconds)
+		return 0;
+	now = rate_now();
+	for (i = 0; i < listener_count; ++i)
+		sum += rate_sum(&accepts[i], RATE_SECOND, seconds, now);
+	return (double)sum / seconds;
+}
+
+static void report_series(struct rate_series *series, const char *prefix, uint64_t now)
+{
+	uint64_t key = __atomic_load_n(&series->key, __ATOMIC_ACQUIRE), minute, five_minutes, hour;
+
+	if (!key || key & RATE_BUSY)
+		return;
+	minute = rate_sum(series, RATE_SECOND, 60, now);
+	five_minutes = rate_sum(series, RATE_SECOND, 300, now);
+	hour = rate_sum(series, RATE_MINUTE, 60, now);
+	if (!hour && !five_minutes)
+		return;
+	printf("Rates: %s%s: %.2f/s over 1m, %.2f/s over 5m, %.2f/s over 1h.\n",
+		prefix, series->name, minute / 60.0, five_minutes / 300.0, hour / 3600.0);
+}
+
+void rate_report(void)
+{
+	uint64_t now;
+	int i;
+
+	if (!rates)
+		return;
+	now = rate_now();
+	for (i = 0; i < listener_count; ++i) {
+		report_series(&accepts[i], "", now);
+		report_series(&attempts[i], "", now);
+	}
+	for (i = 0; i < RATE_PERSONAS; ++i)
+		report_series(&personas[i], "attempts as ", now);
+	for (i = 0; i < RATE_SOURCES; ++i)
+		report_series(&sources[i], "attempts from ", now);
+}
@@ -0,0 +1,111 @@
+#ifndef RATE_H
+#define RATE_H
+
+#include <stdint.h>
+
+/*
+ * The layout of the rate series, shared by the honeypot, which counts
+ * into them, and honeyrate, which reads them from the file --rates maps
+ * them to. The file is a header followed by RATE_SERIES_MAX series.
+ *
+ * A series counts events in three rings of buckets: one per second for a
+ * little over five minutes, one per minute for two hours and one per hour
+ * for two days. Every event is counted at all three as it comes in, so
+ * the coarser rings are kept up without anyone rolling the finer ones up
+ * into them. A bucket has the second, minute or hour it counts for in its
+ * top 32 bits and the count in the bottom ones, so it starts over with a
+ * single compare and swap when its turn comes around again, and a bucket
+ * left over from an earlier turn reads as empty.
+ *
+ * The series are the connections accepted and the attempts made on each
+ * listener, then the attempts under each persona and from the busiest
+ * sources, in slots that change hands as those do. A slot's key is 0
+ * while it is free, and has RATE_BUSY set while it is being handed over.
+ */
+#define RATE_MAGIC		0x4554415259454e4fULL	/* "ONEYRATE" */
+#define RATE_VERSION		1
+#define RATE_SECONDS		310
+#define RATE_MINUTES		121
+#define RATE_HOURS		49
+#define RATE_LISTENERS		8
+#define RATE_PERSONAS		4
+#define RATE_SOURCES		8
+#define RATE_SERIES_MAX		(2 * RATE_LISTENERS + RATE_PERSONAS + RATE_SOURCES)
+#define RATE_BUSY		(1ULL << 63)
+
+enum rate_resolution {
+	RATE_SECOND,
+	RATE_MINUTE,
+	RATE_HOUR
+};
+
+struct rate_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t series_count;
+	uint64_t started;	/* seconds since the epoch */
+	char padding[40];
+};
+
+struct rate_series {
+	uint64_t key;
+	uint64_t challenges;	/* attempts from sources without a slot, against this one */
+	char name[48];
+	uint64_t seconds[RATE_SECONDS];
+	uint64_t minutes[RATE_MINUTES];
+	uint64_t hours[RATE_HOURS];
+};
+
+static inline struct rate_series *rate_series(struct rate_header *header)
+{
+	return (struct rate_series *)(header + 1);
+}
+
+static inline uint32_t rate_span(enum rate_resolution resolution)
+{
+	return resolution == RATE_SECOND ? 1 : resolution == RATE_MINUTE ? 60 : 3600;
+}
+
+static inline uint32_t rate_size(enum rate_resolution resolution)
+{
+	return resolution == RATE_SECOND ? RATE_SECONDS : resolution == RATE_MINUTE ? RATE_MINUTES : RATE_HOURS;
+}
+
+static inline uint64_t *rate_ring(struct rate_series *series, enum rate_resolution resolution)
+{
+	return resolution == RATE_SECOND ? series->seconds : resolution == RATE_MINUTE ? series->minutes : series->hours;
+}
+
+/*
+ * The count of a whole bucket, the one for slot, where slot is seconds
+ * since the epoch divided by the span of the resolution. 0 if it is gone.
+ */
+static inline uint32_t rate_bucket(struct rate_series *series, enum rate_resolution resolution, uint32_t slot)
+{
+	uint64_t bucket = __atomic_load_n(&rate_ring(series, resolution)[slot % rate_size(resolution)], __ATOMIC_RELAXED);
+
+	return bucket >> 32 == slot ? (uint32_t)bucket : 0;
+}
+
+/*
+ * Sums up the count whole buckets before the one now falls in, which is
+ * still filling up. Asking for more than the ring keeps gets what it has.
+ */
+static inline uint64_t rate_sum(struct rate_series *series, enum rate_resolution resolution, uint32_t count, uint64_t now)
+{
+	uint32_t slot = now / rate_span(resolution), i;
+	uint64_t sum = 0;
+
+	for (i = 1; i <= count && i < rate_size(resolution); ++i)
+		sum += rate_bucket(series, resolution, slot - i);
+	return sum;
+}
+
+int rate_open(const char *path);
+void rate_listener(int index, const char *protocol, int port);
+void rate_accept(int listener);
+void rate_attempt(int listener, const char *persona, const char *ipaddr);
+double rate_accepts(uint32_t seconds);
+void rate_report(void);
+
+#endif
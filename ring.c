@@ -0,0 +1,118 @@
+/*
+ * ring.c
+ *
+ *
+ * Keeps the most recent honey log records in a memory-mapped file, so that
+ * they survive a session, a worker or the whole honeypot dying before the
+ * log reached the disk. Appending is a handful of stores into the mapping,
+ * with no system call, which also makes it safe behind seccomp.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ring.h"
+
+static struct ring_header *ring = 0;
+
+/*
+ * Finds where the last run left off: the newest intact record might be
+ * newer than what the header says, if we died between the two.
+ */
+static void ring_recover(void)
+{
+	struct ring_slot copy;
+	uint64_t seq, first, next = ring->next, found = 0;
+
+	for (seq = 0; seq < ring->slot_count; ++seq) {
+		first = ring_slot(ring, seq)->seq;
+		if (first & RING_BUSY || !first)
+			continue;
+		if (!ring_read(ring, first - 1, &copy)) {
+			++found;
+			if (first > next)
+				next = first;
+		}
+	}
+	ring->next = next;
+	printf("Recovered %llu records from the ring, continuing at %llu.\n", (unsigned long long)found, (unsigned long long)next);
+}
+
+/*
+ * Maps the ring file before the chroot, creating it or starting it over
+ * if it does not have the layout we want.
+ */
+int ring_open(const char *path, uint64_t slots)
+{
+	size_t size = sizeof(struct ring_header) + slots * RING_SLOT_SIZE;
+	struct stat sbuf;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+	if (fstat(fd, &sbuf) < 0) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+	if ((size_t)sbuf.st_size != size && ftruncate(fd, size) < 0) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	ring = map;
+	if ((size_t)sbuf.st_size == size && ring->magic == RING_MAGIC && ring->version == RING_VERSION &&
+	    ring->slot_size == RING_SLOT_SIZE && ring->slot_count == slots) {
+		ring_recover();
+		return 0;
+	}
+	if (sbuf.st_size)
+		fprintf(stderr, "Warning: %s is not a ring of %llu slots, starting it over.\n", path, (unsigned long long)slots);
+	memset(map, 0, size);
+	ring->version = RING_VERSION;
+	ring->slot_size = RING_SLOT_SIZE;
+	ring->slot_count = slots;
+	__atomic_store_n(&ring->magic, RING_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Puts a record in the next slot, cutting it short if it does not fit.
+ */
+void ring_append(const char *record, size_t len)
+{
+	struct ring_slot *slot;
+	struct timespec now;
+	uint64_t seq;
+
+	if (!ring)
+		return;
+	seq = __atomic_fetch_add(&ring->next, 1, __ATOMIC_RELAXED);
+	slot = ring_slot(ring, seq);
+	__atomic_store_n(&slot->seq, RING_BUSY | seq, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	/* The vDSO makes this a plain function call, too. */
+	clock_gettime(CLOCK_REALTIME, &now);
+	slot->time_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	slot->len = len < sizeof(slot->data) ? len : sizeof(slot->data);
+	memcpy(slot->data, record, slot->len);
+	slot->checksum = ring_checksum(slot);
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+}
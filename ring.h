@@ -0,0 +1,76 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "hash.h"
+
+/*
+ * The on-disk layout of the ring of recent records, shared by the
+ * honeypot, which writes it, and honeyring, which reads it. The file is
+ * a header followed by slot_count slots, all RING_SLOT_SIZE bytes.
+ *
+ * A record's sequence number picks its slot. While a slot is being
+ * written, its seq has RING_BUSY set; once it is complete, seq is the
+ * sequence number plus one, and the checksum covers the rest of the slot.
+ * A writer that died halfway leaves a slot that no reader will accept.
+ */
+#define RING_MAGIC		0x474e495259454e4fULL	/* "ONEYRING" */
+#define RING_VERSION		1
+#define RING_SLOT_SIZE		256
+#define RING_DEFAULT_SLOTS	65536
+#define RING_BUSY		(1ULL << 63)
+
+struct ring_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t slot_size;
+	uint64_t slot_count;
+	uint64_t next;		/* sequence number of the next record */
+	char padding[RING_SLOT_SIZE - 32];
+};
+
+struct ring_slot {
+	uint64_t seq;
+	uint64_t time_ns;	/* CLOCK_REALTIME */
+	uint64_t checksum;
+	uint16_t len;
+	char data[RING_SLOT_SIZE - 26];
+};
+
+static inline struct ring_slot *ring_slot(struct ring_header *header, uint64_t seq)
+{
+	return (struct ring_slot *)(header + 1) + seq % header->slot_count;
+}
+
+static inline uint64_t ring_checksum(const struct ring_slot *slot)
+{
+	return hash_bytes(&slot->time_ns, sizeof(slot->time_ns)) ^ hash_bytes(slot->data, slot->len) ^ slot->len;
+}
+
+/*
+ * Copies out the record with the given sequence number, if it is still
+ * there and intact. Returns 0 when it is.
+ */
+static inline int ring_read(struct ring_header *header, uint64_t seq, struct ring_slot *copy)
+{
+	struct ring_slot *slot = ring_slot(header, seq);
+	uint64_t before;
+
+	before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if (before != seq + 1)
+		return -1;
+	memcpy(copy, slot, sizeof(*copy));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != before)
+		return -1;
+	if (copy->len > sizeof(copy->data) || ring_checksum(copy) != copy->checksum)
+		return -1;
+	return 0;
+}
+
+int ring_open(const char *path, uint64_t slots);
+void ring_append(const char *record, size_t len);
+
+#endif
@@ -0,0 +1,384 @@
+/*
+ * sampling.c
+ *
+ *
+ * Decides how much of each attempt makes it into the honey log, for when
+ * scan waves come in faster than we care to write them down. Attempts with
+ * a credential or from a source that we have not seen before are always
+ * logged. Repeats are logged one time in N, and the rest are only counted,
+ * in count-min sketches that also keep track of the heaviest hitters. The
+ * log says which attempts were sampled and at what rate, so that weighting
+ * each of them by N gives unbiased counts.
+ *
+ * How many times a credential has been tried is counted once, by seen.c,
+ * and when it counts, which it does unless --counters=0, its count is what
+ * says whether the credential is new, and what ranks it among the heavy
+ * hitters. Without it, and for sources, which seen.c counts by session and
+ * not by attempt, a Bloom filter says whether we have seen it before, so
+ * now and then something new is taken for a repeat. That only means it is
+ * sampled like one, and logged as such. The filters start over once they
+ * are half full. Everything lives in shared memory, mapped before the
+ * fork, which the sessions update with atomics and no system calls.
+ *
+ * N comes from the command line or from a file, which is read again on
+ * SIGHUP. The file holds the rate, alone on a line; # starts a comment.
+ * The config file can set it too, and has the last word.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "sampling.h"
+#include "hash.h"
+
+#define CREDENTIAL_FILTER_BITS	(1 << 24)
+#define SOURCE_FILTER_BITS	(1 << 22)
+#define FILTER_HASHES		4
+#define SKETCH_WIDTH		(1 << 16)
+#define SKETCH_DEPTH		4
+#define SKETCH_TOP		8
+#define REPORT_TOP		5
+
+/*
+ * One of the most counted keys. hash is 0 while the slot is being
+ * rewritten, and name is always terminated within the slot.
+ */
+struct heavy_hitter {
+	uint64_t hash;
+	uint32_t estimate;
+	char name[52];
+};
+
+struct sketch {
+	uint32_t counters[SKETCH_DEPTH][SKETCH_WIDTH];
+	struct heavy_hitter top[SKETCH_TOP];
+};
+
+struct filter_stats {
+	unsigned long long bits_set;
+	unsigned long long resets;
+};
+
+struct sampling_state {
+	unsigned int rate;
+	unsigned long long attempts;
+	unsigned long long novel_credentials;
+	unsigned long long novel_sources;
+	unsigned long long sampled;
+	unsigned long long counted;
+	struct filter_stats credential_stats, source_stats;
+	uint64_t credential_filter[CREDENTIAL_FILTER_BITS / 64];
+	uint64_t source_filter[SOURCE_FILTER_BITS / 64];
+	struct sketch credentials, sources;
+};
+
+static struct sampling_state *state = 0;
+static int policy_fd = -1;
+
+/*
+ * Reads the rate from the policy file: the first line that is not blank
+ * or a comment.
+ */
+static int read_policy(unsigned int *rate)
+{
+	char buffer[256], *line, *end;
+	unsigned long value;
+	ssize_t len;
+
+	len = pread(policy_fd, buffer, sizeof(buffer) - 1, 0);
+	if (len < 0) {
+		perror("pread");
+		return -1;
+	}
+	buffer[len] = 0;
+	for (line = buffer; *line; line = end + strspn(end, "\n")) {
+		end = line + strcspn(line, "\n");
+		while (line < end && isspace((unsigned char)*line))
+			++line;
+		if (line == end || *line == '#')
+			continue;
+		value = strtoul(line, &line, 10);
+		while (line < end && isspace((unsigned char)*line))
+			++line;
+		if (!value || value > 1000000 || (line < end && *line != '#'))
+			return -1;
+		*rate = value;
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * Maps the shared state before forking. policy is either the rate itself,
+ * or a file to read it from, which we keep open for the reloads since it
+ * will be out of reach after the chroot.
+ */
+int sampling_init(const char *policy)
+{
+	unsigned long value;
+	unsigned int rate;
+	char *end;
+	void *map;
+
+	value = strtoul(policy, &end, 10);
+	if (isdigit((unsigned char)*policy) && !*end) {
+		if (!value || value > 1000000) {
+			fprintf(stderr, "Invalid sampling rate: %s\n", policy);
+			return -1;
+		}
+		rate = value;
+	} else {
+		policy_fd = open(policy, O_RDONLY | O_CLOEXEC);
+		if (policy_fd < 0) {
+			perror("open");
+			return -1;
+		}
+		if (read_policy(&rate) < 0) {
+			fprintf(stderr, "No sampling rate in %s.\n", policy);
+			return -1;
+		}
+	}
+	map = mmap(NULL, sizeof(struct sampling_state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	state = map;
+	state->rate = rate;
+	printf("Sampling repeated attempts at 1/%u.\n", rate);
+	return 0;
+}
+
+int sampling_enabled(void)
+{
+	return state != 0;
+}
+
+/*
+ * Picks up a new rate from the policy file, on SIGHUP. Sessions see it
+ * from their next attempt on.
+ */
+void sampling_reload(void)
+{
+	unsigned int rate;
+
+	if (!state || policy_fd < 0)
+		return;
+	if (read_policy(&rate) < 0) {
+		fprintf(stderr, "No valid sampling rate in the policy file, keeping 1/%u.\n", __atomic_load_n(&state->rate, __ATOMIC_RELAXED));
+		return;
+	}
+	__atomic_store_n(&state->rate, rate, __ATOMIC_RELAXED);
+	printf("Sampling repeated attempts at 1/%u.\n", rate);
+}
+
+/*
+ * Takes the rate from the config. Every worker does this on a reload,
+ * and the first one to change it says so.
+ */
+void sampling_set_rate(unsigned int rate)
+{
+	if (!state) {
+		fprintf(stderr, "Sampling was not enabled at startup, ignoring the sampling rate.\n");
+		return;
+	}
+	if (__atomic_exchange_n(&state->rate, rate, __ATOMIC_RELAXED) != rate)
+		printf("Sampling repeated attempts at 1/%u.\n", rate);
+}
+
+/*
+ * Sets the key's bits, and tells whether any of them were not set yet.
+ * Bits that are already set are only read, so that repeats, which is
+ * most of what we see, do not bounce the cache lines between cores.
+ */
+static int filter_add(uint64_t *filter, uint64_t bits, struct filter_stats *stats, uint64_t hash)
+{
+	uint64_t step = (hash >> 32) | 1, bit, mask;
+	int i, fresh = 0;
+
+	for (i = 0; i < FILTER_HASHES; ++i) {
+		bit = (hash + i * step) & (bits - 1);
+		mask = 1ULL << (bit % 64);
+		if (__atomic_load_n(&filter[bit / 64], __ATOMIC_RELAXED) & mask)
+			continue;
+		if (!(__atomic_fetch_or(&filter[bit / 64], mask, __ATOMIC_RELAXED) & mask)) {
+			__atomic_fetch_add(&stats->bits_set, 1, __ATOMIC_RELAXED);
+			fresh = 1;
+		}
+	}
+	return fresh;
+}
+
+/*
+ * Counts the key in the sketch, and returns its estimate.
+ */
+static uint32_t sketch_count(struct sketch *sketch, uint64_t hash)
+{
+	uint32_t estimate = UINT32_MAX, count;
+	int i;
+
+	for (i = 0; i < SKETCH_DEPTH; ++i) {
+		count = __atomic_add_fetch(&sketch->counters[i][(hash >> (16 * i)) & (SKETCH_WIDTH - 1)], 1, __ATOMIC_RELAXED);
+		if (count < estimate)
+			estimate = count;
+	}
+	return estimate;
+}
+
+/*
+ * Puts the key among the heavy hitters if its estimate beats the smallest
+ * one there. Writers may race for a slot; at worst a hitter is missing
+ * from one report.
+ */
+static void sketch_top(struct sketch *sketch, uint64_t hash, const char *name, uint32_t estimate)
+{
+	uint32_t count, lowest = UINT32_MAX;
+	struct heavy_hitter *slot = 0;
+	int i;
+
+	for (i = 0; i < SKETCH_TOP; ++i) {
+		if (__atomic_load_n(&sketch->top[i].hash, __ATOMIC_RELAXED) == hash) {
+			__atomic_store_n(&sketch->top[i].estimate, estimate, __ATOMIC_RELAXED);
+			return;
+		}
+		count = __atomic_load_n(&sketch->top[i].estimate, __ATOMIC_RELAXED);
+		if (count < lowest) {
+			lowest = count;
+			slot = &sketch->top[i];
+		}
+	}
+	if (estimate <= lowest)
+		return;
+	__atomic_store_n(&slot->hash, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	strncpy(slot->name, name, sizeof(slot->name) - 1);
+	__atomic_store_n(&slot->estimate, estimate, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->hash, hash, __ATOMIC_RELEASE);
+}
+
+static uint64_t mix(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+/*
+ * Decides whether an attempt gets logged. Returns 0 when it is only
+ * counted, or otherwise N, where the attempt stands for N like it: 1 for
+ * anything new, or when sampling is off, and the rate for sampled repeats.
+ * seen is the credential's count from seen_credential(), 0 if there is
+ * none. Called by the sessions, so this may not make any system calls.
+ */
+unsigned int sampling_decide(const char *username, const char *password, const char *ipaddr, unsigned int seen)
+{
+	char name[sizeof(((struct heavy_hitter *)0)->name)];
+	uint64_t credential, source;
+	unsigned int rate;
+	struct timespec now;
+	int novel = 0;
+
+	if (!state)
+		return 1;
+	credential = hash_bytes(password, strlen(password)) ^ mix(hash_bytes(username, strlen(username)));
+	source = hash_bytes(ipaddr, strlen(ipaddr));
+	__atomic_fetch_add(&state->attempts, 1, __ATOMIC_RELAXED);
+
+	snprintf(name, sizeof(name), "%s:%s", username, password);
+	sketch_top(&state->credentials, credential, name, seen ? seen : sketch_count(&state->credentials, credential));
+	sketch_top(&state->sources, source, ipaddr, sketch_count(&state->sources, source));
+	if (seen ? seen == 1 : filter_add(state->credential_filter, CREDENTIAL_FILTER_BITS, &state->credential_stats, credential)) {
+		__atomic_fetch_add(&state->novel_credentials, 1, __ATOMIC_RELAXED);
+		novel = 1;
+	}
+	if (filter_add(state->source_filter, SOURCE_FILTER_BITS, &state->source_stats, source)) {
+		__atomic_fetch_add(&state->novel_sources, 1, __ATOMIC_RELAXED);
+		novel = 1;
+	}
+	if (novel)
+		return 1;
+
+	rate = __atomic_load_n(&state->rate, __ATOMIC_RELAXED);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (mix(credential ^ source ^ (now.tv_sec * 1000000000ULL + now.tv_nsec)) % rate) {
+		__atomic_fetch_add(&state->counted, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	__atomic_fetch_add(&state->sampled, 1, __ATOMIC_RELAXED);
+	return rate;
+}
+
+/*
+ * Starts a filter over once half of its bits are set, past which it
+ * would take too many new keys for repeats.
+ */
+static unsigned long long check_filter(uint64_t *filter, uint64_t bits, struct filter_stats *stats, const char *what)
+{
+	unsigned long long percent = __atomic_load_n(&stats->bits_set, __ATOMIC_RELAXED) * 100 / bits;
+
+	if (percent >= 50) {
+		memset(filter, 0, bits / 8);
+		__atomic_store_n(&stats->bits_set, 0, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&stats->resets, 1, __ATOMIC_RELAXED);
+		printf("Sampling: the %s filter was half full, starting it over.\n", what);
+	}
+	return percent;
+}
+
+static void report_top(const struct sketch *sketch, const char *preposition)
+{
+	struct heavy_hitter top[SKETCH_TOP], swap;
+	int count = 0, i, j;
+	uint64_t hash;
+
+	for (i = 0; i < SKETCH_TOP; ++i) {
+		hash = __atomic_load_n(&sketch->top[i].hash, __ATOMIC_ACQUIRE);
+		if (!hash)
+			continue;
+		memcpy(&top[count], &sketch->top[i], sizeof(top[count]));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		/* It changed hands while we copied it. */
+		if (__atomic_load_n(&sketch->top[i].hash, __ATOMIC_RELAXED) != hash)
+			continue;
+		top[count].name[sizeof(top[count].name) - 1] = 0;
+		for (j = count++; j > 0 && top[j].estimate > top[j - 1].estimate; --j) {
+			swap = top[j];
+			top[j] = top[j - 1];
+			top[j - 1] = swap;
+		}
+	}
+	for (i = 0; i < count && i < REPORT_TOP; ++i)
+		printf("Sampling: ~%u attempts %s %s.\n", top[i].estimate, preposition, top[i].name);
+}
+
+void sampling_report(void)
+{
+	unsigned long long credential_percent, source_percent;
+
+	if (!state)
+		return;
+	printf("Sampling: %llu attempts, %llu with new credentials, %llu from new sources, %llu sampled, %llu only counted, now at 1/%u.\n",
+		__atomic_load_n(&state->attempts, __ATOMIC_RELAXED),
+		__atomic_load_n(&state->novel_credentials, __ATOMIC_RELAXED),
+		__atomic_load_n(&state->novel_sources, __ATOMIC_RELAXED),
+		__atomic_load_n(&state->sampled, __ATOMIC_RELAXED),
+		__atomic_load_n(&state->counted, __ATOMIC_RELAXED),
+		__atomic_load_n(&state->rate, __ATOMIC_RELAXED));
+	credential_percent = check_filter(state->credential_filter, CREDENTIAL_FILTER_BITS, &state->credential_stats, "credential");
+	source_percent = check_filter(state->source_filter, SOURCE_FILTER_BITS, &state->source_stats, "source");
+	printf("Sampling: credential filter %llu%% full, source filter %llu%% full, %llu and %llu restarts.\n",
+		credential_percent, source_percent,
+		__atomic_load_n(&state->credential_stats.resets, __ATOMIC_RELAXED),
+		__atomic_load_n(&state->source_stats.resets, __ATOMIC_RELAXED));
+	report_top(&state->credentials, "with");
+	report_top(&state->sources, "from");
+}
@@ -0,0 +1,11 @@
+#ifndef SAMPLING_H
+#define SAMPLING_H
+
+int sampling_init(const char *policy);
+int sampling_enabled(void);
+unsigned int sampling_decide(const char *username, const char *password, const char *ipaddr, unsigned int seen);
+void sampling_reload(void);
+void sampling_set_rate(unsigned int rate);
+void sampling_report(void);
+
+#endif
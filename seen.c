@@ -0,0 +1,155 @@
+/*
+ * seen.c
+ *
+ *
+ * How many times each credential has been tried, and how many sessions
+ * each source has had, across every session of every worker. Sessions
+ * cannot tell each other anything, so the counts live in a shared mapping
+ * made before the workers fork, and the sessions bump them with atomics
+ * and no system calls, which is what lets a session script let a bot in
+ * on its third try of a password, whichever connection that comes on.
+ *
+ * Each of the two tables is open addressed, keyed on a 64 bit hash of
+ * what it counts, and never grows. A key looks at a handful of slots
+ * from its hash on; when they are all taken by others, it takes over the
+ * one that went the longest without being seen, and the count that was
+ * there is gone. A count can be off by the attempts that race with an
+ * eviction of its slot, which is as exact as we need it.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "seen.h"
+#include "hash.h"
+
+/* Slots a key may go in, from its hash on. */
+#define SEEN_PROBES	8
+
+struct seen_entry {
+	uint64_t key;		/* 0 while free */
+	uint32_t count;
+	uint32_t last_seen;	/* seconds, on the monotonic clock */
+};
+
+struct seen_table {
+	unsigned long long used;
+	unsigned long long evicted;
+	unsigned long long lookups;
+} __attribute__((aligned(64)));
+
+static struct seen_table *credentials = 0, *sources = 0;
+static struct seen_entry *credential_entries = 0, *source_entries = 0;
+static uint64_t mask = 0;
+
+
+/*
+ * Maps both tables before forking, with entries rounded up to a power of
+ * two for each.
+ */
+int seen_init(unsigned long entries)
+{
+	size_t size;
+	char *map;
+
+	for (mask = 1; mask < entries; mask <<= 1);
+	size = 2 * sizeof(struct seen_table) + 2 * mask * sizeof(struct seen_entry);
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	credentials = (struct seen_table *)map;
+	sources = credentials + 1;
+	credential_entries = (struct seen_entry *)(sources + 1);
+	source_entries = credential_entries + mask;
+	printf("Counting credentials and sources across sessions, %llu of each, in %zu KB.\n", (unsigned long long)mask, size / 1024);
+	--mask;
+	return 0;
+}
+
+/*
+ * Counts the key, and returns how many times it has been counted now.
+ */
+static unsigned int count(struct seen_table *table, struct seen_entry *entries, uint64_t key)
+{
+	struct seen_entry *entry, *victim = 0;
+	uint32_t now, last, oldest = UINT32_MAX;
+	struct timespec ts;
+	uint64_t seen;
+	int probe;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	now = ts.tv_sec;
+	key = key ? key : 1;
+	__atomic_fetch_add(&table->lookups, 1, __ATOMIC_RELAXED);
+
+	for (probe = 0; probe < SEEN_PROBES; ++probe) {
+		entry = &entries[(key + probe) & mask];
+		seen = __atomic_load_n(&entry->key, __ATOMIC_RELAXED);
+		/* On failure, seen is whoever beat us to it, which may be the key itself. */
+		if (!seen && __atomic_compare_exchange_n(&entry->key, &seen, key, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			__atomic_fetch_add(&table->used, 1, __ATOMIC_RELAXED);
+			__atomic_store_n(&entry->last_seen, now, __ATOMIC_RELAXED);
+			return __atomic_add_fetch(&entry->count, 1, __ATOMIC_RELAXED);
+		}
+		if (seen == key) {
+			/* Only written when it changes, so that hot keys do not bounce their line around. */
+			if (__atomic_load_n(&entry->last_seen, __ATOMIC_RELAXED) != now)
+				__atomic_store_n(&entry->last_seen, now, __ATOMIC_RELAXED);
+			return __atomic_add_fetch(&entry->count, 1, __ATOMIC_RELAXED);
+		}
+		last = __atomic_load_n(&entry->last_seen, __ATOMIC_RELAXED);
+		if (last < oldest) {
+			oldest = last;
+			victim = entry;
+		}
+	}
+
+	/* Someone else took it over first; this one counts as new, and is not kept. */
+	seen = __atomic_load_n(&victim->key, __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&victim->key, &seen, key, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return 1;
+	__atomic_fetch_add(&table->evicted, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->count, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->last_seen, now, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/*
+ * Counts an attempt with a credential. Returns how many there have been
+ * with it, this one included, or 0 when we are not counting.
+ */
+unsigned int seen_credential(const char *username, const char *password)
+{
+	if (!credentials)
+		return 0;
+	return count(credentials, credential_entries, hash_bytes(username, strlen(username)) * 0x9e3779b97f4a7c15ULL ^ hash_bytes(password, strlen(password)));
+}
+
+/*
+ * Counts a session from a source, the same way.
+ */
+unsigned int seen_source(const char *ipaddr)
+{
+	if (!sources)
+		return 0;
+	return count(sources, source_entries, hash_bytes(ipaddr, strlen(ipaddr)));
+}
+
+void seen_report(void)
+{
+	if (!credentials)
+		return;
+	printf("Seen: %llu credentials in %llu slots, %llu evicted; %llu sources, %llu evicted; %llu and %llu lookups.\n",
+		__atomic_load_n(&credentials->used, __ATOMIC_RELAXED), (unsigned long long)mask + 1,
+		__atomic_load_n(&credentials->evicted, __ATOMIC_RELAXED),
+		__atomic_load_n(&sources->used, __ATOMIC_RELAXED),
+		__atomic_load_n(&sources->evicted, __ATOMIC_RELAXED),
+		__atomic_load_n(&credentials->lookups, __ATOMIC_RELAXED),
+		__atomic_load_n(&sources->lookups, __ATOMIC_RELAXED));
+}
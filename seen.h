@@ -0,0 +1,11 @@
+#ifndef SEEN_H
+#define SEEN_H
+
+#define SEEN_DEFAULT_ENTRIES	65536
+
+int seen_init(unsigned long entries);
+unsigned int seen_credential(const char *username, const char *password);
+unsigned int seen_source(const char *ipaddr);
+void seen_report(void);
+
+#endif
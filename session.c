@@ -0,0 +1,408 @@
+/*
+ * session.c
+ *
+ *
+ * What every session does, whatever it speaks: it takes the connection
+ * over from the listener, locks itself down, keeps the timers and the
+ * accounting, logs what it collects, and leaves with an exit code that
+ * tells the listener why. The talking is left to the protocol of the
+ * port the connection came in on.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "session.h"
+#include "protocol.h"
+#include "profile.h"
+#include "probes.h"
+#include "accounting.h"
+#include "honeylog.h"
+#include "seen.h"
+#include "rate.h"
+#include "config.h"
+#ifdef SECCOMP
+#include "seccomp-bpf.h"
+#endif
+
+
+static FILE *input = 0;
+static FILE *output = 0;
+static struct session *session = 0;
+static const struct session_policy *policy = 0;
+static const char *end_reason = 0;	/* when the exit code does not say it all */
+
+/* What the session has cost so far, for --accounting. */
+static struct {
+	unsigned long long reads, writes, flushes;
+	unsigned long long negotiate_cpu_us, negotiate_io_calls;
+	int negotiated;
+	enum fingerprint fingerprint;
+} usage;
+
+
+#ifdef SECCOMP
+static void seccomp_enable_filter()
+{
+	struct sock_filter filter[] = {
+		VALIDATE_ARCHITECTURE,
+		EXAMINE_SYSCALL,
+		ALLOW_SYSCALL(rt_sigreturn),
+		ALLOW_SYSCALL(rt_sigprocmask),
+		ALLOW_SYSCALL(rt_sigaction),
+		ALLOW_SYSCALL(nanosleep),
+		ALLOW_SYSCALL(exit_group),
+		ALLOW_SYSCALL(exit),
+		ALLOW_SYSCALL(read),
+		ALLOW_SYSCALL(write),
+		ALLOW_SYSCALL(alarm),
+		ALLOW_SYSCALL(fstat),
+		ALLOW_SYSCALL(newfstatat),
+		ALLOW_SYSCALL(mmap),
+		ALLOW_SYSCALL(ioctl),
+		ALLOW_SYSCALL(clock_nanosleep),
+		ALLOW_SYSCALL(setsockopt),
+		ALLOW_SYSCALL(clock_gettime),
+		ALLOW_SYSCALL(getrusage),
+		ALLOW_SYSCALL(sendfile),
+		KILL_PROCESS
+	};
+	struct sock_fprog prog = {
+		.len = (unsigned short)(sizeof(filter) / sizeof(filter[0])),
+		.filter = filter
+	};
+	if (profiling())
+		return;
+	if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog)) {
+		perror("prctl(SECCOMP)");
+		exit(EXIT_FAILURE);
+	}
+}
+#endif
+
+
+/*
+ * Milliseconds since the connection was accepted.
+ */
+long session_ms()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - session->start.tv_sec) * 1000 + (now.tv_nsec - session->start.tv_nsec) / 1000000;
+}
+
+/*
+ * CPU time the session has used, user and system.
+ */
+static unsigned long long session_cpu_us()
+{
+	struct rusage self;
+
+	if (getrusage(RUSAGE_SELF, &self) < 0)
+		return 0;
+	return (self.ru_utime.tv_sec + self.ru_stime.tv_sec) * 1000000ULL + self.ru_utime.tv_usec + self.ru_stime.tv_usec;
+}
+
+/*
+ * Adds what the session cost to the shared histograms.
+ */
+static void account_session()
+{
+	unsigned long long cpu_us = session_cpu_us(), io_calls = usage.reads + usage.writes;
+
+	if (usage.negotiated) {
+		accounting_record(usage.fingerprint, PHASE_NEGOTIATE, usage.negotiate_cpu_us, usage.negotiate_io_calls);
+		accounting_record(usage.fingerprint, PHASE_LOGIN, cpu_us - usage.negotiate_cpu_us, io_calls - usage.negotiate_io_calls);
+	} else
+		accounting_record(usage.fingerprint, PHASE_NEGOTIATE, cpu_us, io_calls);
+	accounting_record(usage.fingerprint, PHASE_TOTAL, cpu_us, io_calls);
+	accounting_count_io(usage.fingerprint, usage.reads, usage.writes, usage.flushes);
+}
+
+static const char *exit_reason(int code)
+{
+	switch (code) {
+		case SESSION_FAILED:
+			return "failed";
+		case SESSION_IDLE:
+			return "idle";
+		case SESSION_DEAD_PEER:
+			return "dead_peer";
+		default:
+			return "closed";
+	}
+}
+
+/*
+ * Leaves the session with an exit code that tells the listener why.
+ */
+void session_exit(int code)
+{
+	/* Nothing to trace, log or account before handle_connection has a session. */
+	if (!session)
+		_exit(code);
+	PROBE3(exit, session->id, code, session_ms());
+	honeylog_session_end(session, end_reason ? end_reason : exit_reason(code), accounting_fingerprint_name(usage.fingerprint));
+	if (accounting_enabled())
+		account_session();
+	if (profiling())
+		__gcov_dump();
+	_exit(code);
+}
+
+/*
+ * Works out why a read from the peer came back empty-handed.
+ */
+int session_read_failure()
+{
+	if (feof(input))
+		return SESSION_CLOSED;
+	if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return SESSION_IDLE;
+	if (errno == ETIMEDOUT || errno == EHOSTUNREACH)
+		return SESSION_DEAD_PEER;
+	return SESSION_CLOSED;
+}
+
+/*
+ * Reads a line, without its line ending. Control characters are dropped,
+ * as they would only garble the log, and lines that do not fit are cut
+ * short, with the rest of them thrown away.
+ */
+void session_read_line(char *buffer, size_t size)
+{
+	size_t len = 0;
+	int c;
+
+	while ((c = getc(input)) != '\n') {
+		if (c == EOF)
+			session_exit(session_read_failure());
+		if (!iscntrl(c) && len < size - 1)
+			buffer[len++] = c;
+	}
+	buffer[len] = 0;
+}
+
+/*
+ * Tunes the socket for the phase we are entering, so that a peer that
+ * vanished without a FIN is noticed in seconds: SO_RCVTIMEO makes reads
+ * give up on a silent peer, while keepalives and TCP_USER_TIMEOUT make
+ * the kernel declare it dead when it stops acknowledging.
+ */
+static void apply_phase(int fd, const struct phase_policy *phase)
+{
+	struct timeval timeout = { .tv_sec = phase->idle };
+	int on = 1;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &phase->keepalive_idle, sizeof(phase->keepalive_idle));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &phase->keepalive_interval, sizeof(phase->keepalive_interval));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &phase->keepalive_count, sizeof(phase->keepalive_count));
+	setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &phase->user_timeout, sizeof(phase->user_timeout));
+}
+
+/*
+ * With --accounting, the session talks to the socket through these, so
+ * that every read and write it makes gets counted.
+ */
+static ssize_t counted_read(void *cookie, char *buffer, size_t size)
+{
+	ssize_t len = read(*(int *)cookie, buffer, size);
+
+	++usage.reads;
+	return len;
+}
+
+static ssize_t counted_write(void *cookie, const char *buffer, size_t size)
+{
+	ssize_t len = write(*(int *)cookie, buffer, size);
+
+	++usage.writes;
+	/* stdio wants errors reported as nothing written, never as a negative count. */
+	return len < 0 ? 0 : len;
+}
+
+static FILE *open_stream(int *fd, const char *mode)
+{
+	cookie_io_functions_t functions = { .read = counted_read, .write = counted_write };
+
+	if (!accounting_enabled())
+		return fdopen(*fd, mode);
+	return fopencookie(fd, mode, functions);
+}
+
+void session_flush()
+{
+	++usage.flushes;
+	fflush(output);
+}
+
+/*
+ * Sends len bytes of fd from offset to the peer, after whatever stdio
+ * still has buffered. Write errors are left for the next read to notice,
+ * as with stdio.
+ */
+void session_sendfile(int fd, off_t offset, size_t len)
+{
+	ssize_t sent;
+
+	session_flush();
+	while (len) {
+		sent = sendfile(session->fd, fd, &offset, len);
+		++usage.writes;
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			return;
+		len -= sent;
+	}
+}
+
+void session_set_fingerprint(enum fingerprint fingerprint)
+{
+	usage.fingerprint = fingerprint;
+}
+
+/*
+ * Sleeps for the given number of milliseconds.
+ */
+void session_tarpit(int ms)
+{
+	struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+
+	if (ms > 0)
+		nanosleep(&ts, NULL);
+}
+
+/*
+ * Moves on from negotiating to logging in, which gets its own idle
+ * limits, and the clock for the whole login starts.
+ */
+void session_login()
+{
+	if (accounting_enabled()) {
+		usage.negotiate_cpu_us = session_cpu_us();
+		usage.negotiate_io_calls = usage.reads + usage.writes;
+		usage.negotiated = 1;
+	}
+	apply_phase(session->fd, &policy->login);
+
+	/* Quit after a minute or two, less when we are busy. */
+	alarm(policy->session_timeout);
+}
+
+/*
+ * Logs a username and password the peer gave us, and takes our time
+ * before the protocol turns them down. Returns how many times the
+ * credential has been tried in all sessions, or 0 if we do not count.
+ */
+unsigned int session_credential(const char *username, const char *password)
+{
+	unsigned int seen = seen_credential(username, password);
+
+	rate_attempt(session->listener, config_get()->persona, session->ipaddr);
+	PROBE3(credential, session->id, username, password);
+	honeylog_credential(session, username, password, seen);
+	printf("Honeypotted: %s - %s:%s\n", session->ipaddr, username, password);
+	session_tarpit(policy->reply_delay);
+	return seen;
+}
+
+
+/*
+ * When the listener dies, we want to kill the clients too, but
+ * first we make sure to say goodbye.
+ */
+static void SIGINT_handler(int sig)
+{
+	(void) sig;
+
+	fprintf(stderr, "Got SIGINT, exiting gracefully.\n");
+	end_reason = "shutdown";
+	session->protocol->shutdown(output);
+	session_flush();
+	session_exit(SESSION_CLOSED);
+}
+
+/*
+ * Handle the alarm which breaks us off of negotiating,
+ * or of a login that has gone on for too long.
+ */
+static void SIGALRM_handler(int sig)
+{
+	int code;
+
+	(void) sig;
+
+	alarm(0);
+	end_reason = "timeout";
+	code = session->protocol->timeout(output);
+	session_flush();
+	session_exit(code);
+}
+
+
+void handle_connection(struct session *new_session)
+{
+	int fd = new_session->fd;
+	struct rlimit limit;
+
+	limit.rlim_cur = limit.rlim_max = 90;
+	setrlimit(RLIMIT_CPU, &limit);
+	limit.rlim_cur = limit.rlim_max = 0;
+	setrlimit(RLIMIT_NPROC, &limit);
+
+	session = new_session;
+	policy = &session->policy;
+	session->visits = seen_source(session->ipaddr);
+
+	input = open_stream(&session->fd, "r");
+	if (!input) {
+		perror("fdopen");
+		session_exit(SESSION_FAILED);
+	}
+	output = open_stream(&session->fd, "w");
+	if (!output) {
+		perror("fdopen");
+		session_exit(SESSION_FAILED);
+	}
+
+	/* A dead peer should show up as a failed read, not kill us outright. */
+	signal(SIGPIPE, SIG_IGN);
+	apply_phase(fd, &policy->negotiate);
+
+#ifdef SECCOMP
+	seccomp_enable_filter();
+#endif
+
+	/* Set the alarm handler to quit on bad clients. */
+	if (signal(SIGALRM, SIGALRM_handler) == SIG_ERR) {
+		perror("signal");
+		session_exit(SESSION_FAILED);
+	}
+	/* Accept ^C -> say goodbye. */
+	if (signal(SIGINT, SIGINT_handler) == SIG_ERR) {
+		perror("signal");
+		session_exit(SESSION_FAILED);
+	}
+
+	session->protocol->serve(session, input, output);
+	session_exit(SESSION_FAILED);
+}
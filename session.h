@@ -0,0 +1,21 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <sys/types.h>
+
+#include "telnet_srv.h"
+#include "accounting.h"
+
+void handle_connection(struct session *session);
+void session_exit(int code) __attribute__((noreturn));
+int session_read_failure(void);
+void session_read_line(char *buffer, size_t size);
+void session_flush(void);
+void session_login(void);
+unsigned int session_credential(const char *username, const char *password);
+void session_sendfile(int fd, off_t offset, size_t len);
+void session_tarpit(int ms);
+void session_set_fingerprint(enum fingerprint fingerprint);
+long session_ms(void);
+
+#endif
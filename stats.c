@@ -0,0 +1,175 @@
+/*
+ * stats.c
+ *
+ *
+ * Per-worker counters, kept in memory that survives fork() as shared.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "stats.h"
+
+/*
+ * Shared by all the workers, in its own cache line in front of the shards.
+ */
+struct stats_header {
+	unsigned long long run_start;
+	unsigned long long session_sequence;
+} __attribute__((aligned(64)));
+
+static struct stats_header *header = 0;
+static struct stats_shard *shards = 0;
+static int shard_count = 0;
+static int netstat_fd = -1;
+static int netstat_seen = 0;
+static unsigned long long listen_overflows = 0, listen_drops = 0;
+
+/*
+ * Maps the shards before forking, so that all workers see the same pages.
+ */
+int stats_init(int count)
+{
+	void *map;
+
+	map = mmap(NULL, sizeof(struct stats_header) + count * sizeof(struct stats_shard), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	header = map;
+	header->run_start = time(NULL);
+	shards = (struct stats_shard *)(header + 1);
+	shard_count = count;
+	return 0;
+}
+
+struct stats_shard *stats_shard(int index)
+{
+	return &shards[index];
+}
+
+/*
+ * How many sessions are running across all the workers.
+ */
+unsigned long long stats_live(void)
+{
+	unsigned long long live = 0;
+	int i;
+
+	for (i = 0; i < shard_count; ++i) {
+		live += __atomic_load_n(&shards[i].accepted, __ATOMIC_RELAXED);
+		live -= __atomic_load_n(&shards[i].fork_failed, __ATOMIC_RELAXED);
+		live -= __atomic_load_n(&shards[i].exited, __ATOMIC_RELAXED);
+	}
+	return live;
+}
+
+/*
+ * Hands out session ids, which are unique across workers and restarts:
+ * the top half is when we started, the bottom half counts up from there.
+ */
+unsigned long long stats_next_session_id(void)
+{
+	return header->run_start << 32 | (uint32_t)__atomic_add_fetch(&header->session_sequence, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Finds the ListenOverflows and ListenDrops counters in the TcpExt lines,
+ * where the first line carries the names and the second one the values.
+ */
+static int read_netstat(unsigned long long *overflows, unsigned long long *drops)
+{
+	char buffer[8192], *names, *values, *name_end, *value_end;
+	ssize_t len;
+	int found = 0;
+
+	if (netstat_fd < 0)
+		return -1;
+	len = pread(netstat_fd, buffer, sizeof(buffer) - 1, 0);
+	if (len <= 0)
+		return -1;
+	buffer[len] = 0;
+	names = strstr(buffer, "TcpExt:");
+	if (!names)
+		return -1;
+	values = strstr(names + 1, "TcpExt:");
+	if (!values)
+		return -1;
+	names += 7;
+	values += 7;
+	while (*names && *names != '\n' && *values && *values != '\n') {
+		while (*names == ' ')
+			++names;
+		while (*values == ' ')
+			++values;
+		name_end = names + strcspn(names, " \n");
+		value_end = values + strcspn(values, " \n");
+		if (name_end - names == 15 && !strncmp(names, "ListenOverflows", 15)) {
+			*overflows = strtoull(values, NULL, 10);
+			++found;
+		} else if (name_end - names == 11 && !strncmp(names, "ListenDrops", 11)) {
+			*drops = strtoull(values, NULL, 10);
+			++found;
+		}
+		names = name_end;
+		values = value_end;
+	}
+	return found == 2 ? 0 : -1;
+}
+
+/*
+ * Opens /proc/net/netstat while we can still see it. It has to happen
+ * before the chroot; the descriptor can be reread from the start forever.
+ */
+void stats_watch_netstat(void)
+{
+	netstat_fd = open("/proc/net/netstat", O_RDONLY | O_CLOEXEC);
+	if (netstat_fd < 0)
+		perror("open(/proc/net/netstat)");
+	else if (!read_netstat(&listen_overflows, &listen_drops))
+		netstat_seen = 1;
+}
+
+/*
+ * Sums up all of the shards and prints them to the debug log.
+ */
+void stats_report(void)
+{
+	unsigned long long accepted = 0, fork_failed = 0, exited = 0, overflows, drops;
+	unsigned long long idle_reclaimed = 0, dead_reclaimed = 0, new_sources = 0, parked = 0, shed = 0, ignored = 0;
+	int i;
+
+	for (i = 0; i < shard_count; ++i) {
+		accepted += __atomic_load_n(&shards[i].accepted, __ATOMIC_RELAXED);
+		fork_failed += __atomic_load_n(&shards[i].fork_failed, __ATOMIC_RELAXED);
+		exited += __atomic_load_n(&shards[i].exited, __ATOMIC_RELAXED);
+		idle_reclaimed += __atomic_load_n(&shards[i].idle_reclaimed, __ATOMIC_RELAXED);
+		dead_reclaimed += __atomic_load_n(&shards[i].dead_reclaimed, __ATOMIC_RELAXED);
+		new_sources += __atomic_load_n(&shards[i].new_sources, __ATOMIC_RELAXED);
+		parked += __atomic_load_n(&shards[i].parked, __ATOMIC_RELAXED);
+		shed += __atomic_load_n(&shards[i].shed, __ATOMIC_RELAXED);
+		ignored += __atomic_load_n(&shards[i].ignored, __ATOMIC_RELAXED);
+	}
+	printf("Stats: %llu accepted, %llu live, %llu fork failures, %d workers.\n",
+		accepted, accepted - fork_failed - exited, fork_failed, shard_count);
+	printf("Stats: %llu idle sessions and %llu dead peers reclaimed.\n", idle_reclaimed, dead_reclaimed);
+	printf("Stats: %llu connections from new sources, %llu parked, %llu shed, %llu ignored.\n", new_sources, parked, shed, ignored);
+
+	/* These count for the whole network namespace, not just our sockets. */
+	if (!read_netstat(&overflows, &drops)) {
+		if (netstat_seen)
+			printf("Stats: %llu listen overflows, %llu listen drops since last report.\n",
+				overflows - listen_overflows, drops - listen_drops);
+		netstat_seen = 1;
+		listen_overflows = overflows;
+		listen_drops = drops;
+	}
+}
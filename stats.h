@@ -0,0 +1,30 @@
+#ifndef STATS_H
+#define STATS_H
+
+/*
+ * Each worker owns one shard and is the only one writing to it, so the
+ * counters never bounce between cores. The shards live in a shared mapping
+ * so that whoever reports can sum them up without talking to the workers.
+ */
+struct stats_shard {
+	unsigned long long accepted;
+	unsigned long long fork_failed;
+	unsigned long long exited;
+	unsigned long long idle_reclaimed;
+	unsigned long long dead_reclaimed;
+	unsigned long long new_sources;
+	unsigned long long parked;
+	unsigned long long shed;
+	unsigned long long ignored;
+} __attribute__((aligned(64)));
+
+#define stats_inc(shard, field) __atomic_fetch_add(&(shard)->field, 1, __ATOMIC_RELAXED)
+
+int stats_init(int shards);
+struct stats_shard *stats_shard(int index);
+unsigned long long stats_live(void);
+unsigned long long stats_next_session_id(void);
+void stats_watch_netstat(void);
+void stats_report(void);
+
+#endif
@@ -78,5 +78,6 @@
 
 #define IS 0
 #define SEND 1
+#define INFO 2
 
 #endif
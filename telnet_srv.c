@@ -33,15 +33,21 @@
  * 
  */
  
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <signal.h>
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
-#include <sys/resource.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
 
 /*
  * telnet.h contains some #defines for the various
@@ -51,49 +57,17 @@
  */
 #include "telnet.h"
 #include "telnet_srv.h"
-#ifdef SECCOMP
-#include "seccomp-bpf.h"
-#endif
+#include "session.h"
+#include "protocol.h"
+#include "probes.h"
+#include "accounting.h"
 
 
 static FILE *input = 0;
 static FILE *output = 0;
-FILE *logfile = 0;
 static int is_telnet_client = 0;
-
-
-#ifdef SECCOMP
-static void seccomp_enable_filter()
-{
-	struct sock_filter filter[] = {
-		VALIDATE_ARCHITECTURE,
-		EXAMINE_SYSCALL,
-		ALLOW_SYSCALL(rt_sigreturn),
-		ALLOW_SYSCALL(rt_sigprocmask),
-		ALLOW_SYSCALL(rt_sigaction),
-		ALLOW_SYSCALL(nanosleep),
-		ALLOW_SYSCALL(exit_group),
-		ALLOW_SYSCALL(exit),
-		ALLOW_SYSCALL(read),
-		ALLOW_SYSCALL(write),
-		ALLOW_SYSCALL(alarm),
-		ALLOW_SYSCALL(fstat),
-		ALLOW_SYSCALL(newfstatat),
-		ALLOW_SYSCALL(mmap),
-		ALLOW_SYSCALL(ioctl),
-		ALLOW_SYSCALL(clock_nanosleep),
-		KILL_PROCESS
-	};
-	struct sock_fprog prog = {
-		.len = (unsigned short)(sizeof(filter) / sizeof(filter[0])),
-		.filter = filter
-	};
-	if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog)) {
-		perror("prctl(SECCOMP)");
-		exit(EXIT_FAILURE);
-	}
-}
-#endif
+static struct session *session = 0;
+static const struct session_policy *policy = 0;
 
 
 /*
@@ -117,42 +91,32 @@ static void newline(int n)
  * When the listener dies, we want to kill the clients too, but
  * first we make sure to send a nice message and restore the cursor.
  */
-static void SIGINT_handler(int sig)
+static void telnet_shutdown(FILE *output)
 {
-	(void) sig;
-
-	fprintf(stderr, "Got SIGINT, exiting gracefully.\n");
 	newline(3);
 	fprintf(output, "\033[1;33m*** Server shutting down. Goodbye. ***\033[0m\033[?25h");
 	newline(2);
-	fflush(output);
-	_exit(EXIT_SUCCESS);
 }
 
 /*
- * Handle the alarm which breaks us off of options
- * handling if we didn't receive a terminal.
+ * The alarm breaks us off of options handling if we
+ * didn't receive a terminal, and off of a long login.
  */
-static void SIGALRM_handler(int sig)
+static int telnet_timeout(FILE *output)
 {
-	(void) sig;
-
-	alarm(0);
+	PROBE3(timeout, session->id, session_ms(), is_telnet_client);
 	if (!is_telnet_client) {
 		fprintf(stderr, "Bad telnet negotiation, exiting.\n");
 		fprintf(output, "\033[?25h\033[0m\033[H\033[2J");
 		fprintf(output, "\033[1;31m*** You must connect using a real telnet client. ***\033[0m");
 		newline(1);
-		fflush(output);
-		_exit(EXIT_FAILURE);
-	} else {
-		fprintf(stderr, "Timeout reached, exiting.\n");
-		newline(3);
-		fprintf(output, "\033[1;33m*** Authentication timed out. Please reconnect. ***\033[0m\033[?25h");
-		newline(2);
-		fflush(output);
-		_exit(EXIT_SUCCESS);
+		return SESSION_FAILED;
 	}
+	fprintf(stderr, "Timeout reached, exiting.\n");
+	newline(3);
+	fprintf(output, "\033[1;33m*** Authentication timed out. Please reconnect. ***\033[0m\033[?25h");
+	newline(2);
+	return SESSION_CLOSED;
 }
 
 /*
@@ -161,16 +125,16 @@ static void SIGALRM_handler(int sig)
 static void readline(char *buffer, size_t size, int password)
 {
 	unsigned int i;
-	unsigned char c;
+	int c;
 	
 	/* We make sure to restore the cursor. */
 	fprintf(output, "\033[?25h");
-	fflush(output);
+	session_flush();
 	
 	for (i = 0; i < size - 1; ++i) {
-		if (feof(input))
-			_exit(EXIT_SUCCESS);
 		c = getc(input);
+		if (c == EOF)
+			session_exit(session_read_failure());
 		if (c == '\r' || c == '\n') {
 			if (c == '\r') {
 				/* the next char is either \n or \0, which we can discard. */
@@ -185,46 +149,92 @@ static void readline(char *buffer, size_t size, int password)
 			}
 			if (password) {
 				fprintf(output, "\033[%dD\033[K", i);
-				fflush(output);
+				session_flush();
 				i = -1;
 				continue;
 			} else {
 				fprintf(output, "\b \b");
-				fflush(output);
+				session_flush();
 				i -= 2;
 				continue;
 			}
 		} else if (c == 0xff)
-			_exit(EXIT_SUCCESS);
+			session_exit(SESSION_CLOSED);
 		else if (iscntrl(c)) {
 			--i;
 			continue;
 		}
 		buffer[i] = c;
 		putc(password ? '*' : c, output);
-		fflush(output);
+		session_flush();
 	}
 	buffer[i] = 0;
+	PROBE3(line, session->id, i, password);
 	
 	/* And we hide it again at the end. */
 	fprintf(output, "\033[?25l");
-	fflush(output);
+	session_flush();
 }
 
 /*
- * These are the options we want to use as
- * a telnet server. These are set in set_options()
+ * These are the options we want to use as a telnet server, and
+ * what we want the client to do, each in ascending option order:
+ * WILL or WONT in the first list, DO or DONT in the second.
  */
-static unsigned char telnet_options[256] = { 0 };
-static unsigned char telnet_willack[256] = { 0 };
+#define SERVER_OPTIONS(X, arg)	\
+	X(arg, WILL, ECHO)		/* We will echo input */ \
+	X(arg, WILL, SGA)		/* We will set graphics modes */ \
+	X(arg, WONT, NEW_ENVIRON)	/* We will not set new environments */
+
+#define CLIENT_OPTIONS(X, arg)	\
+	X(arg, DONT, ECHO)		/* The client should not echo its own input */ \
+	X(arg, DO, SGA)			/* The client can set a graphics mode */ \
+	X(arg, DO, TTYPE)		/* The client should tell us its terminal type (very important) */ \
+	X(arg, DO, NAWS)		/* The client should tell us its window size */ \
+	X(arg, DONT, LINEMODE)		/* No linemode */ \
+	X(arg, DO, NEW_ENVIRON)		/* And the client can set a new environment */
 
 /*
- * These are the values we have set or
- * agreed to during our handshake.
- * These are set in send_command(...)
+ * Everything below is generated from those two lists by the compiler.
+ * Our answer to DO or DONT for each option, and to WILL or WONT; options
+ * we have no opinion about get DONT and WONT.
  */
-static unsigned char telnet_do_set[256]  = { 0 };
-static unsigned char telnet_will_set[256]= { 0 };
+#define OPTION_ENTRY(arg, cmd, opt)	[opt] = cmd,
+static const unsigned char telnet_options[256] = { SERVER_OPTIONS(OPTION_ENTRY, 0) };
+static const unsigned char telnet_willack[256] = { CLIENT_OPTIONS(OPTION_ENTRY, 0) };
+
+/* What we send as soon as the client connects. */
+#define OFFER_BYTES(arg, cmd, opt)	IAC, cmd, opt,
+static const unsigned char telnet_offer[] = { SERVER_OPTIONS(OFFER_BYTES, 0) CLIENT_OPTIONS(OFFER_BYTES, 0) };
+
+/*
+ * These are the values we have set or agreed to during our handshake:
+ * for DO/DONT and for WILL/WONT, whether we have sent one for an option
+ * and, if we have, whether it was the positive one. 128 bytes, where
+ * this used to take 512.
+ */
+struct negotiation {
+	uint64_t sent[2][4];
+	uint64_t positive[2][4];
+} __attribute__((aligned(64)));
+
+#define SIDE(cmd)		((cmd) == WILL || (cmd) == WONT)
+#define POSITIVE(cmd)		((cmd) == DO || (cmd) == WILL)
+#define OFFER_BIT(arg, cmd, opt)	\
+	| (SIDE(cmd) == (arg) / 4 && (opt) / 64 == (arg) % 4 ? 1ULL << ((opt) % 64) : 0)
+#define POSITIVE_BIT(arg, cmd, opt)	\
+	| (POSITIVE(cmd) && SIDE(cmd) == (arg) / 4 && (opt) / 64 == (arg) % 4 ? 1ULL << ((opt) % 64) : 0)
+#define OFFER_WORD(BIT, word)	(0 SERVER_OPTIONS(BIT, word) CLIENT_OPTIONS(BIT, word))
+#define OFFER_WORDS(BIT, side)	{ OFFER_WORD(BIT, side * 4), OFFER_WORD(BIT, side * 4 + 1), \
+				  OFFER_WORD(BIT, side * 4 + 2), OFFER_WORD(BIT, side * 4 + 3) }
+
+/* Where the handshake stands once telnet_offer has gone out. */
+static const struct negotiation offered = {
+	.sent = { OFFER_WORDS(OFFER_BIT, 0), OFFER_WORDS(OFFER_BIT, 1) },
+	.positive = { OFFER_WORDS(POSITIVE_BIT, 0), OFFER_WORDS(POSITIVE_BIT, 1) }
+};
+
+static struct negotiation negotiation;
 
 /*
  * Send a command (cmd) to the telnet client
@@ -232,63 +242,144 @@ static unsigned char telnet_will_set[256]= { 0 };
  */
 static void send_command(int cmd, int opt)
 {
+	uint64_t bit = 1ULL << (opt % 64);
+	int side = SIDE(cmd), word = opt / 64;
+
 	/* Send a command to the telnet client */
-	if (cmd == DO || cmd == DONT) {
-		/* DO commands say what the client should do. */
-		if (((cmd == DO) && (telnet_do_set[opt] != DO)) || ((cmd == DONT) && (telnet_do_set[opt] != DONT))) {
-			/* And we only send them if there is a disagreement */
-			telnet_do_set[opt] = cmd;
-			fprintf(output, "%c%c%c", IAC, cmd, opt);
-		}
-	} else if (cmd == WILL || cmd == WONT) {
-		/* Similarly, WILL commands say what the server will do. */
-		if (((cmd == WILL) && (telnet_will_set[opt] != WILL)) || ((cmd == WONT) && (telnet_will_set[opt] != WONT))) {
-			/* And we only send them during disagreements */
-			telnet_will_set[opt] = cmd;
-			fprintf(output, "%c%c%c", IAC, cmd, opt);
-		}
+	if (cmd == DO || cmd == DONT || cmd == WILL || cmd == WONT) {
+		/* DO commands say what the client should do, WILL commands
+		 * what the server will do. And we only send them if there
+		 * is a disagreement. */
+		if ((negotiation.sent[side][word] & bit) && !(negotiation.positive[side][word] & bit) == !POSITIVE(cmd))
+			return;
+		negotiation.sent[side][word] |= bit;
+		if (POSITIVE(cmd))
+			negotiation.positive[side][word] |= bit;
+		else
+			negotiation.positive[side][word] &= ~bit;
+		fprintf(output, "%c%c%c", IAC, cmd, opt);
 	} else
 		/* Other commands are sent raw */
 		fprintf(output, "%c%c", IAC, cmd);
-	fflush(output);
 }
 
 /*
- * Set the default options for the telnet server.
+ * Let the client know what we're using.
  */
 static void set_options()
 {
-	int option;
-	
-	/* We will echo input */
-	telnet_options[ECHO] = WILL;
-	/* We will set graphics modes */
-	telnet_options[SGA] = WILL;
-	/* We will not set new environments */
-	telnet_options[NEW_ENVIRON] = WONT;
-	
-	/* The client should not echo its own input */
-	telnet_willack[ECHO] = DONT;
-	/* The client can set a graphics mode */
-	telnet_willack[SGA] = DO;
-	/* We do not care about window size updates */
-	telnet_willack[NAWS] = DONT;
-	/* The client should tell us its terminal type (very important) */
-	telnet_willack[TTYPE] = DO;
-	/* No linemode */
-	telnet_willack[LINEMODE] = DONT;
-	/* And the client can set a new environment */
-	telnet_willack[NEW_ENVIRON] = DO;
-	
-	
-	/* Let the client know what we're using */
-	for (option = 0; option < (int)sizeof(telnet_options); ++option) {
-		if (telnet_options[option])
-			send_command(telnet_options[option], option);
+	negotiation = offered;
+	fwrite(telnet_offer, 1, sizeof(telnet_offer), output);
+	session_flush();
+}
+
+/* How long we wait for each further terminal type, once we have one. */
+#define TTYPE_CYCLE_MS		250
+#define TTYPE_CYCLE_MAX		4
+#define TTYPE_SEND_MAX		8	/* SENDs before we stop asking, whatever comes back */
+
+/* NEW-ENVIRON subnegotiation codes, from RFC 1572. */
+#define ENV_VAR		0
+#define ENV_VALUE	1
+#define ENV_ESC		2
+#define ENV_USERVAR	3
+
+/*
+ * Appends len bytes to the string in field, keeping it terminated and
+ * replacing anything unprintable, since all of this ends up in logs.
+ */
+static void append_field(char *field, size_t size, const unsigned char *data, size_t len)
+{
+	size_t used = strlen(field);
+
+	for (; len && used < size - 1; --len, ++data)
+		field[used++] = isprint(*data) && *data != ' ' ? *data : '?';
+	field[used] = 0;
+}
+
+/*
+ * Handles a TTYPE IS, and returns whether the client has run through its
+ * list: RFC 1091 clients repeat the last type, others start over.
+ */
+static int parse_ttype(const unsigned char *sb, int len)
+{
+	struct client_info *client = &session->client;
+	char terminal[40] = { 0 }, *seen, *next;
+	int count = 1;
+
+	if (len < 2 || sb[1] != IS)
+		return 0;
+	append_field(terminal, sizeof(terminal), sb + 2, len - 2);
+	PROBE2(ttype, session->id, terminal);
+	for (seen = client->terminals; *seen; seen = next + 1) {
+		next = strchrnul(seen, ',');
+		if ((size_t)(next - seen) == strlen(terminal) && !memcmp(seen, terminal, next - seen))
+			return 1;
+		++count;
+		if (!*next)
+			break;
 	}
-	for (option = 0; option < (int)sizeof(telnet_willack); ++option) {
-		if (telnet_willack[option])
-			send_command(telnet_willack[option], option);
+	if (client->terminals[0])
+		append_field(client->terminals, sizeof(client->terminals), (const unsigned char *)",", 1);
+	else
+		session_set_fingerprint(accounting_fingerprint(1, terminal));
+	append_field(client->terminals, sizeof(client->terminals), (const unsigned char *)terminal, strlen(terminal));
+	return count >= TTYPE_CYCLE_MAX;
+}
+
+static void parse_naws(const unsigned char *sb, int len)
+{
+	if (len != 5)
+		return;
+	session->client.width = sb[1] << 8 | sb[2];
+	session->client.height = sb[3] << 8 | sb[4];
+}
+
+/*
+ * Handles a NEW-ENVIRON IS or INFO: a list of VAR or USERVAR names, each
+ * followed by an optional VALUE, with ESC quoting any of those codes.
+ * Variables are unescaped in place, over the bytes they came in.
+ */
+static void parse_environ(unsigned char *sb, int len)
+{
+	struct client_info *client = &session->client;
+	unsigned char *name = 0, *value = 0, *end = sb + 2, *in;
+	size_t name_len = 0;
+
+	if (len < 2 || (sb[1] != IS && sb[1] != INFO))
+		return;
+	for (in = sb + 2; in <= sb + len; ++in) {
+		if (in == sb + len || *in == ENV_VAR || *in == ENV_USERVAR || *in == ENV_VALUE) {
+			/* Whatever we were collecting ends here. */
+			if (name && value) {
+				if (name_len == 4 && !memcmp(name, "USER", 4))
+					append_field(client->user, sizeof(client->user), value, end - value);
+				else if (name_len == 7 && !memcmp(name, "DISPLAY", 7))
+					append_field(client->display, sizeof(client->display), value, end - value);
+				else if (name_len) {
+					if (client->environ[0] && strlen(client->environ) < sizeof(client->environ) - 1)
+						strcat(client->environ, " ");
+					append_field(client->environ, sizeof(client->environ), name, name_len);
+					append_field(client->environ, sizeof(client->environ), (const unsigned char *)"=", 1);
+					append_field(client->environ, sizeof(client->environ), value, end - value);
+				}
+			}
+			if (in == sb + len)
+				break;
+			if (*in == ENV_VALUE) {
+				if (!name)
+					continue;
+				name_len = end - name;
+				value = end = in + 1;
+			} else {
+				name = end = in + 1;
+				value = 0;
+			}
+			continue;
+		}
+		if (*in == ENV_ESC && in + 1 < sb + len)
+			++in;
+		*end++ = *in;
 	}
 }
 
@@ -297,63 +388,92 @@ static void set_options()
  */
 static void negotiate_telnet()
 {
-	/* The default terminal is ANSI */
-	char term[1024] = {'a','n','s','i', 0};
-	int ttype, done = 0, sb_mode = 0, do_echo = 0, sb_len = 0;
-	/* Various pieces for the telnet communication */
-	char sb[1024];
-	// unsigned char opt, i;
+	static const unsigned char environ_send[] = { IAC, SB, NEW_ENVIRON, SEND, ENV_VAR, ENV_USERVAR, IAC, SE };
+	static const unsigned char ttype_send[] = { IAC, SB, TTYPE, SEND, IAC, SE };
+	struct timeval cycle_timeout = { .tv_usec = TTYPE_CYCLE_MS * 1000 };
+	int done = 0, sb_mode = 0, do_echo = 0, sb_len = 0, cycling = 0, ttype_done = 0, environ_pending = 0, ttype_sends = 0;
+	/* Various pieces for the telnet communication; only sb_len bytes of sb are valid. */
+	unsigned char sb[1024];
 	int opt, i;
-	memset(sb, 0, sizeof(sb));
 	
 	
 	/* Set the default options. */
 	set_options();	
 
-	/* We will stop handling options after ten seconds */
-	alarm(10);
+	/* We will stop handling options after a few seconds. This stays armed
+	 * while terminal types cycle, so a peer that keeps talking without
+	 * ever going quiet cannot hold us here. */
+	alarm(policy->negotiate_timeout);
 
 	/* Let's do this */
-	while (!feof(stdin) && done < 1) {
+	while (!done && !(ttype_done && !environ_pending)) {
 		/* Get either IAC (start command) or a regular character (break, unless in SB mode) */
 		i = getc(input);
+		if (i == EOF) {
+			/* Clients that do not cycle terminal types just go quiet. */
+			if (cycling && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				clearerr(input);
+				break;
+			}
+			session_exit(session_read_failure());
+		}
 		if (i == IAC) {
 			/* If IAC, get the command */
 			i = getc(input);
+			if (i == EOF)
+				session_exit(session_read_failure());
 			switch (i) {
 				case SE:
 					/* End of extended option mode */
 					sb_mode = 0;
+					if (!sb_len)
+						break;
 					if (sb[0] == TTYPE) {
-						alarm(0);
-						is_telnet_client = 1;
 						/* This was a response to the TTYPE command, meaning
-						 * that this should be a terminal type */
-						strncpy(term, &sb[2], sizeof(term) - 1);
-						term[sizeof(term) - 1] = 0;
-						++done;
+						 * that this should be a terminal type. We keep
+						 * asking for more until the client runs out. */
+						if (!cycling) {
+							is_telnet_client = 1;
+							cycling = 1;
+							setsockopt(session->fd, SOL_SOCKET, SO_RCVTIMEO, &cycle_timeout, sizeof(cycle_timeout));
+						}
+						ttype_done = parse_ttype(sb, sb_len) || ttype_sends >= TTYPE_SEND_MAX;
+						if (!ttype_done) {
+							fwrite(ttype_send, 1, sizeof(ttype_send), output);
+							session_flush();
+							++ttype_sends;
+						}
+					} else if (sb[0] == NAWS)
+						parse_naws(sb, sb_len);
+					else if (sb[0] == NEW_ENVIRON) {
+						parse_environ(sb, sb_len);
+						environ_pending = 0;
 					}
 					break;
 				case NOP:
 					/* No Op */
 					send_command(NOP, 0);
-					fflush(output);
+					session_flush();
 					break;
 				case WILL:
 				case WONT:
 					/* Will / Won't Negotiation */
 					opt = getc(input);
 					if (opt < 0 || opt >= (int)sizeof(telnet_willack))
-						_exit(EXIT_FAILURE);
-					if (!telnet_willack[opt])
-						/* We default to WONT */
-						telnet_willack[opt] = WONT;
-					send_command(telnet_willack[opt], opt);
-					fflush(output);
-					if ((i == WILL) && (opt == TTYPE)) {
+						session_exit(session_read_failure());
+					/* We default to WONT */
+					send_command(telnet_willack[opt] ? telnet_willack[opt] : WONT, opt);
+					session_flush();
+					if ((i == WILL) && (opt == TTYPE) && ttype_sends < TTYPE_SEND_MAX) {
 						/* WILL TTYPE? Great, let's do that now! */
-						fprintf(output, "%c%c%c%c%c%c", IAC, SB, TTYPE, SEND, IAC, SE);
-						fflush(output);
+						fwrite(ttype_send, 1, sizeof(ttype_send), output);
+						session_flush();
+						++ttype_sends;
+					} else if ((i == WILL) && (opt == NEW_ENVIRON) && !environ_pending) {
+						/* Ask for all of its variables, well-known and user defined. */
+						fwrite(environ_send, 1, sizeof(environ_send), output);
+						session_flush();
+						environ_pending = 1;
 					}
 					break;
 				case DO:
@@ -361,23 +481,26 @@ static void negotiate_telnet()
 					/* Do / Don't Negotiation */
 					opt = getc(input);
 					if (opt < 0 || opt >= (int)sizeof(telnet_options))
-						_exit(EXIT_FAILURE);
-					if (!telnet_options[opt])
-						/* We default to DONT */
-						telnet_options[opt] = DONT;
-					send_command(telnet_options[opt], opt);
+						session_exit(session_read_failure());
+					/* We default to DONT */
+					send_command(telnet_options[opt] ? telnet_options[opt] : DONT, opt);
 					if (opt == ECHO)
 						do_echo = (i == DO);
-					fflush(output);
+					session_flush();
 					break;
 				case SB:
 					/* Begin Extended Option Mode */
 					sb_mode = 1;
 					sb_len  = 0;
-					memset(sb, 0, sizeof(sb));
 					break;
 				case IAC: 
-					/* IAC IAC? That's probably not right. */
+					/* IAC IAC is an escaped 255 inside a subnegotiation. */
+					if (sb_mode) {
+						if (sb_len < (int)sizeof(sb))
+							sb[sb_len++] = IAC;
+						break;
+					}
+					/* Outside of one? That's probably not right. */
 					done = 2;
 					break;
 				default:
@@ -385,81 +508,173 @@ static void negotiate_telnet()
 			}
 		} else if (sb_mode) {
 			/* Extended Option Mode -> Accept character */
-			if (sb_len < (int)(sizeof(sb) - 1))
+			if (sb_len < (int)sizeof(sb))
 				/* Append this character to the SB string,
 				 * but only if it doesn't put us over
 				 * our limit; honestly, we shouldn't hit
 				 * the limit, as we're only collecting characters
-				 * for a terminal type or window size, but better safe than
-				 * sorry (and vulnerable).
+				 * for terminal types, window sizes and environments,
+				 * but better safe than sorry (and vulnerable).
 				 */
 				sb[sb_len++] = i;
+		} else if (cycling) {
+			/* The client has moved on to typing; leave that to readline. */
+			ungetc(i, input);
+			break;
 		}
 	}
 	
-	/* What shall we now do with term, ttype, do_echo, and terminal_width? */
+	PROBE3(negotiated, session->id, session_ms(), is_telnet_client);
+	if (is_telnet_client)
+		printf("Client %s: terminals %s, window %ux%u, user %s, display %s, environment %s\n", session->ipaddr,
+			session->client.terminals, session->client.width, session->client.height,
+			session->client.user, session->client.display, session->client.environ);
+
+	/* What shall we now do with do_echo? */
 }
 
 
-void handle_connection(int fd, char *ipaddr)
+/*
+ * The screens every session gets, rendered whenever the persona changes.
+ * NL is the telnet newline, which is why these are measured with sizeof
+ * and not strlen, and PERSONA is where the name the console goes by fits in.
+ */
+#define NL "\r\0\n"
+#define PERSONA "\001"
+#define SCREEN_MAX 2048
+
+static const char welcome_screen[] =
+	/* Attempt to set terminal title for various different terminals. */
+	"\033kWelcome to " PERSONA "\033\134"
+	"\033]1;Welcome to " PERSONA "\007"
+	"\033]2;Welcome to " PERSONA "\007"
+	/* Clear the screen */
+	"\033[H\033[2J\033[?25l"
+	"                  \033[1m" PERSONA " Administration Console\033[0m" NL NL NL
+	"This console uses \033[1;34mGoogle App Engine\033[0m for authentication. To login as" NL
+	"an administrator, enter the admin account credentials. If you do not" NL
+	"yet have an account on zx2c4, enter your \033[1m\033[34mG\033[31mo\033[33mo\033[34mg\033[32ml\033[31me\033[0m credentials to begin." NL NL NL NL;
+
+static const char invalid_screen[] =
+	NL "\033[1;31mInvalid credentials. Please try again.\033[0m";
+
+static const char retry_screen[] =
+	"\033[H\033[2J\033[?25l"
+	"                  \033[1m" PERSONA " Administration Console\033[0m" NL NL;
+
+static const char domain_hint_screen[] =
+	"\033[1;34mBe sure to include the domain in your username (e.g. @gmail.com).\033[0m" NL NL;
+
+/* In the order they are laid out, so that a retry and its hint go out together. */
+enum screen {
+	SCREEN_WELCOME,
+	SCREEN_INVALID,
+	SCREEN_RETRY,
+	SCREEN_DOMAIN_HINT,
+	SCREEN_COUNT
+};
+
+static struct {
+	const char *template;
+	size_t template_len;
+	char data[SCREEN_MAX];
+	size_t len;
+	off_t offset;		/* into screen_fd */
+} screens[SCREEN_COUNT] = {
+	[SCREEN_WELCOME] = { welcome_screen, sizeof(welcome_screen) - 1, "", 0, 0 },
+	[SCREEN_INVALID] = { invalid_screen, sizeof(invalid_screen) - 1, "", 0, 0 },
+	[SCREEN_RETRY] = { retry_screen, sizeof(retry_screen) - 1, "", 0, 0 },
+	[SCREEN_DOMAIN_HINT] = { domain_hint_screen, sizeof(domain_hint_screen) - 1, "", 0, 0 }
+};
+
+static int screen_fd = -1;
+
+/*
+ * Renders the screens for the persona, and puts them into a sealed memfd,
+ * so that sessions can sendfile() them to the peer instead of copying
+ * them through stdio. The pages are shared by every worker and session,
+ * and the seals mean none of them can change what the others send. Each
+ * session keeps the screens it was forked with, across reloads. Without
+ * memfd, we fall back to stdio.
+ */
+void prepare_screens(const char *persona)
 {
-	char username[1024];
-	char password[1024];
-	struct rlimit limit;
+	size_t persona_len = strlen(persona), i, len;
+	off_t offset = 0;
+	int fd, screen;
 
-	limit.rlim_cur = limit.rlim_max = 90;
-	setrlimit(RLIMIT_CPU, &limit);
-	limit.rlim_cur = limit.rlim_max = 0;
-	setrlimit(RLIMIT_NPROC, &limit);
+	for (screen = 0; screen < SCREEN_COUNT; ++screen) {
+		for (i = 0, len = 0; i < screens[screen].template_len; ++i) {
+			if (screens[screen].template[i] != PERSONA[0])
+				screens[screen].data[len++] = screens[screen].template[i];
+			else {
+				memcpy(screens[screen].data + len, persona, persona_len);
+				len += persona_len;
+			}
+		}
+		screens[screen].len = len;
+	}
 
-	input = fdopen(fd, "r");
-	if (!input) {
-		perror("fdopen");
-		_exit(EXIT_FAILURE);
+	if (screen_fd >= 0) {
+		close(screen_fd);
+		screen_fd = -1;
 	}
-	output = fdopen(fd, "w");
-	if (!output) {
-		perror("fdopen");
-		_exit(EXIT_FAILURE);
+	fd = memfd_create("honeypot screens", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		perror("memfd_create");
+		return;
 	}
-
-#ifdef SECCOMP
-	seccomp_enable_filter();
-#endif
-	
-	/* Set the alarm handler to quit on bad telnet clients. */
-	if (signal(SIGALRM, SIGALRM_handler) == SIG_ERR) {
-		perror("signal");
-		_exit(EXIT_FAILURE);
+	for (screen = 0; screen < SCREEN_COUNT; ++screen) {
+		if (pwrite(fd, screens[screen].data, screens[screen].len, offset) != (ssize_t)screens[screen].len) {
+			perror("pwrite");
+			close(fd);
+			return;
+		}
+		screens[screen].offset = offset;
+		offset += screens[screen].len;
 	}
-	/* Accept ^C -> restore cursor. */
-	if (signal(SIGINT, SIGINT_handler) == SIG_ERR) {
-		perror("signal");
-		_exit(EXIT_FAILURE);
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+		perror("fcntl(F_ADD_SEALS)");
+		close(fd);
+		return;
 	}
+	screen_fd = fd;
+}
 
-	negotiate_telnet();
-	
-	/* Quit after a minute and a half. */
-	alarm(90);
+/*
+ * Sends the screens from first to last, which sit next to each other in
+ * the memfd, after whatever stdio still has buffered.
+ */
+static void send_screens(enum screen first, enum screen last)
+{
+	int i;
 
-	/* Attempt to set terminal title for various different terminals. */
-	fprintf(output, "\033kWelcome to zx2c4.com\033\134");
-	fprintf(output, "\033]1;Welcome to zx2c4.com\007");
-	fprintf(output, "\033]2;Welcome to zx2c4.com\007");
+	if (screen_fd < 0) {
+		for (i = first; i <= (int)last; ++i)
+			fwrite(screens[i].data, 1, screens[i].len, output);
+		session_flush();
+		return;
+	}
+	session_sendfile(screen_fd, screens[first].offset, screens[last].offset + screens[last].len - screens[first].offset);
+}
 
-	/* Clear the screen */
-	fprintf(output, "\033[H\033[2J\033[?25l");
-	
-	fprintf(output, "                  \033[1mzx2c4.com Administration Console\033[0m");
-	newline(3);
-	fprintf(output, "This console uses \033[1;34mGoogle App Engine\033[0m for authentication. To login as");
-	newline(1);
-	fprintf(output, "an administrator, enter the admin account credentials. If you do not");
-	newline(1);
-	fprintf(output, "yet have an account on zx2c4, enter your \033[1m\033[34mG\033[31mo\033[33mo\033[34mg\033[32ml\033[31me\033[0m credentials to begin.");
-	newline(4);
-	fflush(output);
+/*
+ * Negotiates, and then asks for credentials until the alarm goes off.
+ */
+static void telnet_serve(struct session *new_session, FILE *new_input, FILE *new_output)
+{
+	char username[1024];
+	char password[1024];
+
+	session = new_session;
+	policy = &session->policy;
+	input = new_input;
+	output = new_output;
+
+	negotiate_telnet();
+	session_login();
+
+	send_screens(SCREEN_WELCOME, SCREEN_WELCOME);
 	
 	while (1) {
 		fprintf(output, "\033[1;32mUsername: \033[0m");
@@ -467,25 +682,21 @@ void handle_connection(int fd, char *ipaddr)
 		fprintf(output, "\033[1;32mPassword: \033[0m");
 		readline(password, sizeof(password), 1);
 		newline(2);
-		fflush(output);
-		fprintf(logfile, "%s - %s:%s\n", ipaddr, username, password);
-		fflush(logfile);
-		printf("Honeypotted: %s - %s:%s\n", ipaddr, username, password);
-		sleep(1);
-		newline(1);
-		fprintf(output, "\033[1;31mInvalid credentials. Please try again.\033[0m");
-		fflush(output);
-		sleep(2);
-		fprintf(output, "\033[H\033[2J\033[?25l");
-		fprintf(output, "                  \033[1mzx2c4.com Administration Console\033[0m");
-		newline(2);
-		if (!strchr(username, '@')) {
-			fprintf(output, "\033[1;34mBe sure to include the domain in your username (e.g. @gmail.com).\033[0m");
-			newline(2);
-		}
-		fflush(output);
+		session_flush();
+		session_credential(username, password);
+		send_screens(SCREEN_INVALID, SCREEN_INVALID);
+		session_tarpit(policy->retry_delay);
+		if (!strchr(username, '@'))
+			send_screens(SCREEN_RETRY, SCREEN_DOMAIN_HINT);
+		else
+			send_screens(SCREEN_RETRY, SCREEN_RETRY);
 	}
-	fclose(input);
-	fclose(output);
 }
 
+const struct protocol telnet_protocol = {
+	.name = "telnet",
+	.port = 23,
+	.serve = telnet_serve,
+	.timeout = telnet_timeout,
+	.shutdown = telnet_shutdown
+};
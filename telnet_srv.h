@@ -2,9 +2,72 @@
 #define TELNET_SRV_H
 
 #include <stdio.h>
+#include <time.h>
+#include <netinet/in.h>
 
-extern FILE *logfile;
+#include "geo.h"
+#include "protocol.h"
 
-void handle_connection(int fd, char *ipaddr);
+/*
+ * Exit codes of the session children, so that the listener
+ * can tell why a session ended.
+ */
+#define SESSION_CLOSED		0	/* the peer went away, or we hung up on it */
+#define SESSION_FAILED		1	/* something went wrong on our side, or a bad client */
+#define SESSION_IDLE		3	/* the peer stopped talking to us */
+#define SESSION_DEAD_PEER	4	/* the kernel gave up on the peer */
+
+/*
+ * How long we wait on a peer before reclaiming its session, for one
+ * phase of the session. Times are in seconds, except user_timeout.
+ */
+struct phase_policy {
+	int idle;		/* without any input from the peer */
+	int keepalive_idle;	/* before the first keepalive probe */
+	int keepalive_interval;	/* between keepalive probes */
+	int keepalive_count;	/* unanswered probes before the peer is dead */
+	int user_timeout;	/* ms that sent data may stay unacknowledged */
+};
+
+struct session_policy {
+	struct phase_policy negotiate;
+	struct phase_policy login;
+	int negotiate_timeout;	/* seconds to come up with a terminal type */
+	int session_timeout;	/* seconds for the whole login */
+	int reply_delay;	/* ms before we reject a password */
+	int retry_delay;	/* ms before we ask again */
+};
+
+/*
+ * What the client told us about itself during negotiation. Bots give a
+ * lot away here. Strings are truncated to fit, and empty when not sent.
+ */
+struct client_info {
+	char terminals[64];	/* every terminal type it cycled through, comma separated */
+	char user[32];		/* USER from NEW-ENVIRON */
+	char display[64];	/* DISPLAY from NEW-ENVIRON */
+	char environ[128];	/* any other variables, as NAME=VALUE separated by spaces */
+	unsigned short width, height;	/* from NAWS */
+};
+
+/*
+ * Everything the listener knows about a connection when it hands it
+ * over to a session.
+ */
+struct session {
+	unsigned long long id;
+	int fd;
+	char ipaddr[INET6_ADDRSTRLEN];
+	struct timespec start;	/* CLOCK_MONOTONIC, when we accepted it */
+	struct geo geo;		/* with --geo */
+	struct session_policy policy;
+	const struct protocol *protocol;	/* what is spoken on the port it came in on */
+	int listener;		/* which of the listeners that port is */
+	int port;
+	struct client_info client;	/* filled in by the session itself */
+	unsigned int visits;	/* sessions its source has had, this one included; 0 unless counted */
+};
+
+void prepare_screens(const char *persona);
 
 #endif
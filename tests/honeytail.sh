@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# Checks that honeytail's globs match what fnmatch would, in attempt lines
+# and in the attempt lists of session records, in particular the bracket
+# expressions that the literal prefilter has to step over, and in the
+# port= and persona= tokens that honeylog writes.
+#
+# Usage: tests/honeytail.sh (from the top of the tree, after make)
+#
+
+log="$(mktemp)"
+failed=0
+
+printf '2026-10-17 05:11:35.060 198.51.100.7 - admin:1234\tsession=1\tport=23\tpersona=router\n' > "$log"
+printf '2026-10-17 05:11:35.060 198.51.100.7 - root:1234\tsession=2\tport=2323\tpersona=router\n' >> "$log"
+printf '2026-10-17 05:11:45.060 198.51.100.8 - session\tsession=3\tattempts=1\tcreds=guest:12345\tport=23\tpersona=camera\n' >> "$log"
+
+# expect OPTION SESSIONS: the session ids of the records honeytail OPTION prints
+expect() {
+	got="$(timeout 1 ./honeytail --from-start "$1" "$log" | sed 's/.*session=\([0-9]*\).*/\1/' | tr '\n' ' ')"
+	if [ "$got" != "$2" ]; then
+		echo "$1 printed sessions '$got', expected '$2'"
+		failed=1
+	fi
+}
+
+expect --username='admin' '1 '
+expect --username='adm[io]n' '1 '
+expect --username='adm[!x]n' '1 '
+expect --username='adm[]io]n' '1 '
+expect --username='a[[:alpha:]]min' '1 '
+expect --username='[ar]*' '1 2 '
+expect --username='gu[e]st' '3 '
+expect --username='adm[x]n' ''
+expect --match=port=23 '1 3 '
+expect --match='port=2[3]2*' '2 '
+expect --match='persona=r*' '1 2 '
+expect --match=persona=camera '3 '
+
+rm -f "$log"
+[ $failed = 0 ] && echo "honeytail: all filters matched as expected."
+exit $failed